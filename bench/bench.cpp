@@ -0,0 +1,508 @@
+// Benchmarks of tgafunc_cpp, on synthetic images of several sizes, pixel
+// formats and contents, and on the test images.
+//
+// Pass --benchmark_format=json, or --benchmark_out=<file>, for machine
+// readable results. bytes_per_second counts decoded pixel bytes and
+// items_per_second counts pixels, whatever the size of the file.
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "tgafunc_cpp.h"
+
+namespace {
+
+using tga::tga_pixel_format;
+
+struct format_case {
+    const char *name;
+    tga_pixel_format format;
+};
+
+const format_case format_cases[] = {
+    {"BW8", tga_pixel_format::TGA_PIXEL_BW8},
+    {"RGB555", tga_pixel_format::TGA_PIXEL_RGB555},
+    {"RGB24", tga_pixel_format::TGA_PIXEL_RGB24},
+    {"ARGB32", tga_pixel_format::TGA_PIXEL_ARGB32}};
+
+const int sizes[] = {64, 512, 2048};
+
+const unsigned thread_counts[] = {1, 2, 4, 8};
+
+const char *image_names[] = {"CBW8.TGA",  "CCM8.TGA",  "CTC16.TGA", "CTC24.TGA",
+                             "CTC32.TGA", "UBW8.TGA",  "UCM8.TGA",  "UTC16.TGA",
+                             "UTC24.TGA", "UTC32.TGA"};
+
+const std::pair<const char *, tga::ResampleFilter> filters[] = {
+    {"box", tga::ResampleFilter::BOX},
+    {"triangle", tga::ResampleFilter::TRIANGLE},
+    {"cubic", tga::ResampleFilter::CUBIC},
+    {"lanczos3", tga::ResampleFilter::LANCZOS3}};
+
+// Thumbnails are made at this size, in both directions.
+const int thumbnail_size = 256;
+
+enum class content {
+    // Runs of 32 equal pixels, out of less than 256 colors: the best case of
+    // RLE and of the exact palette.
+    FLAT,
+    // Random pixels: no runs, and a palette has to be quantized.
+    NOISE
+};
+
+tga::Image make_image(int size, tga_pixel_format format, content kind) {
+    tga::Image img(size, size, format);
+    uint8_t *data = img.get_raw_data();
+    int pixel_size = img.get_pixel_size();
+    std::mt19937 rng(size);
+    for (int y = 0; y < size; ++y) {
+        for (int x = 0; x < size; ++x) {
+            uint8_t *pixel = data + ((size_t)y * size + x) * pixel_size;
+            uint32_t color = ((x / 32) * 37 + (y / 8) * 11) % 200;
+            for (int i = 0; i < pixel_size; ++i) {
+                pixel[i] = kind == content::FLAT
+                               ? (uint8_t)(color * (i + 1) * 29)
+                               : (uint8_t)rng();
+            }
+        }
+    }
+    return img;
+}
+
+std::vector<uint8_t> encode(tga::Image img, bool rle, bool color_mapped) {
+    tga::SaveOptions options;
+    options.rle = rle;
+    options.color_mapped = color_mapped;
+    std::vector<uint8_t> encoded;
+    img.save_to_memory(encoded, options);
+    return encoded;
+}
+
+std::vector<uint8_t> read_file(const std::string &filepath) {
+    std::vector<uint8_t> contents;
+    FILE *file = fopen(filepath.c_str(), "rb");
+    if (file == nullptr) {
+        return contents;
+    }
+    uint8_t block[65536];
+    size_t count;
+    while ((count = fread(block, 1, sizeof(block), file)) > 0) {
+        contents.insert(contents.end(), block, block + count);
+    }
+    fclose(file);
+    return contents;
+}
+
+void set_counters(benchmark::State &state, const tga::Image &img) {
+    state.SetItemsProcessed(state.iterations() * img.get_width() *
+                            img.get_height());
+    state.SetBytesProcessed(state.iterations() * img.get_data().size());
+}
+
+void register_load(const std::string &name,
+                   std::shared_ptr<const std::vector<uint8_t>> encoded,
+                   unsigned thread_count) {
+    auto *bench = benchmark::RegisterBenchmark(
+        name.c_str(), [encoded, thread_count](benchmark::State &state) {
+            tga::ExecutionPolicy policy{thread_count};
+            tga::Image img;
+            tga::reset_allocation_counters();
+            for (auto _ : state) {
+                if (!img.load_from_memory(encoded->data(), encoded->size(),
+                                          tga::LoadOptions{}, policy)) {
+                    state.SkipWithError("load failed");
+                    break;
+                }
+            }
+            set_counters(state, img);
+            // Allocations per load, only the first load into img should
+            // allocate.
+            state.counters["allocations"] = benchmark::Counter(
+                (double)tga::get_allocation_counters().allocations,
+                benchmark::Counter::kAvgIterations);
+        });
+    if (thread_count > 1) {
+        bench->UseRealTime();
+    }
+}
+
+void register_save(const std::string &name,
+                   std::shared_ptr<const tga::Image> source, bool rle,
+                   unsigned thread_count) {
+    auto *bench = benchmark::RegisterBenchmark(
+        name.c_str(), [source, rle, thread_count](benchmark::State &state) {
+            tga::ExecutionPolicy policy{thread_count};
+            tga::SaveOptions options;
+            options.rle = rle;
+            tga::Image img = *source;
+            std::vector<uint8_t> encoded;
+            for (auto _ : state) {
+                if (!img.save_to_memory(encoded, options, policy)) {
+                    state.SkipWithError("save failed");
+                    break;
+                }
+            }
+            set_counters(state, img);
+            // Size of the file over the size of the pixels.
+            state.counters["size_ratio"] =
+                (double)encoded.size() / img.get_data().size();
+        });
+    if (thread_count > 1) {
+        bench->UseRealTime();
+    }
+}
+
+void register_flip(const std::string &name,
+                   std::shared_ptr<const tga::Image> source, bool vertical,
+                   unsigned thread_count) {
+    auto *bench = benchmark::RegisterBenchmark(
+        name.c_str(),
+        [source, vertical, thread_count](benchmark::State &state) {
+            tga::ExecutionPolicy policy{thread_count};
+            tga::Image img = *source;
+            for (auto _ : state) {
+                if (vertical) {
+                    img.flip_v(policy);
+                } else {
+                    img.flip_h(policy);
+                }
+                benchmark::ClobberMemory();
+            }
+            set_counters(state, img);
+        });
+    if (thread_count > 1) {
+        bench->UseRealTime();
+    }
+}
+
+void register_synthetic() {
+    for (int size : sizes) {
+        for (const auto &format_case : format_cases) {
+            std::string shape = std::string("/") + format_case.name + "/" +
+                                std::to_string(size) + "x" +
+                                std::to_string(size);
+            bool is_grayscale =
+                format_case.format == tga_pixel_format::TGA_PIXEL_BW8;
+            for (content kind : {content::FLAT, content::NOISE}) {
+                std::string suffix =
+                    shape + (kind == content::FLAT ? "/flat" : "/noise");
+                auto img = std::make_shared<const tga::Image>(
+                    make_image(size, format_case.format, kind));
+                register_load("load/rle" + suffix,
+                              std::make_shared<const std::vector<uint8_t>>(
+                                  encode(*img, true, false)),
+                              1);
+                register_save("save/rle" + suffix, img, true, 1);
+                // Grayscale images are never saved color mapped.
+                if (!is_grayscale) {
+                    register_load("load/mapped" + suffix,
+                                  std::make_shared<const std::vector<uint8_t>>(
+                                      encode(*img, false, true)),
+                                  1);
+                }
+                if (kind == content::FLAT) {
+                    continue;
+                }
+                // The rest doesn't depend on the content.
+                register_load("load/raw" + suffix,
+                              std::make_shared<const std::vector<uint8_t>>(
+                                  encode(*img, false, false)),
+                              1);
+                register_save("save/raw" + suffix, img, false, 1);
+                register_flip("flip_h" + suffix, img, false, 1);
+                register_flip("flip_v" + suffix, img, true, 1);
+            }
+        }
+    }
+}
+
+// The operations that split the rows in bands, on the largest image.
+void register_thread_scaling() {
+    int size = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+    auto img = std::make_shared<const tga::Image>(make_image(
+        size, tga_pixel_format::TGA_PIXEL_ARGB32, content::NOISE));
+    auto raw = std::make_shared<const std::vector<uint8_t>>(
+        encode(*img, false, false));
+    auto rle =
+        std::make_shared<const std::vector<uint8_t>>(encode(*img, true, false));
+    std::string suffix = "/ARGB32/" + std::to_string(size) + "x" +
+                         std::to_string(size) + "/noise/threads:";
+    for (unsigned thread_count : thread_counts) {
+        std::string threads = std::to_string(thread_count);
+        register_load("load/raw" + suffix + threads, raw, thread_count);
+        register_load("load/rle" + suffix + threads, rle, thread_count);
+        register_save("save/rle" + suffix + threads, img, true, thread_count);
+        register_flip("flip_h" + suffix + threads, img, false, thread_count);
+        register_flip("flip_v" + suffix + threads, img, true, thread_count);
+    }
+}
+
+// A per-pixel filter, inverting the colors, written against the checked
+// Image::get_pixel and against TypedImage.
+void register_pixel_access() {
+    int size = 512;
+    auto source = std::make_shared<const tga::Image>(make_image(
+        size, tga_pixel_format::TGA_PIXEL_ARGB32, content::NOISE));
+    std::string suffix = "/ARGB32/" + std::to_string(size) + "x" +
+                         std::to_string(size);
+    benchmark::RegisterBenchmark(
+        ("pixel_access/get_pixel" + suffix).c_str(),
+        [source](benchmark::State &state) {
+            tga::Image img = *source;
+            for (auto _ : state) {
+                for (int y = 0; y < img.get_height(); ++y) {
+                    for (int x = 0; x < img.get_width(); ++x) {
+                        uint8_t *pixel = img.get_pixel(x, y);
+                        for (int i = 0; i < 3; ++i) {
+                            pixel[i] = 255 - pixel[i];
+                        }
+                    }
+                }
+                benchmark::ClobberMemory();
+            }
+            set_counters(state, img);
+        });
+    benchmark::RegisterBenchmark(
+        ("pixel_access/typed" + suffix).c_str(),
+        [source](benchmark::State &state) {
+            tga::Image img = *source;
+            tga::TypedImage<tga_pixel_format::TGA_PIXEL_ARGB32> pixels(img);
+            for (auto _ : state) {
+                for (auto row : pixels) {
+                    for (tga::Bgra32 &pixel : row) {
+                        pixel.b = 255 - pixel.b;
+                        pixel.g = 255 - pixel.g;
+                        pixel.r = 255 - pixel.r;
+                    }
+                }
+                benchmark::ClobberMemory();
+            }
+            set_counters(state, img);
+        });
+}
+
+void register_mipmaps(const std::string &name,
+                      std::shared_ptr<const tga::Image> source,
+                      const tga::MipmapOptions &options,
+                      unsigned thread_count) {
+    auto *bench = benchmark::RegisterBenchmark(
+        name.c_str(),
+        [source, options, thread_count](benchmark::State &state) {
+            tga::ExecutionPolicy policy{thread_count};
+            tga::Image img = *source;
+            std::vector<tga::Image> levels;
+            for (auto _ : state) {
+                if (tga::generate_mipmaps(img.get_view(), levels, options,
+                                          policy) !=
+                    tga::tga_error::TGA_NO_ERROR) {
+                    state.SkipWithError("generate_mipmaps failed");
+                    break;
+                }
+            }
+            // Counted in pixels of the source image.
+            set_counters(state, img);
+        });
+    if (thread_count > 1) {
+        bench->UseRealTime();
+    }
+}
+
+// Full mip chains of the largest image, per format, filter and option, then
+// with more threads.
+void register_mipmap_chains() {
+    int size = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+    std::string shape = std::to_string(size) + "x" + std::to_string(size);
+    for (const auto &format_case : format_cases) {
+        auto img = std::make_shared<const tga::Image>(
+            make_image(size, format_case.format, content::NOISE));
+        std::string suffix =
+            std::string("/") + format_case.name + "/" + shape + "/noise";
+        for (const auto &filter : filters) {
+            tga::MipmapOptions options;
+            options.filter = filter.second;
+            register_mipmaps(std::string("mipmaps/") + filter.first + suffix,
+                             img, options, 1);
+        }
+    }
+
+    auto img = std::make_shared<const tga::Image>(make_image(
+        size, tga_pixel_format::TGA_PIXEL_ARGB32, content::NOISE));
+    std::string suffix = "/ARGB32/" + shape + "/noise";
+    tga::MipmapOptions options;
+    options.gamma_correct = true;
+    register_mipmaps("mipmaps/box/gamma" + suffix, img, options, 1);
+    options.alpha_weighted = true;
+    register_mipmaps("mipmaps/box/gamma+alpha" + suffix, img, options, 1);
+    for (unsigned thread_count : thread_counts) {
+        register_mipmaps("mipmaps/box" + suffix + "/threads:" +
+                             std::to_string(thread_count),
+                         img, tga::MipmapOptions{}, thread_count);
+    }
+}
+
+void register_resize(const std::string &name,
+                     std::shared_ptr<const tga::Image> source,
+                     tga::ResampleFilter filter, unsigned thread_count) {
+    auto *bench = benchmark::RegisterBenchmark(
+        name.c_str(), [source, filter, thread_count](benchmark::State &state) {
+            tga::ExecutionPolicy policy{thread_count};
+            tga::Image thumbnail(thumbnail_size, thumbnail_size,
+                                 source->get_pixel_format());
+            tga::Image img = *source;
+            for (auto _ : state) {
+                if (tga::resize(thumbnail.get_view(), img.get_view(), filter,
+                                policy) != tga::tga_error::TGA_NO_ERROR) {
+                    state.SkipWithError("resize failed");
+                    break;
+                }
+            }
+            // Counted in pixels of the source image.
+            set_counters(state, img);
+        });
+    if (thread_count > 1) {
+        bench->UseRealTime();
+    }
+}
+
+// Thumbnails of the largest image, per format and filter, then with more
+// threads. Thumbnails of a file, loaded in full then resized, against
+// loaded resized.
+void register_thumbnails() {
+    int size = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+    std::string shape = std::to_string(size) + "x" + std::to_string(size);
+    for (const auto &format_case : format_cases) {
+        auto img = std::make_shared<const tga::Image>(
+            make_image(size, format_case.format, content::NOISE));
+        std::string suffix =
+            std::string("/") + format_case.name + "/" + shape + "/noise";
+        for (const auto &filter : filters) {
+            register_resize(std::string("resize/") + filter.first + suffix,
+                            img, filter.second, 1);
+        }
+    }
+
+    auto img = std::make_shared<const tga::Image>(make_image(
+        size, tga_pixel_format::TGA_PIXEL_ARGB32, content::NOISE));
+    std::string suffix = "/ARGB32/" + shape + "/noise";
+    for (unsigned thread_count : thread_counts) {
+        register_resize("resize/cubic" + suffix + "/threads:" +
+                            std::to_string(thread_count),
+                        img, tga::ResampleFilter::CUBIC, thread_count);
+    }
+
+    for (bool rle : {false, true}) {
+        auto encoded = std::make_shared<const std::vector<uint8_t>>(
+            encode(*img, rle, false));
+        std::string kind = rle ? "rle" : "raw";
+        benchmark::RegisterBenchmark(
+            ("thumbnail/load+resize/" + kind + suffix).c_str(),
+            [encoded](benchmark::State &state) {
+                tga::Image full;
+                tga::Image thumbnail;
+                for (auto _ : state) {
+                    full.load_from_memory(encoded->data(), encoded->size());
+                    thumbnail = tga::resize(full, thumbnail_size,
+                                            thumbnail_size);
+                }
+                set_counters(state, full);
+            });
+        benchmark::RegisterBenchmark(
+            ("thumbnail/load_resized/" + kind + suffix).c_str(),
+            [encoded, img](benchmark::State &state) {
+                tga::Image thumbnail;
+                for (auto _ : state) {
+                    if (!thumbnail.load_resized_from_memory(
+                            encoded->data(), encoded->size(), thumbnail_size,
+                            thumbnail_size)) {
+                        state.SkipWithError("load_resized failed");
+                        break;
+                    }
+                }
+                set_counters(state, *img);
+            });
+    }
+}
+
+// Decoding as the file arrives, in chunks the size of a network packet and
+// of a socket read, against loading it whole.
+void register_incremental() {
+    int size = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+    auto img = std::make_shared<const tga::Image>(make_image(
+        size, tga_pixel_format::TGA_PIXEL_ARGB32, content::NOISE));
+    std::string suffix = "/ARGB32/" + std::to_string(size) + "x" +
+                         std::to_string(size) + "/noise";
+    for (bool rle : {false, true}) {
+        auto encoded = std::make_shared<const std::vector<uint8_t>>(
+            encode(*img, rle, false));
+        std::string kind = rle ? "rle" : "raw";
+        for (size_t chunk_size : {(size_t)1500, (size_t)65536}) {
+            benchmark::RegisterBenchmark(
+                ("incremental/" + kind + suffix +
+                 "/chunk:" + std::to_string(chunk_size))
+                    .c_str(),
+                [encoded, img, chunk_size](benchmark::State &state) {
+                    tga::IncrementalDecoder decoder;
+                    for (auto _ : state) {
+                        decoder.reset();
+                        for (size_t pos = 0; pos < encoded->size();
+                             pos += chunk_size) {
+                            size_t count = std::min(chunk_size,
+                                                    encoded->size() - pos);
+                            decoder.feed(encoded->data() + pos, count);
+                        }
+                        if (!decoder.finish()) {
+                            state.SkipWithError("decode failed");
+                            break;
+                        }
+                    }
+                    set_counters(state, *img);
+                });
+        }
+    }
+}
+
+// Loads each test image, and saves it raw and with RLE.
+void register_corpus() {
+    for (const char *name : image_names) {
+        std::vector<uint8_t> contents =
+            read_file(std::string(TGAFUNC_BENCH_IMAGES) + name);
+        if (contents.size() < 18) {
+            fprintf(stderr, "Cannot read %s%s\n", TGAFUNC_BENCH_IMAGES, name);
+            continue;
+        }
+        register_load(std::string("corpus/load/") + name,
+                      std::make_shared<const std::vector<uint8_t>>(contents),
+                      1);
+        auto img = std::make_shared<tga::Image>();
+        img->load_from_memory(contents.data(), contents.size());
+        register_save(std::string("corpus/save/raw/") + name, img, false, 1);
+        register_save(std::string("corpus/save/rle/") + name, img, true, 1);
+    }
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    register_synthetic();
+    register_thread_scaling();
+    register_pixel_access();
+    register_mipmap_chains();
+    register_thumbnails();
+    register_incremental();
+    register_corpus();
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,1510 @@
+// The checks are asserts, keep them in release builds.
+#undef NDEBUG
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <filesystem>
+
+#include "tgafunc_cpp.h"
+
+static std::vector<uint8_t> read_file(const char* path) {
+    FILE* file = fopen(path, "rb");
+    assert(file != NULL);
+    std::vector<uint8_t> contents;
+    uint8_t block[4096];
+    size_t count;
+    while ((count = fread(block, 1, sizeof(block), file)) > 0) {
+        contents.insert(contents.end(), block, block + count);
+    }
+    fclose(file);
+    return contents;
+}
+
+static void write_file(const char* path, const std::vector<uint8_t>& contents) {
+    FILE* file = fopen(path, "wb");
+    assert(file != NULL);
+    assert(fwrite(contents.data(), 1, contents.size(), file) ==
+           contents.size());
+    fclose(file);
+}
+
+static void create_test(void) {
+    using namespace tga;
+
+    int size = 4;
+    int oversize = 65535 + 1;
+
+    // image size cannot be less than 1.
+    {
+        Image img(0, size, tga_pixel_format::TGA_PIXEL_RGB24);
+        assert(img.last_error() ==
+               tga_error::TGA_ERROR_INVALID_IMAGE_DIMENSIONS);
+    }
+
+    {
+        Image img(size, 0, tga_pixel_format::TGA_PIXEL_RGB24);
+        assert(img.last_error() ==
+               tga_error::TGA_ERROR_INVALID_IMAGE_DIMENSIONS);
+    }
+
+    {
+        Image img(-1, size, tga_pixel_format::TGA_PIXEL_RGB24);
+        assert(img.last_error() ==
+               tga_error::TGA_ERROR_INVALID_IMAGE_DIMENSIONS);
+    }
+
+    {
+        Image img(size, -1, tga_pixel_format::TGA_PIXEL_RGB24);
+        assert(img.last_error() ==
+               tga_error::TGA_ERROR_INVALID_IMAGE_DIMENSIONS);
+    }
+
+    // Image size cannot be greater than TGA_MAX_IMAGE_DIMENSISNS.
+    {
+        Image img(oversize, size, tga_pixel_format::TGA_PIXEL_RGB24);
+        assert(img.last_error() ==
+               tga_error::TGA_ERROR_INVALID_IMAGE_DIMENSIONS);
+    }
+
+    {
+        Image img(size, oversize, tga_pixel_format::TGA_PIXEL_RGB24);
+        assert(img.last_error() ==
+               tga_error::TGA_ERROR_INVALID_IMAGE_DIMENSIONS);
+    }
+
+    // Wrong pixel format check. The image holds no pixels and keeps the
+    // error.
+    {
+        Image img(size, size, static_cast<tga_pixel_format>(100));
+        assert(img.last_error() ==
+               tga_error::TGA_ERROR_UNSUPPORTED_PIXEL_FORMAT);
+        assert(img.get_data().empty());
+        assert(img.get_raw_data() == NULL);
+        assert(img.last_error() ==
+               tga_error::TGA_ERROR_UNSUPPORTED_PIXEL_FORMAT);
+    }
+
+    // This time it should have succeeded.
+    {
+        Image img(size, size, tga_pixel_format::TGA_PIXEL_RGB24);
+        assert(img.last_error() == tga_error::TGA_NO_ERROR);
+        assert(img.get_width() == size);
+        assert(img.get_height() == size);
+        assert(img.get_pixel_format() == tga_pixel_format::TGA_PIXEL_RGB24);
+        assert(img.get_pixel_size() == 3);
+    }
+}
+
+static void load_test(void) {
+    using namespace tga;
+
+    const int image_size = 128;
+    // CMake copies the images next to the test, which runs from there.
+    const char image_path[] = "images/";
+    const char* image_name_list[] = {
+        "CBW8.TGA", "CCM8.TGA", "CTC16.TGA", "CTC24.TGA", "CTC32.TGA",
+        "UBW8.TGA", "UCM8.TGA", "UTC16.TGA", "UTC24.TGA", "UTC32.TGA"};
+    tga_pixel_format pixel_format_list[] = {
+        tga_pixel_format::TGA_PIXEL_BW8,    tga_pixel_format::TGA_PIXEL_RGB555,
+        tga_pixel_format::TGA_PIXEL_RGB555, tga_pixel_format::TGA_PIXEL_RGB24,
+        tga_pixel_format::TGA_PIXEL_ARGB32, tga_pixel_format::TGA_PIXEL_BW8,
+        tga_pixel_format::TGA_PIXEL_RGB555, tga_pixel_format::TGA_PIXEL_RGB555,
+        tga_pixel_format::TGA_PIXEL_RGB24,  tga_pixel_format::TGA_PIXEL_ARGB32};
+
+    char image_name[128];
+
+    // Test the loading correctness of RLE images.
+    int image_count = sizeof(image_name_list) / sizeof(image_name_list[0]);
+    int group_size = image_count / 2;
+    for (int i = 0; i < group_size; i++) {
+        Image pair[2];
+        for (int j = 0; j < 2; j++) {
+            int list_index = j * group_size + i;
+            // Create file name.
+            memcpy(image_name, image_path, sizeof(image_path));
+            strcat(image_name, image_name_list[list_index]);
+            // Load the image and check the image information.
+            Image img(image_name);
+            auto error_code = img.last_error();
+            assert(error_code == tga_error::TGA_NO_ERROR);
+
+            if (img.get_width() != image_size ||
+                img.get_height() != image_size ||
+                img.get_pixel_format() != pixel_format_list[list_index]) {
+                // The loaded image information is wrong.
+                assert(0);
+            }
+            pair[j] = std::move(img);
+        }
+        // The RLE image and the uncompressed one hold the same pixels.
+        assert(pair[0].get_data() == pair[1].get_data());
+    }
+}
+
+static void mapped_test(void) {
+    using namespace tga;
+
+    // The same pixels stored from each origin, as told by bits 4 and 5 of
+    // the image descriptor.
+    std::vector<uint8_t> contents = read_file("images/UTC24.TGA");
+    for (int origin = 0; origin < 4; origin++) {
+        contents[17] = (uint8_t)((contents[17] & ~0x30) | (origin << 4));
+        write_file("mapped.tga", contents);
+        Image img("mapped.tga");
+        MappedImage mapped("mapped.tga");
+        assert(mapped.last_error() == tga_error::TGA_NO_ERROR);
+        assert(mapped.get_width() == img.get_width());
+        assert(mapped.get_height() == img.get_height());
+        assert(mapped.get_pixel_format() == img.get_pixel_format());
+        for (int y = 0; y < img.get_height(); y++) {
+            for (int x = 0; x < img.get_width(); x++) {
+                assert(memcmp(mapped.get_pixel(x, y), img.get_pixel(x, y),
+                              3) == 0);
+            }
+            assert(mapped.get_row(y) == mapped.get_pixel(0, y));
+        }
+    }
+    remove("mapped.tga");
+
+    // Only uncompressed true-color and grayscale files can be mapped.
+    MappedImage rle("images/CTC24.TGA");
+    assert(rle.last_error() == tga_error::TGA_ERROR_UNSUPPORTED_IMAGE_TYPE);
+    assert(rle.get_raw_data() == NULL);
+    MappedImage color_mapped("images/UCM8.TGA");
+    assert(color_mapped.last_error() ==
+           tga_error::TGA_ERROR_UNSUPPORTED_IMAGE_TYPE);
+}
+
+static void memory_test(void) {
+    using namespace tga;
+
+    const char* paths[] = {"images/CBW8.TGA", "images/CCM8.TGA",
+                           "images/CTC16.TGA", "images/UTC24.TGA",
+                           "images/UTC32.TGA"};
+    for (const char* path : paths) {
+        Image expected(path);
+        std::vector<uint8_t> contents = read_file(path);
+
+        Image img;
+        assert(img.load_from_memory(contents.data(), contents.size()));
+        assert(img.get_data() == expected.get_data());
+
+        // A reader that hands out a few bytes at a time.
+        size_t pos = 0;
+        tga_reader reader;
+        reader.read = [&](uint8_t* dest, size_t size) {
+            size_t count = 1 + pos % 7;
+            count = count < size ? count : size;
+            count = count < contents.size() - pos ? count
+                                                   : contents.size() - pos;
+            memcpy(dest, contents.data() + pos, count);
+            pos += count;
+            return count;
+        };
+        Image streamed;
+        assert(streamed.load(reader));
+        assert(streamed.get_data() == expected.get_data());
+
+        // A source that ends in the middle of the pixels.
+        pos = 0;
+        contents.resize(1000);
+        assert(!streamed.load(reader));
+        assert(streamed.last_error() ==
+               tga_error::TGA_ERROR_FILE_CANNOT_READ);
+
+        // Saving to memory and through a writer gives the same file, which
+        // loads back the same pixels.
+        SaveOptions options;
+        options.rle = path[7] == 'C';
+        std::vector<uint8_t> saved;
+        assert(img.save_to_memory(saved, options));
+        std::vector<uint8_t> written;
+        tga_writer writer;
+        writer.write = [&](const uint8_t* src, size_t size) {
+            written.insert(written.end(), src, src + size);
+            return true;
+        };
+        assert(img.save(writer, options));
+        assert(written == saved);
+        Image reloaded;
+        assert(reloaded.load_from_memory(saved.data(), saved.size()));
+        assert(reloaded.get_data() == expected.get_data());
+
+        // A writer that fails.
+        writer.write = [](const uint8_t*, size_t) { return false; };
+        assert(!img.save(writer, options));
+        assert(img.last_error() == tga_error::TGA_ERROR_FILE_CANNOT_WRITE);
+    }
+
+    Image img;
+    assert(!img.load_from_memory(NULL, 0));
+    assert(img.last_error() == tga_error::TGA_ERROR_FILE_CANNOT_READ);
+}
+
+// Loads each file twice into the same Image: once the pixel buffer and the
+// scratch memory have grown, reloading allocates nothing.
+static void reuse_test(void) {
+    using namespace tga;
+
+    const char* paths[] = {"images/CBW8.TGA",  "images/CCM8.TGA",
+                           "images/CTC16.TGA", "images/CTC24.TGA",
+                           "images/CTC32.TGA", "images/UBW8.TGA",
+                           "images/UCM8.TGA",  "images/UTC16.TGA",
+                           "images/UTC24.TGA", "images/UTC32.TGA"};
+    for (const char* path : paths) {
+        std::vector<uint8_t> contents = read_file(path);
+        Image img;
+        reset_allocation_counters();
+        assert(img.load_from_memory(contents.data(), contents.size()));
+        assert(img.load(path));
+        assert(get_allocation_counters().allocations > 0);
+
+        reset_allocation_counters();
+        assert(img.load_from_memory(contents.data(), contents.size()));
+        assert(img.load(path));
+        AllocationCounters counters = get_allocation_counters();
+        assert(counters.allocations == 0);
+        assert(counters.bytes == 0);
+    }
+
+    // The same, for an RLE file decoded in bands.
+    Image big(1024, 600, tga_pixel_format::TGA_PIXEL_RGB24);
+    SaveOptions options;
+    options.rle = true;
+    std::vector<uint8_t> encoded;
+    assert(big.save_to_memory(encoded, options));
+    Image img;
+    assert(img.load_from_memory(encoded.data(), encoded.size(), {},
+                                ExecutionPolicy{4}));
+    reset_allocation_counters();
+    assert(img.load_from_memory(encoded.data(), encoded.size(), {},
+                                ExecutionPolicy{4}));
+    assert(get_allocation_counters().allocations == 0);
+}
+
+static void probe_test(void) {
+    using namespace tga;
+
+    std::vector<std::string> paths = {
+        "images/CBW8.TGA", "images/CCM8.TGA", "images/CTC16.TGA",
+        "images/CTC24.TGA", "images/CTC32.TGA", "images/UBW8.TGA",
+        "images/UCM8.TGA", "images/UTC16.TGA", "images/UTC24.TGA",
+        "images/UTC32.TGA", "images/missing.tga"};
+    std::vector<tga_file_info> infos;
+    std::vector<tga_error> errors = probe_batch(paths, &infos, true, 3);
+    assert(errors.size() == paths.size() && infos.size() == paths.size());
+    for (size_t i = 0; i + 1 < paths.size(); i++) {
+        // The header tells what a full load finds.
+        Image img(paths[i]);
+        tga_file_info info;
+        assert(probe(paths[i], &info, true) == tga_error::TGA_NO_ERROR);
+        assert(info.width == img.get_width());
+        assert(info.height == img.get_height());
+        assert(info.pixel_format == img.get_pixel_format());
+        assert(info.is_rle == (paths[i][7] == 'C'));
+        assert(info.is_color_mapped == (paths[i][8] == 'C'));
+        int image_type = paths[i][8] == 'C' ? 1 : paths[i][8] == 'T' ? 2 : 3;
+        assert(info.image_type == image_type + (info.is_rle ? 8 : 0));
+        assert(info.has_footer);
+
+        assert(errors[i] == tga_error::TGA_NO_ERROR);
+        assert(infos[i].width == info.width);
+        assert(infos[i].image_type == info.image_type);
+        assert(infos[i].has_footer);
+
+        // A buffer too short for the header.
+        std::vector<uint8_t> contents = read_file(paths[i].c_str());
+        assert(probe(contents.data(), contents.size(), &info) ==
+               tga_error::TGA_NO_ERROR);
+        assert(probe(contents.data(), 17, &info) ==
+               tga_error::TGA_ERROR_FILE_CANNOT_READ);
+    }
+    assert(errors.back() == tga_error::TGA_ERROR_FILE_CANNOT_READ);
+}
+
+// Flips rows of each pixel size against a pixel by pixel reference. In bytes,
+// the widths run through the 64 and 32 byte vector loops, the pixel by pixel
+// tail and odd counts of pixels.
+static void flip_test(void) {
+    using namespace tga;
+
+    const tga_pixel_format formats[] = {
+        tga_pixel_format::TGA_PIXEL_BW8, tga_pixel_format::TGA_PIXEL_RGB555,
+        tga_pixel_format::TGA_PIXEL_RGB24, tga_pixel_format::TGA_PIXEL_ARGB32};
+    const int widths[] = {1,  2,  3,  5,  7,  8,  15, 16, 17,  31,
+                          32, 33, 47, 63, 64, 65, 97, 100, 129, 257};
+    uint32_t seed = 7;
+    for (tga_pixel_format format : formats) {
+        for (int width : widths) {
+            Image img(width, 5, format);
+            int pixel_size = img.get_pixel_size();
+            for (size_t i = 0; i < img.get_data().size(); i++) {
+                seed = seed * 1103515245 + 12345;
+                img.get_raw_data()[i] = (uint8_t)(seed >> 16);
+            }
+            Image original = img;
+
+            img.flip_h();
+            for (int y = 0; y < 5; y++) {
+                for (int x = 0; x < width; x++) {
+                    assert(memcmp(img.get_pixel(x, y),
+                                  original.get_pixel(width - 1 - x, y),
+                                  pixel_size) == 0);
+                }
+            }
+            img.flip_h();
+            assert(img.get_data() == original.get_data());
+
+            img.flip_v();
+            for (int y = 0; y < 5; y++) {
+                assert(memcmp(img.get_pixel(0, y), original.get_pixel(0, 4 - y),
+                              (size_t)width * pixel_size) == 0);
+            }
+            img.flip_v();
+            assert(img.get_data() == original.get_data());
+
+            // A view flips its own pixels only, whatever the stride.
+            if (width > 2) {
+                ImageView view = img.get_view(1, 1, width - 2, 3);
+                view.flip_h();
+                view.flip_v();
+                for (int y = 0; y < 5; y++) {
+                    for (int x = 0; x < width; x++) {
+                        bool inside = x >= 1 && x < width - 1 && y >= 1 &&
+                                      y < 4;
+                        int src_x = inside ? width - 1 - x : x;
+                        int src_y = inside ? 4 - y : y;
+                        assert(memcmp(img.get_pixel(x, y),
+                                      original.get_pixel(src_x, src_y),
+                                      pixel_size) == 0);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Loads the test images as if stored from each origin. Flipping the bits 4
+// and 5 of the image descriptor must give the stored image flipped by a
+// pixel by pixel reference.
+static void origin_test(void) {
+    using namespace tga;
+
+    const char* paths[] = {"images/CBW8.TGA", "images/CCM8.TGA",
+                           "images/CTC16.TGA", "images/CTC24.TGA",
+                           "images/CTC32.TGA", "images/UBW8.TGA",
+                           "images/UCM8.TGA", "images/UTC16.TGA",
+                           "images/UTC24.TGA", "images/UTC32.TGA"};
+    for (const char* path : paths) {
+        Image base(path);
+        assert(base.last_error() == tga_error::TGA_NO_ERROR);
+        int width = base.get_width();
+        int height = base.get_height();
+        int pixel_size = base.get_pixel_size();
+        std::vector<uint8_t> contents = read_file(path);
+        uint8_t stored_bits = contents[17] & 0x30;
+        for (int origin = 0; origin < 4; origin++) {
+            uint8_t bits = (uint8_t)(origin << 4);
+            contents[17] = (uint8_t)((contents[17] & ~0x30) | bits);
+            bool flip_h = ((bits ^ stored_bits) & 0x10) != 0;
+            bool flip_v = ((bits ^ stored_bits) & 0x20) != 0;
+            Image img;
+            assert(img.load_from_memory(contents.data(), contents.size()));
+            assert(img.get_width() == width && img.get_height() == height);
+            for (int y = 0; y < height; y++) {
+                for (int x = 0; x < width; x++) {
+                    int src_x = flip_h ? width - 1 - x : x;
+                    int src_y = flip_v ? height - 1 - y : y;
+                    assert(memcmp(img.get_pixel(x, y),
+                                  base.get_pixel(src_x, src_y),
+                                  pixel_size) == 0);
+                }
+            }
+        }
+    }
+}
+
+// Splits the loads, saves, flips and conversions of an image of several
+// bands over four threads. The results must match the one-thread results
+// byte for byte.
+static void policy_test(void) {
+    using namespace tga;
+
+    // Noisy rows between rows of runs, in more than 256 colors.
+    Image img(1024, 300, tga_pixel_format::TGA_PIXEL_ARGB32);
+    uint32_t seed = 3;
+    for (int y = 0; y < img.get_height(); y++) {
+        for (int x = 0; x < img.get_width(); x++) {
+            seed = seed * 1103515245 + 12345;
+            uint8_t* pixel = img.get_pixel(x, y);
+            for (int i = 0; i < 4; i++) {
+                pixel[i] = y % 4 == 0 ? (uint8_t)(seed >> (i * 8))
+                                      : (uint8_t)(x / 16 + y + i * 64);
+            }
+        }
+    }
+    ExecutionPolicy one{1};
+    ExecutionPolicy four{4};
+
+    SaveOptions save_cases[3];
+    save_cases[1].rle = true;
+    save_cases[2].color_mapped = true;
+    for (const SaveOptions& options : save_cases) {
+        std::vector<uint8_t> saved_one, saved_four;
+        assert(img.save_to_memory(saved_one, options, one));
+        assert(img.save_to_memory(saved_four, options, four));
+        assert(saved_one == saved_four);
+
+        Image loaded_one, loaded_four;
+        assert(loaded_one.load_from_memory(saved_one.data(), saved_one.size(),
+                                           {}, one));
+        assert(loaded_four.load_from_memory(saved_one.data(),
+                                            saved_one.size(), {}, four));
+        assert(loaded_four.get_data() == loaded_one.get_data());
+        if (!options.color_mapped) {
+            assert(loaded_one.get_data() == img.get_data());
+        }
+    }
+
+    Image flipped_one = img;
+    Image flipped_four = img;
+    flipped_one.flip_h(one);
+    flipped_four.flip_h(four);
+    assert(flipped_four.get_data() == flipped_one.get_data());
+    flipped_one.flip_v(one);
+    flipped_four.flip_v(four);
+    assert(flipped_four.get_data() == flipped_one.get_data());
+    // Through a view whose rows don't follow each other.
+    flipped_one.get_view(3, 5, 1000, 290).flip_h(one);
+    flipped_four.get_view(3, 5, 1000, 290).flip_h(four);
+    assert(flipped_four.get_data() == flipped_one.get_data());
+    flipped_one.get_view(3, 5, 1000, 290).flip_v(one);
+    flipped_four.get_view(3, 5, 1000, 290).flip_v(four);
+    assert(flipped_four.get_data() == flipped_one.get_data());
+
+    const tga_pixel_format formats[] = {
+        tga_pixel_format::TGA_PIXEL_BW8, tga_pixel_format::TGA_PIXEL_RGB555,
+        tga_pixel_format::TGA_PIXEL_RGB24, tga_pixel_format::TGA_PIXEL_ABGR32};
+    for (tga_pixel_format format : formats) {
+        Image converted_one = img;
+        Image converted_four = img;
+        assert(converted_one.convert(format, one));
+        assert(converted_four.convert(format, four));
+        assert(converted_four.get_data() == converted_one.get_data());
+    }
+}
+
+// Encodes the pixels of an uncompressed file with run-length packets that
+// run across rows, which save_image never writes.
+static std::vector<uint8_t> encode_rle_across_rows(
+    const std::vector<uint8_t>& raw) {
+    size_t pixel_size = (raw[16] + 7) / 8;
+    size_t map_size = (size_t)(raw[5] | raw[6] << 8) * ((raw[7] + 7) / 8);
+    size_t offset = 18 + raw[0] + map_size;
+    size_t count = (size_t)(raw[12] | raw[13] << 8) * (raw[14] | raw[15] << 8);
+    std::vector<uint8_t> encoded(raw.begin(), raw.begin() + offset);
+    encoded[2] |= 8;
+    const uint8_t* pixels = raw.data() + offset;
+    auto same = [&](size_t i, size_t j) {
+        return memcmp(pixels + i * pixel_size, pixels + j * pixel_size,
+                      pixel_size) == 0;
+    };
+    size_t i = 0;
+    while (i < count) {
+        size_t run = 1;
+        while (run < 128 && i + run < count && same(i, i + run)) {
+            run++;
+        }
+        if (run > 1) {
+            encoded.push_back((uint8_t)(0x80 | (run - 1)));
+            encoded.insert(encoded.end(), pixels + i * pixel_size,
+                           pixels + (i + 1) * pixel_size);
+        } else {
+            while (run < 128 && i + run < count &&
+                   !(i + run + 1 < count && same(i + run, i + run + 1))) {
+                run++;
+            }
+            encoded.push_back((uint8_t)(run - 1));
+            encoded.insert(encoded.end(), pixels + i * pixel_size,
+                           pixels + (i + run) * pixel_size);
+        }
+        i += run;
+    }
+    return encoded;
+}
+
+// Loads RLE files of several bands, stored from each origin, on one thread
+// and on four, from memory and from the path. The bands are decoded from
+// the scanline index, and must give the one-thread pixels byte for byte.
+static void parallel_rle_test(void) {
+    using namespace tga;
+
+    const tga_pixel_format formats[] = {tga_pixel_format::TGA_PIXEL_BW8,
+                                        tga_pixel_format::TGA_PIXEL_RGB555,
+                                        tga_pixel_format::TGA_PIXEL_RGB24,
+                                        tga_pixel_format::TGA_PIXEL_ARGB32};
+    for (tga_pixel_format format : formats) {
+        // Rows of one color between rows of noise.
+        Image img(1200, 500, format);
+        uint32_t seed = 5;
+        for (int y = 0; y < img.get_height(); y++) {
+            for (int x = 0; x < img.get_width(); x++) {
+                seed = seed * 1103515245 + 12345;
+                uint8_t* pixel = img.get_pixel(x, y);
+                for (int i = 0; i < img.get_pixel_size(); i++) {
+                    pixel[i] = y % 5 == 1 || y % 5 == 2
+                                   ? (uint8_t)(seed >> (8 + i * 4))
+                                   : (uint8_t)(y / 3 + i);
+                }
+            }
+        }
+        for (int color_mapped = 0; color_mapped < 2; color_mapped++) {
+            // As save_image writes it, and with packets across rows, so that
+            // bands start in the middle of a packet.
+            SaveOptions options;
+            options.color_mapped = color_mapped != 0;
+            std::vector<uint8_t> raw;
+            assert(img.save_to_memory(raw, options));
+            options.rle = true;
+            std::vector<uint8_t> files[2];
+            assert(img.save_to_memory(files[0], options));
+            files[1] = encode_rle_across_rows(raw);
+            for (std::vector<uint8_t>& encoded : files) {
+                for (int origin = 0; origin < 4; origin++) {
+                    encoded[17] =
+                        (uint8_t)((encoded[17] & ~0x30) | (origin << 4));
+                    Image one, four;
+                    assert(one.load_from_memory(encoded.data(), encoded.size(),
+                                                {}, ExecutionPolicy{1}));
+                    assert(four.load_from_memory(encoded.data(),
+                                                 encoded.size(), {},
+                                                 ExecutionPolicy{4}));
+                    assert(four.get_data() == one.get_data());
+
+                    write_file("parallel.tga", encoded);
+                    Image mapped;
+                    assert(
+                        mapped.load("parallel.tga", {}, ExecutionPolicy{4}));
+                    assert(mapped.get_data() == one.get_data());
+                }
+            }
+            Image expected;
+            assert(expected.load_from_memory(raw.data(), raw.size()));
+            Image across;
+            files[1][17] = raw[17];
+            assert(across.load_from_memory(files[1].data(), files[1].size(),
+                                           {}, ExecutionPolicy{4}));
+            assert(across.get_data() == expected.get_data());
+        }
+    }
+    remove("parallel.tga");
+}
+
+// Widens the 8-bit color map indices of an uncompressed file to 16 bits.
+static std::vector<uint8_t> widen_indices(const std::vector<uint8_t>& raw) {
+    size_t map_size = (size_t)(raw[5] | raw[6] << 8) * ((raw[7] + 7) / 8);
+    size_t offset = 18 + raw[0] + map_size;
+    std::vector<uint8_t> wide(raw.begin(), raw.begin() + offset);
+    wide[16] = 16;
+    for (size_t i = offset; i < raw.size(); i++) {
+        wide.insert(wide.end(), {raw[i], 0});
+    }
+    return wide;
+}
+
+// Every RLE kernel, i.e. each pixel size, true-color or color mapped with
+// 8-bit and 16-bit indices, from each origin, must decode what the generic
+// decoder does, and what the uncompressed file holds.
+static void kernel_test(void) {
+    using namespace tga;
+
+    const tga_pixel_format formats[] = {tga_pixel_format::TGA_PIXEL_BW8,
+                                        tga_pixel_format::TGA_PIXEL_RGB555,
+                                        tga_pixel_format::TGA_PIXEL_RGB24,
+                                        tga_pixel_format::TGA_PIXEL_ARGB32};
+    for (tga_pixel_format format : formats) {
+        // An odd width, and rows of runs between rows of noise, out of less
+        // than 256 colors so that the palette is exact.
+        Image img(37, 11, format);
+        uint32_t seed = 9;
+        for (int y = 0; y < img.get_height(); y++) {
+            for (int x = 0; x < img.get_width(); x++) {
+                seed = seed * 1103515245 + 12345;
+                int color = y % 3 == 1 ? (int)(seed >> 16) % 200
+                                       : (y * 7 + x / 10) % 200;
+                uint8_t* pixel = img.get_pixel(x, y);
+                for (int i = 0; i < img.get_pixel_size(); i++) {
+                    pixel[i] = (uint8_t)(color * (i + 1) * 29);
+                }
+            }
+        }
+        for (int index_size : {0, 1, 2}) {
+            SaveOptions options;
+            options.color_mapped = index_size != 0;
+            std::vector<uint8_t> raw;
+            assert(img.save_to_memory(raw, options));
+            if (index_size == 2) {
+                raw = widen_indices(raw);
+            }
+            // As save_image writes it, or with packets across rows.
+            std::vector<uint8_t> files[2];
+            files[1] = encode_rle_across_rows(raw);
+            if (index_size == 2) {
+                files[0] = files[1];
+            } else {
+                options.rle = true;
+                assert(img.save_to_memory(files[0], options));
+            }
+            for (int origin = 0; origin < 4; origin++) {
+                raw[17] = (uint8_t)((raw[17] & ~0x30) | (origin << 4));
+                Image expected;
+                assert(expected.load_from_memory(raw.data(), raw.size()));
+                for (std::vector<uint8_t>& encoded : files) {
+                    encoded[17] = raw[17];
+                    Image loaded;
+                    assert(loaded.load_from_memory(encoded.data(),
+                                                   encoded.size()));
+                    assert(loaded.get_data() == expected.get_data());
+
+                    // Converting while decoding goes through the generic
+                    // decoder, unless the file is color mapped: then the
+                    // color map is converted, and the kernel for the size of
+                    // the converted pixels decodes.
+                    for (tga_pixel_format target : formats) {
+                        LoadOptions load_options;
+                        load_options.convert = true;
+                        load_options.pixel_format = target;
+                        Image converted;
+                        assert(converted.load_from_memory(
+                            encoded.data(), encoded.size(), load_options));
+                        Image reference = expected;
+                        assert(reference.convert(target));
+                        assert(converted.get_data() == reference.get_data());
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void rle_test(void) {
+    using namespace tga;
+
+    const char* paths[] = {"images/UBW8.TGA", "images/UCM8.TGA",
+                           "images/UTC16.TGA", "images/UTC24.TGA",
+                           "images/UTC32.TGA"};
+    SaveOptions options;
+    options.rle = true;
+    for (const char* path : paths) {
+        Image img(path);
+        std::vector<uint8_t> encoded;
+        assert(img.save_to_memory(encoded, options));
+        bool is_grayscale =
+            img.get_pixel_format() == tga_pixel_format::TGA_PIXEL_BW8;
+        assert(encoded[2] == (is_grayscale ? 11 : 10));
+        // The test images compress well.
+        assert(encoded.size() < img.get_data().size());
+
+        Image loaded;
+        assert(loaded.load_from_memory(encoded.data(), encoded.size()));
+        assert(loaded.get_pixel_format() == img.get_pixel_format());
+        assert(loaded.get_data() == img.get_data());
+    }
+}
+
+// Makes a 4x3 color mapped file, top-down, with 16-bit indices into 300
+// 24-bit entries that start at index 2. Entry i is (i & 0xFF, i >> 8, 7).
+// With rle, rows 0 and 1 are raw packets and row 2 is one run packet.
+// Reads an RLE file of several 64 KiB read blocks a few bytes at a time, so
+// that packets and pixels straddle the ends of the blocks.
+static void rle_block_test(void) {
+    using namespace tga;
+
+    // Noisy rows, in raw packets, between rows of runs of varying length.
+    Image img(512, 256, tga_pixel_format::TGA_PIXEL_RGB24);
+    uint32_t seed = 1;
+    for (int y = 0; y < img.get_height(); y++) {
+        for (int x = 0; x < img.get_width(); x++) {
+            seed = seed * 1103515245 + 12345;
+            uint8_t* pixel = img.get_pixel(x, y);
+            for (int i = 0; i < 3; i++) {
+                pixel[i] = y % 3 == 0 ? (uint8_t)(seed >> (8 + i * 8))
+                                      : (uint8_t)(x / (1 + y % 7) + i);
+            }
+        }
+    }
+    SaveOptions options;
+    options.rle = true;
+    std::vector<uint8_t> encoded;
+    assert(img.save_to_memory(encoded, options));
+    assert(encoded.size() > 3 * 65536);
+
+    size_t pos = 0;
+    std::vector<uint8_t> source;
+    tga_reader reader;
+    reader.read = [&](uint8_t* dest, size_t size) {
+        size_t count = 1 + pos % 5;
+        count = count < size ? count : size;
+        count = count < source.size() - pos ? count : source.size() - pos;
+        memcpy(dest, source.data() + pos, count);
+        pos += count;
+        return count;
+    };
+    source = encoded;
+    Image streamed;
+    assert(streamed.load(reader));
+    assert(streamed.get_data() == img.get_data());
+
+    // Files that end in the header, at a block boundary, in the middle of
+    // a packet and one byte short of the last pixel. The copies are sized
+    // exactly, so a read past the end shows up under ASan.
+    size_t sizes[] = {10,
+                      65536,
+                      65536 + 1,
+                      encoded.size() / 2 + 1,
+                      encoded.size() - 1};
+    for (size_t size : sizes) {
+        source.assign(encoded.begin(), encoded.begin() + size);
+        pos = 0;
+        Image partial;
+        assert(!partial.load(reader));
+        assert(partial.last_error() == tga_error::TGA_ERROR_FILE_CANNOT_READ);
+        std::vector<uint8_t> truncated(source);
+        assert(!partial.load_from_memory(truncated.data(), truncated.size()));
+        assert(partial.last_error() == tga_error::TGA_ERROR_FILE_CANNOT_READ);
+    }
+}
+
+static std::vector<uint8_t> make_color_mapped(const uint16_t indices[12],
+                                              bool rle) {
+    const int first_entry = 2;
+    const int entry_count = 300;
+    std::vector<uint8_t> file = {0, 1, (uint8_t)(rle ? 9 : 1),
+                                 first_entry, 0,
+                                 entry_count & 0xFF, entry_count >> 8, 24,
+                                 0, 0, 0, 0, 4, 0, 3, 0, 16, 0x20};
+    for (int i = 0; i < entry_count; i++) {
+        int index = first_entry + i;
+        file.insert(file.end(), {(uint8_t)(index & 0xFF),
+                                 (uint8_t)(index >> 8), 7});
+    }
+    for (int i = 0; i < 12; i++) {
+        if (rle && i % 4 == 0) {
+            file.push_back(i < 8 ? 0x03 : 0x83);
+        }
+        if (!rle || i < 9) {
+            file.insert(file.end(), {(uint8_t)(indices[i] & 0xFF),
+                                     (uint8_t)(indices[i] >> 8)});
+        }
+    }
+    return file;
+}
+
+static void color_map_test(void) {
+    using namespace tga;
+
+    uint16_t indices[12];
+    for (int i = 0; i < 12; i++) {
+        indices[i] = (uint16_t)(2 + i * 25);
+    }
+    // The run packet repeats the first pixel of the last row.
+    indices[9] = indices[10] = indices[11] = indices[8];
+    for (bool rle : {false, true}) {
+        std::vector<uint8_t> file = make_color_mapped(indices, rle);
+        Image img;
+        assert(img.load_from_memory(file.data(), file.size()));
+        assert(img.get_pixel_format() == tga_pixel_format::TGA_PIXEL_RGB24);
+        assert(img.get_width() == 4 && img.get_height() == 3);
+        for (int i = 0; i < 12; i++) {
+            const uint8_t* pixel = img.get_pixel(i % 4, i / 4);
+            assert(pixel[0] == (indices[i] & 0xFF));
+            assert(pixel[1] == indices[i] >> 8 && pixel[2] == 7);
+        }
+
+        // Indices below the first entry and past the last one, in a raw
+        // row and in a run.
+        const int bad_pixels[] = {1, 8};
+        const uint16_t bad_indices[] = {1, 302};
+        for (int pixel : bad_pixels) {
+            for (uint16_t bad_index : bad_indices) {
+                uint16_t bad[12];
+                memcpy(bad, indices, sizeof(bad));
+                bad[pixel] = bad_index;
+                file = make_color_mapped(bad, rle);
+                assert(!img.load_from_memory(file.data(), file.size()));
+                assert(img.last_error() ==
+                       tga_error::TGA_ERROR_COLOR_MAP_INDEX_FAILED);
+            }
+        }
+    }
+}
+
+static void palette_test(void) {
+    using namespace tga;
+
+    // More than 256 colors, so the palette comes from median cut, inside a
+    // black and white frame. The extremes must survive: opaque alpha, pure
+    // black and pure white.
+    const int size = 64;
+    tga_pixel_format formats[] = {tga_pixel_format::TGA_PIXEL_RGB24,
+                                  tga_pixel_format::TGA_PIXEL_ARGB32};
+    for (tga_pixel_format format : formats) {
+        Image img(size, size, format);
+        int pixel_size = img.get_pixel_size();
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) {
+                uint8_t* pixel = img.get_pixel(x, y);
+                pixel[0] = (uint8_t)(64 + x * 2);
+                pixel[1] = (uint8_t)(64 + y * 2);
+                pixel[2] = (uint8_t)(64 + x + y);
+                if (x == 0 || y == 0) {
+                    memset(pixel, 0, 3);
+                } else if (x == size - 1 || y == size - 1) {
+                    memset(pixel, 255, 3);
+                }
+                if (pixel_size == 4) {
+                    pixel[3] = 255;
+                }
+            }
+        }
+        SaveOptions options;
+        options.color_mapped = true;
+        std::vector<uint8_t> encoded;
+        assert(img.save_to_memory(encoded, options));
+        assert(encoded[1] == 1 && encoded[2] == 1);
+
+        Image loaded;
+        assert(loaded.load_from_memory(encoded.data(), encoded.size()));
+        assert(loaded.get_pixel_format() == format);
+        const uint8_t* black = loaded.get_pixel(0, 0);
+        const uint8_t* white = loaded.get_pixel(size - 1, size - 1);
+        assert(black[0] == 0 && black[1] == 0 && black[2] == 0);
+        assert(white[0] == 255 && white[1] == 255 && white[2] == 255);
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) {
+                const uint8_t* pixel = loaded.get_pixel(x, y);
+                const uint8_t* original = img.get_pixel(x, y);
+                if (pixel_size == 4) {
+                    assert(pixel[3] == 255);
+                }
+                for (int c = 0; c < 3; c++) {
+                    assert(abs(pixel[c] - original[c]) <= 16);
+                }
+            }
+        }
+    }
+}
+
+// Reference conversion of one pixel, through blue, green, red and alpha.
+static void convert_pixel(uint8_t* dest, tga::tga_pixel_format dest_format,
+                          const uint8_t* src, tga::tga_pixel_format format) {
+    using tga::tga_pixel_format;
+
+    uint8_t bgra[4] = {0, 0, 0, 255};
+    switch (format) {
+        case tga_pixel_format::TGA_PIXEL_BW8:
+            bgra[0] = bgra[1] = bgra[2] = src[0];
+            break;
+        case tga_pixel_format::TGA_PIXEL_BW16:
+            bgra[0] = bgra[1] = bgra[2] = src[1];
+            break;
+        case tga_pixel_format::TGA_PIXEL_RGB555:
+            for (int c = 0; c < 3; c++) {
+                int value = ((src[0] | (src[1] << 8)) >> (c * 5)) & 0x1F;
+                bgra[c] = (uint8_t)((value << 3) | (value >> 2));
+            }
+            break;
+        case tga_pixel_format::TGA_PIXEL_RGB24:
+            memcpy(bgra, src, 3);
+            break;
+        case tga_pixel_format::TGA_PIXEL_ARGB32:
+            memcpy(bgra, src, 4);
+            break;
+        case tga_pixel_format::TGA_PIXEL_ABGR32:
+            bgra[0] = src[2];
+            bgra[1] = src[1];
+            bgra[2] = src[0];
+            bgra[3] = src[3];
+            break;
+    }
+    uint8_t luma =
+        (uint8_t)((77 * bgra[2] + 150 * bgra[1] + 29 * bgra[0] + 128) >> 8);
+    int value = (bgra[0] >> 3) | ((bgra[1] >> 3) << 5) | ((bgra[2] >> 3) << 10);
+    switch (dest_format) {
+        case tga_pixel_format::TGA_PIXEL_BW8:
+            dest[0] = luma;
+            break;
+        case tga_pixel_format::TGA_PIXEL_BW16:
+            dest[0] = dest[1] = luma;
+            break;
+        case tga_pixel_format::TGA_PIXEL_RGB555:
+            dest[0] = (uint8_t)(value & 0xFF);
+            dest[1] = (uint8_t)(value >> 8);
+            break;
+        case tga_pixel_format::TGA_PIXEL_RGB24:
+            memcpy(dest, bgra, 3);
+            break;
+        case tga_pixel_format::TGA_PIXEL_ARGB32:
+            memcpy(dest, bgra, 4);
+            break;
+        case tga_pixel_format::TGA_PIXEL_ABGR32:
+            dest[0] = bgra[2];
+            dest[1] = bgra[1];
+            dest[2] = bgra[0];
+            dest[3] = bgra[3];
+            break;
+    }
+}
+
+static void convert_test(void) {
+    using namespace tga;
+
+    const tga_pixel_format formats[] = {
+        tga_pixel_format::TGA_PIXEL_BW8,    tga_pixel_format::TGA_PIXEL_BW16,
+        tga_pixel_format::TGA_PIXEL_RGB555, tga_pixel_format::TGA_PIXEL_RGB24,
+        tga_pixel_format::TGA_PIXEL_ARGB32, tga_pixel_format::TGA_PIXEL_ABGR32};
+    // Widths around the 4, 8, 16 and 32 pixels of the vector kernels, so
+    // that every tail is hit whichever kernels the machine runs.
+    const int widths[] = {1, 3, 4, 7, 8, 15, 16, 17, 31, 32, 33, 63, 67};
+    srand(1);
+    for (tga_pixel_format format : formats) {
+        for (tga_pixel_format dest_format : formats) {
+            for (int width : widths) {
+                Image src(width, 3, format);
+                for (size_t i = 0; i < src.get_data().size(); i++) {
+                    src.get_raw_data()[i] = (uint8_t)rand();
+                }
+                Image img = src;
+                assert(img.convert(dest_format));
+                assert(img.get_pixel_format() == dest_format);
+                int pixel_size = img.get_pixel_size();
+                for (int y = 0; y < 3; y++) {
+                    for (int x = 0; x < width; x++) {
+                        uint8_t expected[4];
+                        if (dest_format == format) {
+                            memcpy(expected, src.get_pixel(x, y), pixel_size);
+                        } else {
+                            convert_pixel(expected, dest_format,
+                                          src.get_pixel(x, y), format);
+                        }
+                        assert(memcmp(img.get_pixel(x, y), expected,
+                                      pixel_size) == 0);
+                    }
+                }
+            }
+        }
+    }
+
+    // Converting while loading gives the same pixels as converting after.
+    const char* paths[] = {"images/CBW8.TGA", "images/CCM8.TGA",
+                           "images/UTC16.TGA", "images/CTC24.TGA",
+                           "images/UTC32.TGA"};
+    for (const char* path : paths) {
+        Image loaded(path);
+        for (tga_pixel_format dest_format : formats) {
+            LoadOptions options;
+            options.convert = true;
+            options.pixel_format = dest_format;
+            Image img;
+            assert(img.load(path, options));
+            assert(img.get_pixel_format() == dest_format);
+            Image expected = loaded;
+            assert(expected.convert(dest_format));
+            assert(img.get_data() == expected.get_data());
+        }
+    }
+}
+
+static void scanline_test(void) {
+    using namespace tga;
+
+    // CTC24 is stored bottom-up with RLE.
+    Image img("images/CTC24.TGA");
+    std::vector<uint8_t> row(128 * 3);
+    ScanlineReader top_down("images/CTC24.TGA");
+    assert(top_down.last_error() == tga_error::TGA_NO_ERROR);
+    assert(top_down.get_row_size() == row.size());
+    for (int y = 0; y < 128; y++) {
+        assert(top_down.get_next_row() == y);
+        assert(top_down.read_row(row.data()));
+        assert(memcmp(row.data(), img.get_pixel(0, y), row.size()) == 0);
+    }
+    assert(top_down.get_next_row() == -1);
+    assert(!top_down.read_row(row.data()));
+
+    // Stored order needs no seeking, so a plain reader will do.
+    std::vector<uint8_t> contents = read_file("images/CTC24.TGA");
+    size_t pos = 0;
+    tga_reader reader;
+    reader.read = [&](uint8_t* dest, size_t size) {
+        size_t count = size < contents.size() - pos ? size
+                                                    : contents.size() - pos;
+        memcpy(dest, contents.data() + pos, count);
+        pos += count;
+        return count;
+    };
+    ScanlineReader stored;
+    assert(stored.open(reader, {}, ScanlineOrder::STORED));
+    for (int y = 127; y >= 0; y--) {
+        assert(stored.get_next_row() == y);
+        assert(stored.read_row(row.data()));
+        assert(memcmp(row.data(), img.get_pixel(0, y), row.size()) == 0);
+    }
+    // Top-down from a bottom-up file needs to seek.
+    pos = 0;
+    ScanlineReader no_seek;
+    assert(!no_seek.open(reader));
+
+    // Rows written one by one make the file save() makes.
+    for (bool rle : {false, true}) {
+        SaveOptions options;
+        options.rle = rle;
+        ScanlineWriter writer;
+        assert(writer.open("scanline.tga", 128, 128,
+                           tga_pixel_format::TGA_PIXEL_RGB24, options));
+        for (int y = 0; y < 128; y++) {
+            assert(writer.get_next_row() == y);
+            assert(writer.write_row(img.get_pixel(0, y)));
+        }
+        assert(writer.close());
+        Image written("scanline.tga");
+        assert(written.get_data() == img.get_data());
+
+        std::vector<uint8_t> saved;
+        assert(img.save_to_memory(saved, options));
+        assert(read_file("scanline.tga") == saved);
+    }
+
+    // A file left short of rows is removed.
+    ScanlineWriter writer;
+    assert(writer.open("scanline.tga", 128, 128,
+                       tga_pixel_format::TGA_PIXEL_RGB24));
+    assert(writer.write_row(img.get_pixel(0, 0)));
+    assert(!writer.close());
+    FILE* file = fopen("scanline.tga", "rb");
+    assert(file == NULL);
+}
+
+static void region_test(void) {
+    using namespace tga;
+
+    Image full("images/CTC24.TGA");
+    ScanlineIndex index;
+    Image tile;
+    for (int y = 0; y < 128; y += 48) {
+        assert(tile.load_region("images/CTC24.TGA", 8, y, 40, 30, {},
+                                &index));
+        assert(!index.empty());
+        for (int row = 0; row < 30; row++) {
+            assert(memcmp(tile.get_pixel(0, row), full.get_pixel(8, y + row),
+                          40 * 3) == 0);
+        }
+    }
+
+    // An index made for another file of the same size is not used.
+    std::vector<uint8_t> files[2];
+    Image sources[2];
+    SaveOptions options;
+    options.rle = true;
+    for (int i = 0; i < 2; i++) {
+        sources[i] = Image(64, 64, tga_pixel_format::TGA_PIXEL_RGB24);
+        for (int y = 0; y < 64; y++) {
+            for (int x = 0; x < 64; x++) {
+                // Runs in the first image, noise in the second.
+                uint8_t value = (uint8_t)(i == 0 ? x / 8 : x * y * 7 + y);
+                memset(sources[i].get_pixel(x, y), value, 3);
+            }
+        }
+        assert(sources[i].save_to_memory(files[i], options));
+    }
+    index.clear();
+    for (int i = 0; i < 2; i++) {
+        assert(tile.load_region_from_memory(files[i].data(), files[i].size(),
+                                            4, 20, 50, 40, {}, &index));
+        for (int row = 0; row < 40; row++) {
+            assert(memcmp(tile.get_pixel(0, row),
+                          sources[i].get_pixel(4, 20 + row), 50 * 3) == 0);
+        }
+    }
+}
+
+static void batch_test(void) {
+    using namespace tga;
+
+    std::vector<std::string> paths = {
+        "images/CBW8.TGA", "images/CCM8.TGA", "images/CTC16.TGA",
+        "images/CTC24.TGA", "images/CTC32.TGA", "images/UBW8.TGA",
+        "images/UCM8.TGA", "images/UTC16.TGA", "images/UTC24.TGA",
+        "images/UTC32.TGA", "images/missing.tga"};
+    // Less than a file in flight, so the files go through one at a time.
+    BatchOptions options;
+    options.io_thread_count = 2;
+    options.decode_thread_count = 3;
+    options.max_in_flight_bytes = 1000;
+    BatchLoader loader(options);
+    std::vector<std::future<Image>> images = loader.load(paths);
+    assert(images.size() == paths.size());
+    for (size_t i = 0; i + 1 < paths.size(); i++) {
+        Image img = images[i].get();
+        assert(img.last_error() == tga_error::TGA_NO_ERROR);
+        assert(img.get_data() == Image(paths[i]).get_data());
+    }
+    assert(images.back().get().last_error() ==
+           tga_error::TGA_ERROR_FILE_CANNOT_READ);
+
+    // Files in memory, delivered to a callback.
+    std::vector<std::vector<uint8_t>> contents;
+    std::vector<BatchLoader::MemoryFile> buffers;
+    for (size_t i = 0; i + 1 < paths.size(); i++) {
+        contents.push_back(read_file(paths[i].c_str()));
+    }
+    for (const auto& file : contents) {
+        buffers.push_back({file.data(), file.size()});
+    }
+    std::vector<int> delivered(buffers.size(), 0);
+    std::vector<size_t> sizes(buffers.size(), 0);
+    loader.load(buffers, [&](size_t index, Image&& img) {
+        // Each index is delivered once, on any decode thread.
+        delivered[index]++;
+        sizes[index] = img.get_data().size();
+    });
+    loader.wait();
+    for (size_t i = 0; i < buffers.size(); i++) {
+        assert(delivered[i] == 1);
+        assert(sizes[i] == Image(paths[i]).get_data().size());
+    }
+}
+
+static void cache_test(void) {
+    using namespace tga;
+
+    write_file("cache_a.tga", read_file("images/UTC24.TGA"));
+    write_file("cache_b.tga", read_file("images/UTC32.TGA"));
+    // Room for either image, not for both: 49152 and 65536 bytes of pixels.
+    ImageCache cache(70000);
+
+    std::shared_ptr<const Image> a = cache.get("cache_a.tga");
+    assert(a->last_error() == tga_error::TGA_NO_ERROR);
+    assert(cache.get("cache_a.tga") == a);
+    ImageCacheStats stats = cache.get_stats();
+    assert(stats.misses == 1 && stats.hits == 1 && stats.evictions == 0);
+    assert(stats.entries == 1 && stats.bytes == a->get_data().size());
+
+    // Loading the other one evicts the first, which stays valid.
+    std::shared_ptr<const Image> b = cache.get("cache_b.tga");
+    stats = cache.get_stats();
+    assert(stats.misses == 2 && stats.evictions == 1);
+    assert(stats.entries == 1 && stats.bytes == b->get_data().size());
+    assert(a->get_data() == Image("images/UTC24.TGA").get_data());
+    assert(cache.get("cache_a.tga") != a);
+    assert(cache.get_stats().misses == 3);
+
+    // A file rewritten with the same size is loaded again once its
+    // modification time changes.
+    std::vector<uint8_t> contents = read_file("images/UTC24.TGA");
+    contents[18 + contents[0]] ^= 0xFF;
+    write_file("cache_a.tga", contents);
+    auto mtime = std::filesystem::last_write_time("cache_a.tga");
+    std::filesystem::last_write_time("cache_a.tga",
+                                     mtime + std::chrono::seconds(1));
+    std::shared_ptr<const Image> changed = cache.get("cache_a.tga");
+    assert(cache.get_stats().misses == 4);
+    assert(changed->get_data() != a->get_data());
+    assert(cache.get("cache_a.tga") == changed);
+
+    // Missing files are returned with their error, and not kept.
+    assert(cache.get("cache_missing.tga")->last_error() ==
+           tga_error::TGA_ERROR_FILE_CANNOT_READ);
+    cache.clear();
+    assert(cache.get_stats().entries == 0 && cache.get_stats().bytes == 0);
+    remove("cache_a.tga");
+    remove("cache_b.tga");
+}
+
+static void stats_test(void) {
+    using namespace tga;
+
+    std::vector<uint8_t> contents = read_file("images/CTC24.TGA");
+    Stats stats;
+    Stats inner;
+    std::vector<uint8_t> saved;
+    {
+        StatsScope scope(stats);
+        Image img("images/CTC24.TGA");
+        {
+            // Only the innermost scope records.
+            StatsScope inner_scope(inner);
+            SaveOptions options;
+            options.rle = true;
+            assert(img.save_to_memory(saved, options));
+        }
+        img.flip_h();
+    }
+    if (!stats_enabled()) {
+        assert(stats.loads == 0 && stats.bytes_read == 0);
+        assert(inner.saves == 0 && inner.bytes_written == 0);
+        return;
+    }
+    assert(stats.loads == 1 && stats.saves == 0);
+    assert(stats.bytes_read > 0 && stats.bytes_read <= contents.size());
+    assert(stats.rle_run_packets + stats.rle_raw_packets > 0);
+    assert(stats.decode_ns > 0 && stats.flip_ns > 0);
+    assert(inner.loads == 0 && inner.saves == 1);
+    assert(inner.bytes_written == saved.size());
+
+    // The threads a call splits its work onto record into the same scope.
+    Image big(1024, 1024, tga_pixel_format::TGA_PIXEL_RGB24);
+    for (size_t i = 0; i < big.get_data().size(); i++) {
+        big.get_raw_data()[i] = (uint8_t)(i / 3 % 1024 / 10);
+    }
+    SaveOptions options;
+    options.rle = true;
+    assert(big.save_to_memory(saved, options));
+    Stats one, four;
+    {
+        StatsScope scope(one);
+        big.load_from_memory(saved.data(), saved.size());
+    }
+    {
+        StatsScope scope(four);
+        big.load_from_memory(saved.data(), saved.size(), {},
+                             ExecutionPolicy{4});
+    }
+    assert(one.rle_run_packets > 0);
+    assert(four.rle_run_packets == one.rle_run_packets);
+    assert(four.rle_raw_packets == one.rle_raw_packets);
+    assert(four.bytes_read == one.bytes_read);
+}
+
+static void view_test(void) {
+    using namespace tga;
+
+    Image img("images/UTC24.TGA");
+    assert(img.last_error() == tga_error::TGA_NO_ERROR);
+
+    // A crop saves the same file as a copy of its pixels.
+    ImageView crop = img.get_view(16, 8, 40, 30);
+    assert(!crop.empty());
+    assert(crop.get_pixel(0, 0) == img.get_pixel(16, 8));
+    Image copy(40, 30, tga_pixel_format::TGA_PIXEL_RGB24);
+    assert(copy_rect(copy.get_view(), 0, 0, img.get_view(), 16, 8, 40, 30) ==
+           tga_error::TGA_NO_ERROR);
+    for (int y = 0; y < 30; y++) {
+        assert(memcmp(copy.get_pixel(0, y), crop.get_row(y), 40 * 3) == 0);
+    }
+    SaveOptions options;
+    options.rle = true;
+    std::vector<uint8_t> from_view, from_copy;
+    assert(crop.save_to_memory(from_view, options) == tga_error::TGA_NO_ERROR);
+    assert(copy.save_to_memory(from_copy, options));
+    assert(from_view == from_copy);
+
+    // Rectangles outside the view are rejected, blits are clipped.
+    assert(img.get_view(100, 100, 40, 40).empty());
+    assert(copy_rect(copy.get_view(), 1, 0, crop, 0, 0, 40, 30) ==
+           tga_error::TGA_ERROR_INVALID_IMAGE_DIMENSIONS);
+    assert(blit(copy.get_view(), -30, -20, crop) == tga_error::TGA_NO_ERROR);
+    assert(memcmp(copy.get_pixel(0, 0), crop.get_pixel(30, 20), 3) == 0);
+}
+
+static void typed_test(void) {
+    using namespace tga;
+
+    Image img("images/UTC32.TGA");
+    assert(img.get_pixel_format() == tga_pixel_format::TGA_PIXEL_ARGB32);
+
+    // The conversion checks the format.
+    assert(TypedImage<tga_pixel_format::TGA_PIXEL_RGB24>(img).empty());
+    TypedImage<tga_pixel_format::TGA_PIXEL_ARGB32> pixels(img);
+    assert(!pixels.empty());
+    assert((uint8_t*)&pixels(5, 7) == img.get_pixel(5, 7));
+
+    int count = 0;
+    for (auto row : pixels) {
+        for (Bgra32& pixel : row) {
+            pixel.a = 0;
+            count++;
+        }
+    }
+    assert(count == img.get_width() * img.get_height());
+    assert(img.get_pixel(127, 127)[3] == 0);
+}
+
+static void mipmap_test(void) {
+    using namespace tga;
+
+    Image img("images/UTC24.TGA");
+    std::vector<Image> levels;
+    assert(generate_mipmaps(img.get_view(), levels) ==
+           tga_error::TGA_NO_ERROR);
+    assert(levels.size() == 7);
+    assert(levels[0].get_width() == 64 && levels[0].get_height() == 64);
+    assert(levels.back().get_width() == 1 && levels.back().get_height() == 1);
+    assert(levels[0].get_pixel_format() == img.get_pixel_format());
+
+    // A box filter averages each 2x2 block.
+    for (int c = 0; c < 3; ++c) {
+        int sum = img.get_pixel(20, 30)[c] + img.get_pixel(21, 30)[c] +
+                  img.get_pixel(20, 31)[c] + img.get_pixel(21, 31)[c];
+        assert(abs(levels[0].get_pixel(10, 15)[c] * 4 - sum) <= 2);
+    }
+
+    // The same with any number of threads, and non power of two sizes. The
+    // image is large enough to be split into bands, whose edges the filter
+    // reaches across, and into several passes.
+    Image big(1030, 610, tga_pixel_format::TGA_PIXEL_ARGB32);
+    uint32_t seed = 3;
+    for (size_t i = 0; i < big.get_data().size(); i++) {
+        seed = seed * 1103515245 + 12345;
+        big.get_raw_data()[i] = (uint8_t)(i / 4 % 1030 / 4 + (seed >> 28));
+    }
+    MipmapOptions options;
+    options.filter = ResampleFilter::LANCZOS3;
+    options.gamma_correct = true;
+    std::vector<Image> others;
+    ImageView view = big.get_view(3, 2, 1023, 601);
+    assert(generate_mipmaps(view, levels, options, ExecutionPolicy{1}) ==
+           tga_error::TGA_NO_ERROR);
+    assert(generate_mipmaps(view, others, options, ExecutionPolicy{4}) ==
+           tga_error::TGA_NO_ERROR);
+    assert(levels.size() == others.size());
+    assert(levels[0].get_width() == 511 && levels[0].get_height() == 300);
+    for (size_t i = 0; i < levels.size(); ++i) {
+        assert(levels[i].get_data() == others[i].get_data());
+    }
+}
+
+static void resize_test(void) {
+    using namespace tga;
+
+    Image img("images/UTC24.TGA");
+    Image small = resize(img, 40, 30, ResampleFilter::TRIANGLE);
+    assert(small.last_error() == tga_error::TGA_NO_ERROR);
+    assert(small.get_width() == 40 && small.get_height() == 30);
+    assert(small.get_pixel_format() == img.get_pixel_format());
+
+    // The same with any number of threads, down and up, on images large
+    // enough to be split into bands, whose source rows overlap.
+    Image big(1023, 601, tga_pixel_format::TGA_PIXEL_ARGB32);
+    uint32_t seed = 7;
+    for (size_t i = 0; i < big.get_data().size(); i++) {
+        seed = seed * 1103515245 + 12345;
+        big.get_raw_data()[i] = (uint8_t)(i / 4 % 1023 / 4 + (seed >> 28));
+    }
+    Image down_one = resize(big, 301, 203, ResampleFilter::LANCZOS3);
+    Image down_four = resize(big, 301, 203, ResampleFilter::LANCZOS3,
+                             ExecutionPolicy{4});
+    assert(down_one.last_error() == tga_error::TGA_NO_ERROR);
+    assert(down_one.get_data() == down_four.get_data());
+    Image up_one = resize(down_one, 613, 457, ResampleFilter::CUBIC);
+    Image up_four =
+        resize(down_one, 613, 457, ResampleFilter::CUBIC, ExecutionPolicy{4});
+    assert(up_one.last_error() == tga_error::TGA_NO_ERROR);
+    assert(up_one.get_data() == up_four.get_data());
+
+    // Resizing to the same size copies the pixels.
+    Image same = resize(img, img.get_width(), img.get_height());
+    assert(same.get_data() == img.get_data());
+
+    assert(resize(img, 0, 30).last_error() ==
+           tga_error::TGA_ERROR_INVALID_IMAGE_DIMENSIONS);
+
+    // Loading resized gives the same pixels, up to rounding, without
+    // holding the whole image.
+    Image loaded("images/CTC24.TGA");
+    Image expected = resize(loaded, 50, 300, ResampleFilter::LANCZOS3);
+    Image fused;
+    assert(fused.load_resized("images/CTC24.TGA", 50, 300,
+                              ResampleFilter::LANCZOS3));
+    assert(fused.get_data().size() == expected.get_data().size());
+    for (size_t i = 0; i < expected.get_data().size(); ++i) {
+        assert(abs(fused.get_data()[i] - expected.get_data()[i]) <= 1);
+    }
+
+    // A smaller image loads into the same pixel buffer.
+    const uint8_t* pixels = fused.get_raw_data();
+    assert(fused.load_resized("images/CTC24.TGA", 40, 30));
+    assert(fused.get_raw_data() == pixels);
+}
+
+static void incremental_test(void) {
+    using namespace tga;
+
+    std::vector<uint8_t> contents = read_file("images/CTC24.TGA");
+
+    // Chunks that split the header, the packets and the pixels.
+    IncrementalDecoder decoder;
+    int rows = 0;
+    for (size_t pos = 0; pos < contents.size(); pos += 7) {
+        size_t size = contents.size() - pos < 7 ? contents.size() - pos : 7;
+        assert(decoder.feed(contents.data() + pos, size));
+        assert(decoder.get_rows_decoded() >= rows);
+        rows = decoder.get_rows_decoded();
+    }
+    assert(decoder.finish());
+    assert(decoder.get_decoded_view().get_height() == 128);
+
+    Image loaded("images/CTC24.TGA");
+    Image img = decoder.take_image();
+    assert(img.get_data() == loaded.get_data());
+
+    // A file that ends early is reported once it ends.
+    decoder.reset();
+    assert(decoder.feed(contents.data(), 4096));
+    assert(decoder.has_header() && !decoder.is_done());
+    assert(!decoder.finish());
+    assert(decoder.last_error() == tga_error::TGA_ERROR_FILE_CANNOT_READ);
+
+    // The footer, and a stray chunk after it, come after the last row. They
+    // neither count as loads nor as bytes read.
+    Stats stats;
+    {
+        StatsScope scope(stats);
+        decoder.reset();
+        size_t footer = contents.size() - 26;
+        assert(decoder.feed(contents.data(), footer));
+        assert(decoder.is_done());
+        assert(decoder.feed(contents.data() + footer, 26));
+        assert(decoder.feed(contents.data(), 10));
+        assert(decoder.finish());
+    }
+    if (stats_enabled()) {
+        assert(stats.loads == 1);
+        assert(stats.bytes_read > 0 && stats.bytes_read <= contents.size());
+    }
+}
+
+int main(int argc, char* argv[]) {
+    create_test();
+    load_test();
+    mapped_test();
+    memory_test();
+    reuse_test();
+    probe_test();
+    flip_test();
+    origin_test();
+    policy_test();
+    parallel_rle_test();
+    kernel_test();
+    rle_test();
+    rle_block_test();
+    palette_test();
+    color_map_test();
+    convert_test();
+    scanline_test();
+    region_test();
+    batch_test();
+    cache_test();
+    stats_test();
+    view_test();
+    typed_test();
+    mipmap_test();
+    resize_test();
+    incremental_test();
+    puts("Test cases passed.");
+    return 0;
+}
\ No newline at end of file
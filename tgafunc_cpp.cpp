@@ -1,7 +1,61 @@
 #include "tgafunc_cpp.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
 #include <cstring>
+#include <deque>
+#include <exception>
 #include <fstream>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TGA_USE_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#define TGA_USE_AVX2
+#include <immintrin.h>
+#endif
+
+// Kernels for instruction sets above the compile-time baseline are built with
+// a per-function target and picked at runtime from the CPU features.
+#if defined(TGA_USE_SSE2) && \
+    (defined(__GNUC__) || defined(__clang__) || defined(_MSC_VER))
+#define TGA_RUNTIME_DISPATCH
+#include <immintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define TGA_TARGET(features) __attribute__((target(features)))
+#else
+#include <intrin.h>
+#define TGA_TARGET(features)
+#endif
+#endif
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 // ----------------------Utilities----------------------
 
@@ -36,15 +90,228 @@ struct tga_header {
     uint8_t image_descriptor;
 };
 
+// Number and size of the allocations reported by get_allocation_counters().
+std::atomic<uint64_t> allocation_count{0};
+std::atomic<uint64_t> allocation_bytes{0};
+
+namespace tga::detail {
+
+// Where a StatsScope records, shared with the threads its calls start. Each
+// thread counts into its own Stats and adds them to stats under the mutex
+// when it is done with the scope.
+struct stats_recorder {
+    std::mutex mutex;
+    Stats *stats{nullptr};
+};
+
+}  // namespace tga::detail
+
+// Recording the stats is compiled in only with TGA_ENABLE_STATS, otherwise
+// TGA_STATS_ONLY drops the code it wraps and nothing is left of it.
+#ifdef TGA_ENABLE_STATS
+#define TGA_STATS_ONLY(...) __VA_ARGS__
+
+// The recorder of the innermost StatsScope of this thread, if any, and what
+// this thread recorded for it that is not added to its stats yet.
+thread_local tga::detail::stats_recorder *active_recorder = nullptr;
+thread_local tga::Stats thread_stats;
+
+void stats_add(uint64_t tga::Stats::*field, uint64_t value) {
+    if (active_recorder != nullptr) {
+        thread_stats.*field += value;
+    }
+}
+
+// Adds what this thread recorded to the stats of the active recorder.
+void flush_thread_stats() {
+    tga::detail::stats_recorder *recorder = active_recorder;
+    if (recorder != nullptr) {
+        std::lock_guard<std::mutex> lock(recorder->mutex);
+        *recorder->stats += thread_stats;
+    }
+    thread_stats = tga::Stats{};
+}
+
+// Adds the time until the end of the scope to a field of the stats.
+struct stage_timer {
+    uint64_t tga::Stats::*field;
+    bool active;
+    std::chrono::steady_clock::time_point start;
+
+    explicit stage_timer(uint64_t tga::Stats::*f)
+        : field(f), active(active_recorder != nullptr) {
+        if (active) {
+            start = std::chrono::steady_clock::now();
+        }
+    }
+    ~stage_timer() {
+        if (active) {
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            stats_add(field,
+                      std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          elapsed)
+                          .count());
+        }
+    }
+};
+#else
+#define TGA_STATS_ONLY(...)
+#endif
+
+// Scratch blocks larger than this are handed back when the call ends instead
+// of being kept for the next one.
+#define MAX_ARENA_SIZE (16 * 1024 * 1024)
+
+// Per-thread bump allocator for the scratch memory of a load or save. The
+// block is kept between calls: what doesn't fit in it comes from the heap and
+// makes the block grow when the call ends, so a thread that keeps loading
+// similar images soon stops allocating. Memory is only handed out inside an
+// arena_scope, anything else goes straight to the heap.
+class scratch_arena {
+public:
+    void *allocate(size_t bytes, size_t alignment) {
+        if (depth > 0) {
+            uintptr_t base = (uintptr_t)block.get();
+            uintptr_t start = (base + used + alignment - 1) & ~(alignment - 1);
+            if (block && start + bytes <= base + capacity) {
+                used = start + bytes - base;
+                peak = used > peak ? used : peak;
+                return (void *)start;
+            }
+            overflow += bytes;
+        }
+        tga::detail::count_allocation(bytes);
+        return ::operator new(bytes, std::align_val_t(alignment));
+    }
+
+    void deallocate(void *ptr, size_t bytes, size_t alignment) {
+        uint8_t *p = (uint8_t *)ptr;
+        if (p >= block.get() && p < block.get() + capacity) {
+            // The most recent allocation is taken back, e.g. when a vector
+            // grows, everything else waits for the end of the call.
+            if (p + bytes == block.get() + used) {
+                used = p - block.get();
+            }
+            return;
+        }
+        ::operator delete(ptr, std::align_val_t(alignment));
+    }
+
+    void enter() { ++depth; }
+
+    // Ends a call. Once the outermost one ends, all the scratch memory is
+    // reclaimed, and the block is grown to what the call needed.
+    void leave() {
+        if (--depth > 0) {
+            return;
+        }
+        size_t needed = peak + overflow;
+        if (overflow > 0 && needed <= MAX_ARENA_SIZE) {
+            // Leaves room for alignment padding.
+            capacity = needed + needed / 8;
+            block.reset(new uint8_t[capacity]);
+            tga::detail::count_allocation(capacity);
+        } else if (capacity > MAX_ARENA_SIZE) {
+            block.reset();
+            capacity = 0;
+        }
+        used = 0;
+        peak = 0;
+        overflow = 0;
+    }
+
+private:
+    std::unique_ptr<uint8_t[]> block;
+    size_t capacity{0};
+    size_t used{0};
+    size_t peak{0};
+    size_t overflow{0};
+    int depth{0};
+};
+
+scratch_arena &thread_arena() {
+    thread_local scratch_arena arena;
+    return arena;
+}
+
+// Marks the scratch memory of the calling thread as in use until the end of
+// the scope.
+struct arena_scope {
+    scratch_arena &arena;
+
+    arena_scope() : arena(thread_arena()) { arena.enter(); }
+    ~arena_scope() { arena.leave(); }
+};
+
+// Allocator of the scratch buffers, from the arena of the thread that creates
+// them. New elements are left uninitialized. Scratch buffers must not be
+// resized from another thread, buffers that outlive a call and may move
+// between threads take a null arena, which allocates from the heap.
+template <typename T>
+struct scratch_allocator {
+    using value_type = T;
+    scratch_arena *arena;
+
+    scratch_allocator() noexcept : arena(&thread_arena()) {}
+    scratch_allocator(scratch_arena *a) noexcept : arena(a) {}
+    template <typename U>
+    scratch_allocator(const scratch_allocator<U> &other) noexcept
+        : arena(other.arena) {}
+
+    T *allocate(size_t count) {
+        if (arena == nullptr) {
+            tga::detail::count_allocation(count * sizeof(T));
+            return (T *)::operator new(count * sizeof(T));
+        }
+        return (T *)arena->allocate(count * sizeof(T), alignof(T));
+    }
+    void deallocate(T *ptr, size_t count) noexcept {
+        if (arena == nullptr) {
+            ::operator delete(ptr);
+            return;
+        }
+        arena->deallocate(ptr, count * sizeof(T), alignof(T));
+    }
+    template <typename U>
+    void construct(U *ptr) noexcept {
+        ::new ((void *)ptr) U;
+    }
+    template <typename U, typename... Args>
+    void construct(U *ptr, Args &&...args) {
+        ::new ((void *)ptr) U(std::forward<Args>(args)...);
+    }
+
+    template <typename U>
+    bool operator==(const scratch_allocator<U> &other) const noexcept {
+        return arena == other.arena;
+    }
+    template <typename U>
+    bool operator!=(const scratch_allocator<U> &other) const noexcept {
+        return arena != other.arena;
+    }
+};
+
+template <typename T>
+using scratch_vector = std::vector<T, scratch_allocator<T>>;
+
 struct color_map {
     uint16_t first_index{0};
     uint16_t entry_count{0};
     uint8_t bytes_per_entry{0};
-    std::vector<uint8_t> pixels;
+    scratch_vector<uint8_t> pixels;
+    // The entries widened to 32 bits, for the table driven expansion.
+    scratch_vector<uint32_t> table;
+
+    color_map() = default;
+    explicit color_map(scratch_arena *arena) : pixels(arena), table(arena) {}
 };
 
 #define HEADER_SIZE 18
 
+// TGA 2.0 footer: extension offset, developer area offset and signature.
+#define FOOTER_SIZE 26
+#define FOOTER_SIGNATURE "TRUEVISION-XFILE."
+
 #define IS_SUPPORTED_IMAGE_TYPE(header)                  \
     ((header).image_type == TGA_TYPE_COLOR_MAPPED ||     \
      (header).image_type == TGA_TYPE_TRUE_COLOR ||       \
@@ -90,6 +357,7 @@ int pixel_format_to_pixel_size(tga::tga_pixel_format format) {
         case tga::tga_pixel_format::TGA_PIXEL_RGB24:
             return 3;
         case tga::tga_pixel_format::TGA_PIXEL_ARGB32:
+        case tga::tga_pixel_format::TGA_PIXEL_ABGR32:
             return 4;
         default:
             return -1;
@@ -101,8 +369,8 @@ int pixel_format_to_pixel_size(tga::tga_pixel_format format) {
 bool set_pixel_format(tga::tga_pixel_format &format, const tga_header &header) {
     if (IS_COLOR_MAPPED(header)) {
         // If the supported pixel_depth is changed, remember to also change
-        // the pixel_to_map_index() function.
-        if (header.pixel_depth == 8) {
+        // the pixel_to_map_index() and expand_indices() functions.
+        if (header.pixel_depth == 8 || header.pixel_depth == 16) {
             switch (header.map_entry_size) {
                 case 15:
                 case 16:
@@ -141,403 +409,5597 @@ bool set_pixel_format(tga::tga_pixel_format &format, const tga_header &header) {
     return false;
 }
 
-// Used for color mapped image decode.
-uint16_t pixel_to_map_index(uint8_t *pixel_ptr) {
-    // Because only 8-bit index is supported now, so implemented in this way.
-    return pixel_ptr[0];
+// Reads a little-endian 16-bit value.
+uint16_t read_u16_le(const uint8_t *bytes) {
+    return (uint16_t)(bytes[0] | (bytes[1] << 8));
+}
+
+// Parses the raw header bytes into the header struct.
+void parse_header(const uint8_t *bytes, tga_header *header) {
+    header->id_length = bytes[0];
+    header->map_type = bytes[1];
+    header->image_type = bytes[2];
+    header->map_first_entry = read_u16_le(bytes + 3);
+    header->map_length = read_u16_le(bytes + 5);
+    header->map_entry_size = bytes[7];
+    header->image_x_origin = read_u16_le(bytes + 8);
+    header->image_y_origin = read_u16_le(bytes + 10);
+    header->image_width = read_u16_le(bytes + 12);
+    header->image_height = read_u16_le(bytes + 14);
+    header->pixel_depth = bytes[16];
+    header->image_descriptor = bytes[17];
+}
+
+// Checks if the header describes an image that can be loaded and gets the
+// image information from it.
+tga::tga_error check_header(const tga_header &header, tga::tga_info *info) {
+    if (header.map_type > 1) {
+        return tga::tga_error::TGA_ERROR_UNSUPPORTED_COLOR_MAP_TYPE;
+    }
+    if (header.image_type == TGA_TYPE_NO_DATA) {
+        return tga::tga_error::TGA_ERROR_NO_DATA;
+    }
+    if (!IS_SUPPORTED_IMAGE_TYPE(header)) {
+        return tga::tga_error::TGA_ERROR_UNSUPPORTED_IMAGE_TYPE;
+    }
+    if (header.image_width <= 0 || header.image_height <= 0) {
+        // No need to check if the image size exceeds
+        // TGA_MAX_IMAGE_DIMENSIONS.
+        return tga::tga_error::TGA_ERROR_INVALID_IMAGE_DIMENSIONS;
+    }
+    if (!set_pixel_format(info->pixel_format, header)) {
+        return tga::tga_error::TGA_ERROR_UNSUPPORTED_PIXEL_FORMAT;
+    }
+    info->width = header.image_width;
+    info->height = header.image_height;
+    return tga::tga_error::TGA_NO_ERROR;
+}
+
+// Used for color mapped image decode. Indices are 8 or 16-bit.
+uint16_t pixel_to_map_index(const uint8_t *pixel_ptr, uint8_t index_size) {
+    return index_size == 1 ? pixel_ptr[0] : read_u16_le(pixel_ptr);
+}
+
+// Widens the color map entries to 32 bits, so that looking up an entry is a
+// single load.
+void build_color_table(color_map *map) {
+    map->table.assign(map->entry_count, 0);
+    for (size_t i = 0; i < map->entry_count; ++i) {
+        memcpy(&map->table[i], map->pixels.data() + i * map->bytes_per_entry,
+               map->bytes_per_entry);
+    }
 }
 
 // Gets the color of the specified index from the map.
 // Returns true means no error, otherwise returns false.
 bool try_get_color_from_map(uint8_t *dest, uint16_t index,
                             const color_map *map) {
-    index -= map->first_index;
-    if (index < 0 && index >= map->entry_count) {
+    // Indices below first_index wrap around to large offsets.
+    uint32_t offset = (uint32_t)index - map->first_index;
+    if (offset >= map->entry_count) {
         return false;
     }
-    memcpy(dest, map->pixels.data() + map->bytes_per_entry * index,
+    memcpy(dest, map->pixels.data() + map->bytes_per_entry * offset,
            map->bytes_per_entry);
     return true;
 }
 
-// Decode image data from file stream.
-// Still a C style function
-tga::tga_error decode_data(uint8_t *data, const tga::tga_info *info,
-                           uint8_t pixel_size, bool is_color_mapped,
-                           const color_map *map, std::ifstream &stream) {
-    tga::tga_error error_code = tga::tga_error::TGA_NO_ERROR;
-    size_t pixel_count = (size_t)info->width * info->height;
+// Stores the low E bytes of a color table entry.
+template <int E>
+inline void store_entry(uint8_t *dest, uint32_t entry) {
+    memcpy(dest, &entry, E);
+}
 
-    if (is_color_mapped) {
-        for (; pixel_count > 0; --pixel_count) {
-            if (stream.read((char *)data, pixel_size).gcount() != pixel_size) {
-                error_code = tga::tga_error::TGA_ERROR_FILE_CANNOT_READ;
-                break;
+// Expands count color map indices of I bytes from src into entries of E
+// bytes at dest.
+// Returns false if an index is outside the color map, otherwise returns true.
+template <int E, int I>
+bool expand_indices(uint8_t *dest, const uint8_t *src, size_t count,
+                    const color_map *map) {
+    const uint32_t *table = map->table.data();
+    const uint32_t first_index = map->first_index;
+    const uint32_t entry_count = map->entry_count;
+    size_t i = 0;
+
+    if (I == 1 && first_index == 0 && entry_count >= 256) {
+        // Every 8-bit index is in the map, so there is nothing to check.
+#ifdef TGA_USE_AVX2
+        if constexpr (E == 4) {
+            for (; i + 8 <= count; i += 8) {
+                __m128i index8 = _mm_loadl_epi64((const __m128i *)(src + i));
+                __m256i index32 = _mm256_cvtepu8_epi32(index8);
+                __m256i entries =
+                    _mm256_i32gather_epi32((const int *)table, index32, 4);
+                _mm256_storeu_si256((__m256i *)(dest + i * 4), entries);
             }
-            // In color mapped image, the pixel as the index value of the color
-            // map. The actual pixel value is found from the color map.
-            uint16_t index = pixel_to_map_index(data);
-            if (!try_get_color_from_map(data, index, map)) {
-                error_code = tga::tga_error::TGA_ERROR_COLOR_MAP_INDEX_FAILED;
-                break;
+        }
+#endif
+        if constexpr (E == 3) {
+            // Store 4 bytes at a time, the extra byte is overwritten by the
+            // next pixel.
+            for (; i + 1 < count; ++i) {
+                store_entry<4>(dest + i * 3, table[src[i]]);
             }
-            data += map->bytes_per_entry;
         }
-    } else {
-        size_t data_size = pixel_count * pixel_size;
-        if (stream.read((char *)data, data_size).gcount() != data_size) {
-            error_code = tga::tga_error::TGA_ERROR_FILE_CANNOT_READ;
+        for (; i < count; ++i) {
+            store_entry<E>(dest + i * E, table[src[i]]);
         }
+        return true;
     }
-    return error_code;
-}
 
-// Decode image data with run-length encoding from file stream.
-// Still a C style function
-tga::tga_error decode_data_rle(uint8_t *data, const tga::tga_info *info,
-                               uint8_t pixel_size, bool is_color_mapped,
-                               const color_map *map, std::ifstream &stream) {
-    tga::tga_error error_code = tga::tga_error::TGA_NO_ERROR;
-    size_t pixel_count = (size_t)info->width * info->height;
-    bool is_run_length_packet = false;
-    uint8_t packet_count = 0;
-    std::vector<uint8_t> pixel_buffer(is_color_mapped ? map->bytes_per_entry
-                                                      : pixel_size);
+    for (; i < count; ++i) {
+        uint32_t index = I == 1 ? src[i] : read_u16_le(src + i * 2);
+        // Indices below first_index wrap around to large offsets.
+        uint32_t offset = index - first_index;
+        if (offset >= entry_count) {
+            return false;
+        }
+        store_entry<E>(dest + i * E, table[offset]);
+    }
+    return true;
+}
 
-    // The actual pixel size of the image, In order not to be confused with the
-    // name of the parameter pixel_size, named data element.
-    uint8_t data_element_size = pixel_format_to_pixel_size(info->pixel_format);
+// Expands count color map indices, for any supported entry and index size.
+// Returns false if an index is outside the color map, otherwise returns true.
+bool expand_indices(uint8_t *dest, const uint8_t *src, size_t count,
+                    const color_map *map, uint8_t index_size) {
+    switch (map->bytes_per_entry * 2 + index_size - 1) {
+        case 1 * 2:
+            return expand_indices<1, 1>(dest, src, count, map);
+        case 1 * 2 + 1:
+            return expand_indices<1, 2>(dest, src, count, map);
+        case 2 * 2:
+            return expand_indices<2, 1>(dest, src, count, map);
+        case 2 * 2 + 1:
+            return expand_indices<2, 2>(dest, src, count, map);
+        case 3 * 2:
+            return expand_indices<3, 1>(dest, src, count, map);
+        case 3 * 2 + 1:
+            return expand_indices<3, 2>(dest, src, count, map);
+        case 4 * 2:
+            return expand_indices<4, 1>(dest, src, count, map);
+        case 4 * 2 + 1:
+            return expand_indices<4, 2>(dest, src, count, map);
+        default:
+            return false;
+    }
+}
 
-    for (; pixel_count > 0; --pixel_count) {
-        if (packet_count == 0) {
-            uint8_t repetition_count_field;
-            if (stream.read((char *)&repetition_count_field, 1).gcount() != 1) {
-                error_code = tga::tga_error::TGA_ERROR_FILE_CANNOT_READ;
-                break;
-            }
-            is_run_length_packet = repetition_count_field & 0x80;
-            packet_count = (repetition_count_field & 0x7F) + 1;
-            if (is_run_length_packet) {
-                if (stream.read((char *)pixel_buffer.data(), pixel_size)
-                        .gcount() != pixel_size) {
-                    error_code = tga::tga_error::TGA_ERROR_FILE_CANNOT_READ;
-                    break;
-                }
-                if (is_color_mapped) {
-                    // In color mapped image, the pixel as the index value of
-                    // the color map. The actual pixel value is found from the
-                    // color map.
-                    uint16_t index = pixel_to_map_index(pixel_buffer.data());
-                    if (!try_get_color_from_map(pixel_buffer.data(), index,
-                                                map)) {
-                        error_code =
-                            tga::tga_error::TGA_ERROR_COLOR_MAP_INDEX_FAILED;
-                        break;
-                    }
-                }
-            }
-        }
+// Pixel format conversion goes through ARGB32: the source pixels are widened
+// to it and narrowed from it to the target format. Conversions that neither
+// start nor end at ARGB32 go through a small buffer that stays in cache, unless
+// a kernel does them in a single pass.
+typedef void (*convert_kernel)(uint8_t *dest, const uint8_t *src,
+                               size_t count);
 
-        if (is_run_length_packet) {
-            memcpy(data, pixel_buffer.data(), data_element_size);
-        } else {
-            if (stream.read((char *)data, pixel_size).gcount() != pixel_size) {
-                error_code = tga::tga_error::TGA_ERROR_FILE_CANNOT_READ;
-                break;
-            }
-            if (is_color_mapped) {
-                // Again, in color mapped image, the pixel as the index value of
-                // the color map. The actual pixel value is found from the color
-                // map.
-                uint16_t index = pixel_to_map_index(data);
-                if (!try_get_color_from_map(data, index, map)) {
-                    error_code =
-                        tga::tga_error::TGA_ERROR_COLOR_MAP_INDEX_FAILED;
-                    break;
-                }
-            }
-        }
+#define PIXEL_FORMAT_COUNT 6
+#define CONVERT_CHUNK_SIZE 256
 
-        --packet_count;
-        data += data_element_size;
-    }
+// Scales a 5-bit channel to 8 bits, so that 31 becomes 255.
+inline uint8_t expand_5_bits(uint32_t value) {
+    return (uint8_t)((value << 3) | (value >> 2));
+}
 
-    return error_code;
+// Gets the luma of a color with the Rec. 601 weights, in 8.8 fixed point.
+// Gray colors keep their value.
+inline uint8_t luminance(uint32_t r, uint32_t g, uint32_t b) {
+    return (uint8_t)((77 * r + 150 * g + 29 * b + 128) >> 8);
 }
 
-tga::tga_error save_image(const uint8_t *data, const tga::tga_info *info,
-                          std::ofstream &stream) {
-    int pixel_size = pixel_format_to_pixel_size(info->pixel_format);
-    uint8_t header[HEADER_SIZE];
-    memset(header, 0, HEADER_SIZE);
-    if (info->pixel_format == tga::tga_pixel_format::TGA_PIXEL_BW8 ||
-        info->pixel_format == tga::tga_pixel_format::TGA_PIXEL_BW16) {
-        header[2] = (uint8_t)TGA_TYPE_GRAYSCALE;
-    } else {
-        header[2] = (uint8_t)TGA_TYPE_TRUE_COLOR;
+void bw8_to_argb32(uint8_t *dest, const uint8_t *src, size_t count) {
+    for (size_t i = 0; i < count; ++i, dest += 4) {
+        dest[0] = dest[1] = dest[2] = src[i];
+        dest[3] = 0xFF;
     }
-    header[12] = info->width & 0xFF;
-    header[13] = (info->width >> 8) & 0xFF;
-    header[14] = info->height & 0xFF;
-    header[15] = (info->height >> 8) & 0xFF;
-    header[16] = pixel_size * 8;
-    if (info->pixel_format == tga::tga_pixel_format::TGA_PIXEL_ARGB32) {
-        header[17] = 0x28;
-    } else {
-        header[17] = 0x20;
+}
+
+void bw16_to_argb32(uint8_t *dest, const uint8_t *src, size_t count) {
+    // Keeps the most significant byte of the little-endian gray value.
+    for (size_t i = 0; i < count; ++i, dest += 4) {
+        dest[0] = dest[1] = dest[2] = src[i * 2 + 1];
+        dest[3] = 0xFF;
     }
+}
 
-    if (!stream.write((char *)header, HEADER_SIZE)) {
-        return tga::tga_error::TGA_ERROR_FILE_CANNOT_WRITE;
+void rgb555_to_argb32(uint8_t *dest, const uint8_t *src, size_t count) {
+    // The attribute bit is ignored, like everywhere else.
+    for (size_t i = 0; i < count; ++i, dest += 4) {
+        uint16_t value = read_u16_le(src + i * 2);
+        dest[0] = expand_5_bits(value & 0x1F);
+        dest[1] = expand_5_bits((value >> 5) & 0x1F);
+        dest[2] = expand_5_bits((value >> 10) & 0x1F);
+        dest[3] = 0xFF;
     }
+}
 
-    size_t data_size = (size_t)info->width * info->height * pixel_size;
-    if (!stream.write((char *)data, data_size)) {
-        return tga::tga_error::TGA_ERROR_FILE_CANNOT_WRITE;
+// Widens 24-bit pixels to opaque 32-bit ones, in ARGB32 or, with red and blue
+// swapped, ABGR32.
+template <bool SwapRedBlue>
+void rgb24_to_rgb32(uint8_t *dest, const uint8_t *src, size_t count) {
+    for (size_t i = 0; i < count; ++i, src += 3, dest += 4) {
+        dest[0] = src[SwapRedBlue ? 2 : 0];
+        dest[1] = src[1];
+        dest[2] = src[SwapRedBlue ? 0 : 2];
+        dest[3] = 0xFF;
     }
+}
 
-    return tga::tga_error::TGA_NO_ERROR;
+// Narrows ARGB32 or, with red and blue swapped, ABGR32 pixels to 24 bits.
+template <bool SwapRedBlue>
+void rgb32_to_rgb24(uint8_t *dest, const uint8_t *src, size_t count) {
+    for (size_t i = 0; i < count; ++i, src += 4, dest += 3) {
+        dest[0] = src[SwapRedBlue ? 2 : 0];
+        dest[1] = src[1];
+        dest[2] = src[SwapRedBlue ? 0 : 2];
+    }
 }
 
-// ----------------------tga::Image implementation----------------------
-namespace tga {
+// Converts between ARGB32 and ABGR32, both ways.
+void swap_red_blue32(uint8_t *dest, const uint8_t *src, size_t count) {
+    for (size_t i = 0; i < count; ++i, src += 4, dest += 4) {
+        uint8_t blue = src[0];
+        dest[0] = src[2];
+        dest[1] = src[1];
+        dest[2] = blue;
+        dest[3] = src[3];
+    }
+}
 
-Image::Image(int width, int height, tga_pixel_format format)
-    : img_info{(uint16_t)width, (uint16_t)height, format} {
-    if (!check_dimensions(width, height)) {
-        err = tga_error::TGA_ERROR_INVALID_IMAGE_DIMENSIONS;
-        return;
+void argb32_to_bw8(uint8_t *dest, const uint8_t *src, size_t count) {
+    for (size_t i = 0; i < count; ++i, src += 4) {
+        dest[i] = luminance(src[2], src[1], src[0]);
     }
+}
 
-    int pixel_size = pixel_format_to_pixel_size(format);
-    if (pixel_size == -1) {
-        err = tga_error::TGA_ERROR_UNSUPPORTED_PIXEL_FORMAT;
+void argb32_to_bw16(uint8_t *dest, const uint8_t *src, size_t count) {
+    // Scales the luma by 257, so that 255 becomes 65535.
+    for (size_t i = 0; i < count; ++i, src += 4) {
+        dest[i * 2] = dest[i * 2 + 1] = luminance(src[2], src[1], src[0]);
     }
+}
 
-    // reallocate data
-    data.resize((size_t)width * height * pixel_size);
+void argb32_to_rgb555(uint8_t *dest, const uint8_t *src, size_t count) {
+    for (size_t i = 0; i < count; ++i, src += 4) {
+        uint16_t value = (uint16_t)((src[0] >> 3) | ((src[1] >> 3) << 5) |
+                                    ((src[2] >> 3) << 10));
+        dest[i * 2] = value & 0xFF;
+        dest[i * 2 + 1] = value >> 8;
+    }
+}
 
-    err = tga_error::TGA_NO_ERROR;
+#ifdef TGA_USE_SSE2
+void rgb555_to_argb32_sse2(uint8_t *dest, const uint8_t *src, size_t count) {
+    const __m128i mask = _mm_set1_epi16(0x1F);
+    const __m128i alpha = _mm_set1_epi16((short)0xFF00);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i value = _mm_loadu_si128((const __m128i *)(src + i * 2));
+        __m128i b = _mm_and_si128(value, mask);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(value, 5), mask);
+        __m128i r = _mm_and_si128(_mm_srli_epi16(value, 10), mask);
+        b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+        g = _mm_or_si128(_mm_slli_epi16(g, 3), _mm_srli_epi16(g, 2));
+        r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+        // Pairs of 16-bit lanes are BG and RA, interleaving them gives the
+        // 32-bit pixels.
+        __m128i bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+        __m128i ra = _mm_or_si128(r, alpha);
+        _mm_storeu_si128((__m128i *)(dest + i * 4),
+                         _mm_unpacklo_epi16(bg, ra));
+        _mm_storeu_si128((__m128i *)(dest + i * 4 + 16),
+                         _mm_unpackhi_epi16(bg, ra));
+    }
+    rgb555_to_argb32(dest + i * 4, src + i * 2, count - i);
 }
 
-Image::Image(std::string_view filepath) { load(filepath); }
+void argb32_to_bw8_sse2(uint8_t *dest, const uint8_t *src, size_t count) {
+    const __m128i weights = _mm_setr_epi16(29, 150, 77, 0, 29, 150, 77, 0);
+    const __m128i round = _mm_set1_epi32(128);
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i pixels = _mm_loadu_si128((const __m128i *)(src + i * 4));
+        // Each pixel gives two sums, 29B + 150G and 77R.
+        __m128 lo = _mm_castsi128_ps(
+            _mm_madd_epi16(_mm_unpacklo_epi8(pixels, zero), weights));
+        __m128 hi = _mm_castsi128_ps(
+            _mm_madd_epi16(_mm_unpackhi_epi8(pixels, zero), weights));
+        __m128i bg = _mm_castps_si128(
+            _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)));
+        __m128i r = _mm_castps_si128(
+            _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)));
+        __m128i luma = _mm_srli_epi32(
+            _mm_add_epi32(_mm_add_epi32(bg, r), round), 8);
+        luma = _mm_packs_epi32(luma, luma);
+        luma = _mm_packus_epi16(luma, luma);
+        uint32_t packed = (uint32_t)_mm_cvtsi128_si32(luma);
+        memcpy(dest + i, &packed, 4);
+    }
+    argb32_to_bw8(dest + i, src + i * 4, count - i);
+}
+#endif
 
-bool Image::load(std::string_view filepath) {
-    std::ifstream inFile(filepath.data(), std::ios::binary);
-    if (!inFile.good()) {
-        err = tga_error::TGA_ERROR_FILE_CANNOT_READ;
-        return false;
+#ifdef TGA_RUNTIME_DISPATCH
+template <bool SwapRedBlue>
+TGA_TARGET("ssse3")
+void rgb24_to_rgb32_ssse3(uint8_t *dest, const uint8_t *src, size_t count) {
+    const __m128i order =
+        SwapRedBlue
+            ? _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9,
+                            -1)
+            : _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+                            -1);
+    const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+    size_t i = 0;
+    // Each step loads 16 bytes for 4 pixels, so it stops 2 pixels early to
+    // stay inside the source.
+    for (; i + 6 <= count; i += 4) {
+        __m128i pixels = _mm_loadu_si128((const __m128i *)(src + i * 3));
+        pixels = _mm_or_si128(_mm_shuffle_epi8(pixels, order), alpha);
+        _mm_storeu_si128((__m128i *)(dest + i * 4), pixels);
     }
+    rgb24_to_rgb32<SwapRedBlue>(dest + i * 4, src + i * 3, count - i);
+}
 
-    tga_header header;
+template <bool SwapRedBlue>
+TGA_TARGET("ssse3")
+void rgb32_to_rgb24_ssse3(uint8_t *dest, const uint8_t *src, size_t count) {
+    const __m128i order =
+        SwapRedBlue
+            ? _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1,
+                            -1, -1)
+            : _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1,
+                            -1, -1);
+    size_t i = 0;
+    // Each step stores 16 bytes for 4 pixels, the last 4 are overwritten by
+    // the next step. It stops 2 pixels early to stay inside dest.
+    for (; i + 6 <= count; i += 4) {
+        __m128i pixels = _mm_loadu_si128((const __m128i *)(src + i * 4));
+        _mm_storeu_si128((__m128i *)(dest + i * 3),
+                         _mm_shuffle_epi8(pixels, order));
+    }
+    rgb32_to_rgb24<SwapRedBlue>(dest + i * 3, src + i * 4, count - i);
+}
 
-    // -----------Start load header-----------
-    {
-        inFile.read((char *)&header.id_length, 1);
-        inFile.read((char *)&header.map_type, 1);
-        inFile.read((char *)&header.image_type, 1);
-        inFile.read((char *)&header.map_first_entry, 2);
-        inFile.read((char *)&header.map_length, 2);
-        inFile.read((char *)&header.map_entry_size, 1);
-        inFile.read((char *)&header.image_x_origin, 2);
-        inFile.read((char *)&header.image_y_origin, 2);
-        inFile.read((char *)&header.image_width, 2);
-        inFile.read((char *)&header.image_height, 2);
-        inFile.read((char *)&header.pixel_depth, 1);
-        inFile.read((char *)&header.image_descriptor, 1);
-
-        if (inFile.rdstate()) {
-            err = tga_error::TGA_ERROR_FILE_CANNOT_READ;
-            return false;
-        }
-        if (header.map_type > 1) {
-            err = tga_error::TGA_ERROR_UNSUPPORTED_COLOR_MAP_TYPE;
-            return false;
-        }
-        if (header.image_type == TGA_TYPE_NO_DATA) {
-            err = tga_error::TGA_ERROR_NO_DATA;
-            return false;
-        }
-        if (!IS_SUPPORTED_IMAGE_TYPE(header)) {
-            err = tga_error::TGA_ERROR_UNSUPPORTED_IMAGE_TYPE;
-            return false;
-        }
-        if (header.image_width <= 0 || header.image_height <= 0) {
-            // No need to check if the image size exceeds
-            // TGA_MAX_IMAGE_DIMENSIONS.
-            err = tga_error::TGA_ERROR_INVALID_IMAGE_DIMENSIONS;
-            return false;
-        }
-        if (!set_pixel_format(img_info.pixel_format, header)) {
-            err = tga_error::TGA_ERROR_UNSUPPORTED_PIXEL_FORMAT;
-            return false;
-        }
+TGA_TARGET("ssse3")
+void swap_red_blue32_ssse3(uint8_t *dest, const uint8_t *src, size_t count) {
+    const __m128i order =
+        _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i pixels = _mm_loadu_si128((const __m128i *)(src + i * 4));
+        _mm_storeu_si128((__m128i *)(dest + i * 4),
+                         _mm_shuffle_epi8(pixels, order));
     }
-    this->img_info.width = header.image_width;
-    this->img_info.height = header.image_height;
-    // img_info.pixel_format is already set
+    swap_red_blue32(dest + i * 4, src + i * 4, count - i);
+}
 
-    // No need to handle the content of the ID field, so skip directly.
-    if (!inFile.seekg(header.id_length, std::ios::cur)) {
-        err = tga_error::TGA_ERROR_FILE_CANNOT_READ;
-        return false;
+template <bool SwapRedBlue>
+TGA_TARGET("avx2")
+void rgb24_to_rgb32_avx2(uint8_t *dest, const uint8_t *src, size_t count) {
+    const __m256i order =
+        SwapRedBlue
+            ? _mm256_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10,
+                               9, -1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1,
+                               11, 10, 9, -1)
+            : _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10,
+                               11, -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1,
+                               9, 10, 11, -1);
+    // Moves source bytes 12..27 to the upper lane, so that each lane holds
+    // 4 pixels for the in-lane shuffle.
+    const __m256i spread = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+    const __m256i alpha = _mm256_set1_epi32((int)0xFF000000);
+    size_t i = 0;
+    // Each step loads 32 bytes for 8 pixels, so it stops 3 pixels early to
+    // stay inside the source.
+    for (; i + 11 <= count; i += 8) {
+        __m256i pixels = _mm256_loadu_si256((const __m256i *)(src + i * 3));
+        pixels = _mm256_permutevar8x32_epi32(pixels, spread);
+        pixels = _mm256_or_si256(_mm256_shuffle_epi8(pixels, order), alpha);
+        _mm256_storeu_si256((__m256i *)(dest + i * 4), pixels);
     }
+    rgb24_to_rgb32<SwapRedBlue>(dest + i * 4, src + i * 3, count - i);
+}
 
-    bool is_color_mapped = IS_COLOR_MAPPED(header);
-    bool is_rle = IS_RLE(header);
+TGA_TARGET("avx2")
+void swap_red_blue32_avx2(uint8_t *dest, const uint8_t *src, size_t count) {
+    const __m256i order = _mm256_setr_epi8(
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15, 2, 1, 0, 3, 6, 5,
+        4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i pixels = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+        _mm256_storeu_si256((__m256i *)(dest + i * 4),
+                            _mm256_shuffle_epi8(pixels, order));
+    }
+    swap_red_blue32(dest + i * 4, src + i * 4, count - i);
+}
 
-    color_map color_map;
+struct cpu_features {
+    bool ssse3{false};
+    bool avx2{false};
+};
 
-    // -----------Handle color map field-----------
-    {
-        size_t map_size =
-            header.map_length * BITS_TO_BYTES(header.map_entry_size);
-        if (is_color_mapped) {
-            color_map.first_index = header.map_first_entry;
-            color_map.entry_count = header.map_length;
-            color_map.bytes_per_entry = BITS_TO_BYTES(header.map_entry_size);
-            color_map.pixels.resize(map_size);
-
-            if (inFile.read((char *)color_map.pixels.data(), map_size)
-                    .gcount() != map_size) {
-                err = tga_error::TGA_ERROR_FILE_CANNOT_READ;
-                return false;
-            }
-        } else if (header.map_type == 1) {
-            // The image is not color mapped at this time, but contains a color
-            // map. So skips the color map data block directly.
-            if (!inFile.seekg(map_size, std::ios::cur)) {
-                err = tga_error::TGA_ERROR_FILE_CANNOT_READ;
-                return false;
-            }
-        }
+cpu_features detect_cpu_features() {
+    cpu_features features;
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_cpu_init();
+    features.ssse3 = __builtin_cpu_supports("ssse3");
+    features.avx2 = __builtin_cpu_supports("avx2");
+#else
+    int regs[4];
+    __cpuid(regs, 0);
+    int max_leaf = regs[0];
+    __cpuid(regs, 1);
+    features.ssse3 = (regs[2] >> 9) & 1;
+    // AVX2 also needs the OS to save the upper halves of the registers.
+    bool has_avx = ((regs[2] >> 28) & 1) && ((regs[2] >> 27) & 1) &&
+                   (_xgetbv(0) & 6) == 6;
+    if (has_avx && max_leaf >= 7) {
+        __cpuidex(regs, 7, 0);
+        features.avx2 = (regs[1] >> 5) & 1;
     }
+#endif
+    return features;
+}
+#endif
 
-    this->data.resize((size_t)header.image_width * header.image_height *
-                      pixel_format_to_pixel_size(img_info.pixel_format));
+// Conversion kernels, indexed by source then target pixel format. Null when
+// there is no single pass kernel for the pair.
+struct conversion_kernels {
+    convert_kernel kernels[PIXEL_FORMAT_COUNT][PIXEL_FORMAT_COUNT] = {};
 
-    // -----------Load image data-----------
-    uint8_t pixel_size = BITS_TO_BYTES(header.pixel_depth);
-    if (is_rle) {
-        err = decode_data_rle(data.data(), &img_info, pixel_size,
-                              is_color_mapped, &color_map, inFile);
-    } else {
-        err = decode_data(data.data(), &img_info, pixel_size, is_color_mapped,
-                          &color_map, inFile);
+    convert_kernel &at(tga::tga_pixel_format from, tga::tga_pixel_format to) {
+        return kernels[(int)from][(int)to];
     }
-
-    if (err != tga_error::TGA_NO_ERROR) {
-        return false;
+    convert_kernel at(tga::tga_pixel_format from,
+                      tga::tga_pixel_format to) const {
+        return kernels[(int)from][(int)to];
     }
+};
 
-    // Flip the image if necessary, to keep the origin in upper left corner.
-    bool b_flip_h = header.image_descriptor & 0x10;
-    bool b_flip_v = !(header.image_descriptor & 0x20);
-    if (b_flip_h) {
-        flip_h();
+// Picks the fastest kernels the CPU runs.
+conversion_kernels select_conversion_kernels() {
+    using format = tga::tga_pixel_format;
+    conversion_kernels table;
+    table.at(format::TGA_PIXEL_BW8, format::TGA_PIXEL_ARGB32) = bw8_to_argb32;
+    table.at(format::TGA_PIXEL_BW16, format::TGA_PIXEL_ARGB32) =
+        bw16_to_argb32;
+    table.at(format::TGA_PIXEL_RGB555, format::TGA_PIXEL_ARGB32) =
+        rgb555_to_argb32;
+    table.at(format::TGA_PIXEL_RGB24, format::TGA_PIXEL_ARGB32) =
+        rgb24_to_rgb32<false>;
+    table.at(format::TGA_PIXEL_RGB24, format::TGA_PIXEL_ABGR32) =
+        rgb24_to_rgb32<true>;
+    table.at(format::TGA_PIXEL_ABGR32, format::TGA_PIXEL_ARGB32) =
+        swap_red_blue32;
+    table.at(format::TGA_PIXEL_ARGB32, format::TGA_PIXEL_BW8) = argb32_to_bw8;
+    table.at(format::TGA_PIXEL_ARGB32, format::TGA_PIXEL_BW16) =
+        argb32_to_bw16;
+    table.at(format::TGA_PIXEL_ARGB32, format::TGA_PIXEL_RGB555) =
+        argb32_to_rgb555;
+    table.at(format::TGA_PIXEL_ARGB32, format::TGA_PIXEL_RGB24) =
+        rgb32_to_rgb24<false>;
+    table.at(format::TGA_PIXEL_ABGR32, format::TGA_PIXEL_RGB24) =
+        rgb32_to_rgb24<true>;
+    table.at(format::TGA_PIXEL_ARGB32, format::TGA_PIXEL_ABGR32) =
+        swap_red_blue32;
+
+#ifdef TGA_USE_SSE2
+    table.at(format::TGA_PIXEL_RGB555, format::TGA_PIXEL_ARGB32) =
+        rgb555_to_argb32_sse2;
+    table.at(format::TGA_PIXEL_ARGB32, format::TGA_PIXEL_BW8) =
+        argb32_to_bw8_sse2;
+#endif
+
+#ifdef TGA_RUNTIME_DISPATCH
+    cpu_features cpu = detect_cpu_features();
+    if (cpu.ssse3) {
+        table.at(format::TGA_PIXEL_RGB24, format::TGA_PIXEL_ARGB32) =
+            rgb24_to_rgb32_ssse3<false>;
+        table.at(format::TGA_PIXEL_RGB24, format::TGA_PIXEL_ABGR32) =
+            rgb24_to_rgb32_ssse3<true>;
+        table.at(format::TGA_PIXEL_ARGB32, format::TGA_PIXEL_RGB24) =
+            rgb32_to_rgb24_ssse3<false>;
+        table.at(format::TGA_PIXEL_ABGR32, format::TGA_PIXEL_RGB24) =
+            rgb32_to_rgb24_ssse3<true>;
+        table.at(format::TGA_PIXEL_ABGR32, format::TGA_PIXEL_ARGB32) =
+            swap_red_blue32_ssse3;
+        table.at(format::TGA_PIXEL_ARGB32, format::TGA_PIXEL_ABGR32) =
+            swap_red_blue32_ssse3;
     }
-    if (b_flip_v) {
-        flip_v();
+    if (cpu.avx2) {
+        table.at(format::TGA_PIXEL_RGB24, format::TGA_PIXEL_ARGB32) =
+            rgb24_to_rgb32_avx2<false>;
+        table.at(format::TGA_PIXEL_RGB24, format::TGA_PIXEL_ABGR32) =
+            rgb24_to_rgb32_avx2<true>;
+        table.at(format::TGA_PIXEL_ABGR32, format::TGA_PIXEL_ARGB32) =
+            swap_red_blue32_avx2;
+        table.at(format::TGA_PIXEL_ARGB32, format::TGA_PIXEL_ABGR32) =
+            swap_red_blue32_avx2;
     }
+#endif
+    return table;
+}
 
-    return true;
+const conversion_kernels &get_conversion_kernels() {
+    static const conversion_kernels table = select_conversion_kernels();
+    return table;
 }
 
-bool Image::save(std::string_view filepath) {
-    if (data.empty()) {
-        err = tga_error::TGA_ERROR_NO_DATA;
-        return false;
+// Converts count pixels from src_format at src to dest_format at dest. Both
+// formats must be valid, and the buffers must not overlap.
+void convert_pixels(uint8_t *dest, tga::tga_pixel_format dest_format,
+                    const uint8_t *src, tga::tga_pixel_format src_format,
+                    size_t count) {
+    if (dest_format == src_format) {
+        memcpy(dest, src, count * pixel_format_to_pixel_size(src_format));
+        return;
     }
-
-    // Check if a file with the same name already exists.
-    std::ofstream outFile(filepath.data(), std::ios::binary);
-    if (!outFile.good()) {
-        err = tga_error::TGA_ERROR_FILE_CANNOT_WRITE;
-        return false;
+    const conversion_kernels &table = get_conversion_kernels();
+    convert_kernel kernel = table.at(src_format, dest_format);
+    if (kernel != nullptr) {
+        kernel(dest, src, count);
+        return;
     }
 
-    err = save_image(data.data(), &img_info, outFile);
-    outFile.close();  // you can't delete a file while it's opened.
-
-    if (err != tga_error::TGA_NO_ERROR) {
-        std::remove(filepath.data());
+    const tga::tga_pixel_format argb32 =
+        tga::tga_pixel_format::TGA_PIXEL_ARGB32;
+    convert_kernel widen = table.at(src_format, argb32);
+    convert_kernel narrow = table.at(argb32, dest_format);
+    size_t src_size = pixel_format_to_pixel_size(src_format);
+    size_t dest_size = pixel_format_to_pixel_size(dest_format);
+    uint8_t chunk[CONVERT_CHUNK_SIZE * 4];
+    while (count > 0) {
+        size_t n = count < CONVERT_CHUNK_SIZE ? count : CONVERT_CHUNK_SIZE;
+        widen(chunk, src, n);
+        narrow(dest, chunk, n);
+        src += n * src_size;
+        dest += n * dest_size;
+        count -= n;
     }
-    return true;
 }
 
-void Image::flip_h() {
-    if (data.empty()) {
-        return;
-    }
+// Buffered reader used by the decoders, so that the payload is pulled from the
+// source in large blocks and expanded from memory instead of issuing one read
+// per packet or pixel. A buffer created over memory reads it in place.
+#define READ_BLOCK_SIZE 65536
 
-    int pixel_size = pixel_format_to_pixel_size(img_info.pixel_format);
-    std::vector<uint8_t> temp(pixel_size);
-    int flip_num = img_info.width / 2;
-    for (int i = 0; i < flip_num; ++i) {
-        for (int j = 0; j < img_info.height; ++j) {
-            uint8_t *p1 = get_pixel(i, j);
-            uint8_t *p2 = get_pixel(img_info.width - 1 - i, j);
-            // Swap two pixels.
-            memcpy(temp.data(), p1, pixel_size);
-            memcpy(p1, p2, pixel_size);
-            memcpy(p2, temp.data(), pixel_size);
+struct read_buffer {
+    const tga::tga_reader *reader{nullptr};
+    scratch_vector<uint8_t> block;
+    const uint8_t *bytes{nullptr};
+    size_t pos{0};
+    size_t end{0};
+
+    explicit read_buffer(const tga::tga_reader &r)
+        : reader(&r), block(READ_BLOCK_SIZE), bytes(block.data()) {}
+    read_buffer(const tga::tga_reader &r, scratch_arena *arena)
+        : reader(&r), block(READ_BLOCK_SIZE, arena), bytes(block.data()) {}
+    read_buffer(const uint8_t *data, size_t size) : bytes(data), end(size) {}
+};
+
+// Reads from the source until size bytes are read or the source ends.
+// Returns the number of bytes read.
+size_t read_from_source(const tga::tga_reader *reader, uint8_t *dest,
+                        size_t size) {
+    size_t total = 0;
+    while (total < size) {
+        size_t count = reader->read(dest + total, size - total);
+        if (count == 0) {
+            break;
         }
+        total += count;
     }
+    return total;
 }
 
-void Image::flip_v() {
-    if (data.empty()) {
-        return;
+// Makes sure that at least `count` unread bytes are in the buffer.
+// Returns false if the source ends before that, otherwise returns true.
+bool ensure_bytes(read_buffer *buffer, size_t count) {
+    size_t available = buffer->end - buffer->pos;
+    if (available >= count) {
+        return true;
     }
-    int pixel_size = pixel_format_to_pixel_size(img_info.pixel_format);
-    std::vector<uint8_t> temp(pixel_size);
-    int flip_num = img_info.height / 2;
-    for (int i = 0; i < flip_num; ++i) {
-        for (int j = 0; j < img_info.width; ++j) {
-            uint8_t *p1 = get_pixel(j, i);
-            uint8_t *p2 = get_pixel(j, img_info.height - 1 - i);
-            // Swap two pixels.
-            memcpy(temp.data(), p1, pixel_size);
-            memcpy(p1, p2, pixel_size);
-            memcpy(p2, temp.data(), pixel_size);
+    if (buffer->reader == nullptr) {
+        return false;
+    }
+    // Move the unread tail to the front, then refill the rest of the block.
+    memmove(buffer->block.data(), buffer->block.data() + buffer->pos,
+            available);
+    if (buffer->block.size() < count) {
+        // Grow geometrically, callers may ask for a little more each time.
+        size_t new_size = buffer->block.size() * 2;
+        buffer->block.resize(new_size > count ? new_size : count);
+    }
+    buffer->bytes = buffer->block.data();
+    buffer->pos = 0;
+    buffer->end = available;
+    // Stop as soon as the request is satisfied, so a slow source doesn't
+    // have to deliver a whole block first.
+    while (buffer->end < count) {
+        size_t read = buffer->reader->read(buffer->block.data() + buffer->end,
+                                           buffer->block.size() - buffer->end);
+        if (read == 0) {
+            return false;
         }
+        buffer->end += read;
     }
+    return true;
 }
 
-tga_error Image::last_error() const { return err; }
-
-uint8_t *Image::get_pixel(int x, int y) {
-    if (x < 0) {
+// Copies `count` bytes to dest. Large reads bypass the block and go straight
+// from the source to dest.
+// Returns false if the source ends before that, otherwise returns true.
+bool read_bytes(read_buffer *buffer, uint8_t *dest, size_t count) {
+    size_t available = buffer->end - buffer->pos;
+    size_t chunk = available < count ? available : count;
+    memcpy(dest, buffer->bytes + buffer->pos, chunk);
+    buffer->pos += chunk;
+    dest += chunk;
+    count -= chunk;
+    if (count == 0) {
+        return true;
+    }
+    if (buffer->reader == nullptr) {
+        return false;
+    }
+    if (count >= buffer->block.size()) {
+        return read_from_source(buffer->reader, dest, count) == count;
+    }
+    if (!ensure_bytes(buffer, count)) {
+        return false;
+    }
+    memcpy(dest, buffer->bytes + buffer->pos, count);
+    buffer->pos += count;
+    return true;
+}
+
+// Skips `count` bytes.
+// Returns false if the source ends before that, otherwise returns true.
+bool skip_bytes(read_buffer *buffer, size_t count) {
+    size_t available = buffer->end - buffer->pos;
+    if (available >= count) {
+        buffer->pos += count;
+        return true;
+    }
+    buffer->pos = buffer->end;
+    count -= available;
+    if (buffer->reader == nullptr) {
+        return false;
+    }
+    if (buffer->reader->skip) {
+        return buffer->reader->skip(count);
+    }
+    // The source can't skip, so read and drop the bytes.
+    while (count > 0) {
+        size_t chunk =
+            count < buffer->block.size() ? count : buffer->block.size();
+        if (!ensure_bytes(buffer, chunk)) {
+            return false;
+        }
+        buffer->pos += chunk;
+        count -= chunk;
+    }
+    return true;
+}
+
+// Moves to offset bytes from the start of the source. The source must be
+// memory or have a seek callback.
+// Returns false if failed, otherwise returns true.
+bool seek_bytes(read_buffer *buffer, size_t offset) {
+    if (buffer->reader == nullptr) {
+        if (offset > buffer->end) {
+            return false;
+        }
+        buffer->pos = offset;
+        return true;
+    }
+    if (!buffer->reader->seek || !buffer->reader->seek(offset)) {
+        return false;
+    }
+    buffer->pos = 0;
+    buffer->end = 0;
+    return true;
+}
+
+// Swaps two pixels of N bytes. Fixed size memcpy compiles to plain moves.
+template <int N>
+inline void swap_pixel(uint8_t *p1, uint8_t *p2) {
+    uint8_t temp[N];
+    memcpy(temp, p1, N);
+    memcpy(p1, p2, N);
+    memcpy(p2, temp, N);
+}
+
+// Reverses the pixels of a row between left and right (exclusive), one pixel
+// at a time. Used for whatever is left after the vector loops.
+template <int N>
+inline void reverse_pixels(uint8_t *left, uint8_t *right) {
+    while (right - left >= 2 * N) {
+        right -= N;
+        swap_pixel<N>(left, right);
+        left += N;
+    }
+}
+
+#ifdef TGA_USE_SSE2
+// Reverses the order of the N-byte elements of a 16 bytes vector.
+template <int N>
+inline __m128i reverse_m128(__m128i v);
+
+template <>
+inline __m128i reverse_m128<4>(__m128i v) {
+    return _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+}
+
+template <>
+inline __m128i reverse_m128<2>(__m128i v) {
+    v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+}
+
+template <>
+inline __m128i reverse_m128<1>(__m128i v) {
+    v = reverse_m128<2>(v);
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+#endif
+
+#ifdef TGA_USE_AVX2
+// Reverses the order of the N-byte elements of a 32 bytes vector.
+template <int N>
+inline __m256i reverse_m256(__m256i v);
+
+template <>
+inline __m256i reverse_m256<4>(__m256i v) {
+    const __m256i order = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+    return _mm256_permutevar8x32_epi32(v, order);
+}
+
+template <>
+inline __m256i reverse_m256<2>(__m256i v) {
+    const __m256i mask = _mm256_setr_epi8(
+        14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1, 14, 15, 12, 13,
+        10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1);
+    v = _mm256_shuffle_epi8(v, mask);
+    return _mm256_permute2x128_si256(v, v, 1);
+}
+
+template <>
+inline __m256i reverse_m256<1>(__m256i v) {
+    const __m256i mask = _mm256_setr_epi8(
+        15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12,
+        11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    v = _mm256_shuffle_epi8(v, mask);
+    return _mm256_permute2x128_si256(v, v, 1);
+}
+#endif
+
+// Reverses the order of the N-byte pixels of a row. Works inwards from both
+// ends: each step loads a vector from each end and stores them reversed at
+// the opposite end.
+template <int N>
+void reverse_row(uint8_t *row, size_t count) {
+    uint8_t *left = row;
+    uint8_t *right = row + count * N;
+    // 24-bit pixels don't fit vector lanes, they always take the scalar path.
+#ifdef TGA_USE_AVX2
+    if constexpr (N != 3) {
+        while (right - left >= 64) {
+            right -= 32;
+            __m256i l = _mm256_loadu_si256((const __m256i *)left);
+            __m256i r = _mm256_loadu_si256((const __m256i *)right);
+            _mm256_storeu_si256((__m256i *)left, reverse_m256<N>(r));
+            _mm256_storeu_si256((__m256i *)right, reverse_m256<N>(l));
+            left += 32;
+        }
+    }
+#endif
+#ifdef TGA_USE_SSE2
+    if constexpr (N != 3) {
+        while (right - left >= 32) {
+            right -= 16;
+            __m128i l = _mm_loadu_si128((const __m128i *)left);
+            __m128i r = _mm_loadu_si128((const __m128i *)right);
+            _mm_storeu_si128((__m128i *)left, reverse_m128<N>(r));
+            _mm_storeu_si128((__m128i *)right, reverse_m128<N>(l));
+            left += 16;
+        }
+    }
+#endif
+    reverse_pixels<N>(left, right);
+}
+
+// Reverses the order of the pixels of a row, for any supported pixel size.
+void reverse_row(uint8_t *row, size_t count, int pixel_size) {
+    switch (pixel_size) {
+        case 1:
+            reverse_row<1>(row, count);
+            break;
+        case 2:
+            reverse_row<2>(row, count);
+            break;
+        case 3:
+            reverse_row<3>(row, count);
+            break;
+        case 4:
+            reverse_row<4>(row, count);
+            break;
+    }
+}
+
+// Tracks where the decoders write, so that each stored scanline lands
+// directly in its final row and direction and no flip pass is needed after
+// the decode. Pixels are handed out in stored order, in spans that never
+// cross the end of a scanline.
+struct row_writer {
+    uint8_t *data;
+    size_t row_size;
+    uint16_t width;
+    uint16_t height;
+    uint8_t element_size;
+    bool flip_h;
+    bool flip_v;
+    // Position in stored order.
+    uint16_t row{0};
+    uint16_t x{0};
+
+    row_writer(uint8_t *d, const tga::tga_info *info, bool b_flip_h,
+               bool b_flip_v)
+        : data(d),
+          width(info->width),
+          height(info->height),
+          element_size(pixel_format_to_pixel_size(info->pixel_format)),
+          flip_h(b_flip_h),
+          flip_v(b_flip_v) {
+        row_size = (size_t)width * element_size;
+    }
+};
+
+// Gets the leftmost byte of the destination of the next `count` pixels, which
+// must not run past the end of the current scanline. When the writer flips
+// horizontally, the pixels have to be written into the span right-to-left.
+uint8_t *next_span(const row_writer *writer, size_t count) {
+    size_t dest_row = writer->flip_v ? writer->height - 1 - writer->row
+                                     : writer->row;
+    size_t dest_x = writer->flip_h ? writer->width - writer->x - count
+                                   : writer->x;
+    return writer->data + dest_row * writer->row_size +
+           dest_x * writer->element_size;
+}
+
+// Moves the writer past `count` pixels of the current scanline.
+void advance_span(row_writer *writer, size_t count) {
+    writer->x += (uint16_t)count;
+    if (writer->x == writer->width) {
+        writer->x = 0;
+        ++writer->row;
+    }
+}
+
+// Bands smaller than this are not worth a thread of their own. Can be set at
+// build time, so that the small test images are split into bands too.
+#ifndef MIN_BAND_SIZE
+#define MIN_BAND_SIZE (256 * 1024)
+#endif
+
+// Resolves the thread count of the policy, 0 means all hardware threads.
+unsigned resolve_thread_count(const tga::ExecutionPolicy &policy) {
+    unsigned thread_count = policy.thread_count;
+    if (thread_count == 0) {
+        thread_count = std::thread::hardware_concurrency();
+    }
+    return thread_count == 0 ? 1 : thread_count;
+}
+
+// Gets how many bands rows [0, row_count) are split into under the policy.
+size_t get_band_count(int row_count, size_t row_size,
+                      const tga::ExecutionPolicy &policy) {
+    size_t band_count = resolve_thread_count(policy);
+    size_t max_bands = (size_t)row_count * row_size / MIN_BAND_SIZE;
+    band_count = band_count < max_bands ? band_count : max_bands;
+    band_count = band_count < (size_t)row_count ? band_count : row_count;
+    return band_count;
+}
+
+// Bands of one run_bands call. Bands are taken in turn by the calling thread
+// and by whichever workers of the pool are free, so a call never waits for a
+// band that nobody runs, even when the pool is busy or from inside a band.
+struct band_job {
+    void (*call)(void *fn, size_t band);
+    void *fn;
+    size_t band_count;
+    // Next band to take. The calling thread takes band 0 itself.
+    std::atomic<size_t> next_band{1};
+    // Under the pool mutex: bands done, workers inside the job, and the
+    // first exception a band threw.
+    size_t done{0};
+    int workers{0};
+    std::exception_ptr error;
+    TGA_STATS_ONLY(tga::detail::stats_recorder *recorder{nullptr};)
+};
+
+// Threads that run the bands of run_bands. They are started the first time
+// a call needs them and kept until the process exits, so that each keeps its
+// scratch arena from one call to the next. A thread that fails to start
+// leaves its bands to the calling thread.
+class band_pool {
+public:
+    void run(band_job *job) {
+        start_workers(job->band_count - 1);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(job);
+        }
+        work_ready.notify_all();
+
+        run_band(job, 0);
+        run_bands_of(job);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        remove_job(job);
+        job_done.wait(lock, [job]() {
+            return job->done == job->band_count && job->workers == 0;
+        });
+        if (job->error) {
+            std::rethrow_exception(job->error);
+        }
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable job_done;
+    // Jobs with bands left to take, under the mutex.
+    std::deque<band_job *> jobs;
+    size_t worker_count{0};
+
+    void start_workers(size_t count) {
+        std::lock_guard<std::mutex> lock(mutex);
+        while (worker_count < count) {
+            try {
+                std::thread(&band_pool::work, this).detach();
+            } catch (...) {
+                return;
+            }
+            ++worker_count;
+        }
+    }
+
+    void remove_job(band_job *job) {
+        auto it = std::find(jobs.begin(), jobs.end(), job);
+        if (it != jobs.end()) {
+            jobs.erase(it);
+        }
+    }
+
+    void run_band(band_job *job, size_t band) {
+        std::exception_ptr error;
+        try {
+            job->call(job->fn, band);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (error && !job->error) {
+            job->error = error;
+        }
+        if (++job->done == job->band_count) {
+            job_done.notify_all();
+        }
+    }
+
+    void run_bands_of(band_job *job) {
+        for (size_t band = job->next_band++; band < job->band_count;
+             band = job->next_band++) {
+            run_band(job, band);
+        }
+    }
+
+    void work() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            work_ready.wait(lock, [this]() { return !jobs.empty(); });
+            band_job *job = jobs.front();
+            ++job->workers;
+            lock.unlock();
+            // The bands record into the stats of the calling thread.
+            TGA_STATS_ONLY(active_recorder = job->recorder;)
+            run_bands_of(job);
+            TGA_STATS_ONLY(flush_thread_stats(); active_recorder = nullptr;)
+            lock.lock();
+            // No band is left to take.
+            remove_job(job);
+            if (--job->workers == 0 && job->done == job->band_count) {
+                job_done.notify_all();
+            }
+        }
+    }
+};
+
+// The pool is never destroyed, so that calls made while static objects are
+// destroyed still find it.
+band_pool &get_band_pool() {
+    static band_pool *pool = new band_pool;
+    return *pool;
+}
+
+// Splits rows [0, row_count) into band_count contiguous bands and calls
+// fn(band, first_row, last_row) for each, on the calling thread and the
+// threads of the band pool. The calling thread takes the first band. An
+// exception thrown by a band is rethrown once all the bands are done.
+template <typename Fn>
+void run_bands(size_t band_count, int row_count, Fn &&fn) {
+    if (band_count <= 1) {
+        fn(0, 0, row_count);
+        return;
+    }
+
+    auto run_band = [&fn, band_count, row_count](size_t band) {
+        int first_row = (int)(row_count * band / band_count);
+        int last_row = (int)(row_count * (band + 1) / band_count);
+        fn(band, first_row, last_row);
+    };
+    band_job job;
+    job.call = [](void *f, size_t band) {
+        (*(decltype(run_band) *)f)(band);
+    };
+    job.fn = &run_band;
+    job.band_count = band_count;
+    TGA_STATS_ONLY(job.recorder = active_recorder;)
+    get_band_pool().run(&job);
+}
+
+// Splits rows [0, row_count) into as many bands as the policy allows and
+// calls fn(first_row, last_row) for each band. Small jobs run on the calling
+// thread only.
+template <typename Fn>
+void run_row_bands(int row_count, size_t row_size,
+                   const tga::ExecutionPolicy &policy, Fn &&fn) {
+    run_bands(get_band_count(row_count, row_size, policy), row_count,
+              [&fn](size_t, int first_row, int last_row) {
+                  fn(first_row, last_row);
+              });
+}
+
+// Gets the destination of the first pixel of a stored row, given that the
+// decoders write stored rows straight into their final place.
+uint8_t *dest_row(uint8_t *data, const tga::tga_info *info, int stored_row,
+                  bool b_flip_v) {
+    size_t row_size = (size_t)info->width *
+                      pixel_format_to_pixel_size(info->pixel_format);
+    int row = b_flip_v ? info->height - 1 - stored_row : stored_row;
+    return data + row * row_size;
+}
+
+// Decodes the stored rows [first_row, last_row) of an uncompressed image,
+// with src pointing to the first of them in the payload. Pixels that are not
+// color mapped are converted from file_format to the format of the image.
+// Still a C style function
+tga::tga_error decode_rows(uint8_t *data, const tga::tga_info *info,
+                           uint8_t pixel_size,
+                           tga::tga_pixel_format file_format,
+                           bool is_color_mapped, const color_map *map,
+                           const uint8_t *src, int first_row, int last_row,
+                           bool b_flip_h, bool b_flip_v) {
+    size_t src_row_size = (size_t)info->width * pixel_size;
+    for (int y = first_row; y < last_row; ++y, src += src_row_size) {
+        uint8_t *dest = dest_row(data, info, y, b_flip_v);
+        if (is_color_mapped) {
+            // In color mapped image, the pixel as the index value of the
+            // color map. The actual pixel value is found from the color map.
+            if (!expand_indices(dest, src, info->width, map, pixel_size)) {
+                return tga::tga_error::TGA_ERROR_COLOR_MAP_INDEX_FAILED;
+            }
+            if (b_flip_h) {
+                reverse_row(dest, info->width, map->bytes_per_entry);
+            }
+        } else {
+            convert_pixels(dest, info->pixel_format, src, file_format,
+                           info->width);
+            if (b_flip_h) {
+                reverse_row(dest, info->width,
+                            pixel_format_to_pixel_size(info->pixel_format));
+            }
+        }
+    }
+    TGA_STATS_ONLY(if (is_color_mapped) {
+        stats_add(&tga::Stats::palette_lookups,
+                  (uint64_t)info->width * (last_row - first_row));
+    })
+    return tga::tga_error::TGA_NO_ERROR;
+}
+
+// Decode image data from the read buffer.
+// Still a C style function
+tga::tga_error decode_data(uint8_t *data, const tga::tga_info *info,
+                           uint8_t pixel_size,
+                           tga::tga_pixel_format file_format,
+                           bool is_color_mapped, const color_map *map,
+                           read_buffer *buffer, bool b_flip_h, bool b_flip_v,
+                           const tga::ExecutionPolicy &policy) {
+    size_t src_row_size = (size_t)info->width * pixel_size;
+    size_t payload_size = src_row_size * info->height;
+
+    // Raw pixels coming from a stream are bound by the read, so they are
+    // read row by row straight into place, or converted from the read buffer
+    // into place. Everything else is decoded from memory, in parallel if the
+    // policy allows it.
+    if (!is_color_mapped && buffer->reader != nullptr) {
+        bool convert = file_format != info->pixel_format;
+        for (int y = 0; y < info->height; ++y) {
+            uint8_t *dest = dest_row(data, info, y, b_flip_v);
+            if (convert) {
+                if (!ensure_bytes(buffer, src_row_size)) {
+                    return tga::tga_error::TGA_ERROR_FILE_CANNOT_READ;
+                }
+                convert_pixels(dest, info->pixel_format,
+                               buffer->bytes + buffer->pos, file_format,
+                               info->width);
+                buffer->pos += src_row_size;
+            } else if (!read_bytes(buffer, dest, src_row_size)) {
+                return tga::tga_error::TGA_ERROR_FILE_CANNOT_READ;
+            }
+            if (b_flip_h) {
+                // The row is still in cache, reverse it in place.
+                reverse_row(dest, info->width,
+                            pixel_format_to_pixel_size(info->pixel_format));
+            }
+        }
+        return tga::tga_error::TGA_NO_ERROR;
+    }
+
+    // The index plane of a color mapped image is much smaller than the
+    // image, so it is buffered whole.
+    if (!ensure_bytes(buffer, payload_size)) {
+        return tga::tga_error::TGA_ERROR_FILE_CANNOT_READ;
+    }
+    const uint8_t *payload = buffer->bytes + buffer->pos;
+    buffer->pos += payload_size;
+
+    std::atomic<tga::tga_error> error_code{tga::tga_error::TGA_NO_ERROR};
+    run_row_bands(info->height, src_row_size, policy,
+                  [&](int first_row, int last_row) {
+                      tga::tga_error band_error = decode_rows(
+                          data, info, pixel_size, file_format,
+                          is_color_mapped, map,
+                          payload + first_row * src_row_size, first_row,
+                          last_row, b_flip_h, b_flip_v);
+                      if (band_error != tga::tga_error::TGA_NO_ERROR) {
+                          error_code = band_error;
+                      }
+                  });
+    return error_code;
+}
+
+// Fills `count` elements of `element_size` bytes at dest with the element
+// stored at dest. Each pass copies everything written so far, so a run takes
+// O(log count) memcpy calls instead of one per pixel.
+void fill_run(uint8_t *dest, size_t element_size, size_t count) {
+    if (element_size == 1) {
+        memset(dest + 1, dest[0], count - 1);
+        return;
+    }
+    size_t total = element_size * count;
+    size_t filled = element_size;
+    while (filled < total) {
+        size_t chunk = filled < total - filled ? filled : total - filled;
+        memcpy(dest + filled, dest, chunk);
+        filled += chunk;
+    }
+}
+
+// Decode the stored rows [first_row, last_row) of an image with run-length
+// encoding from the read buffer, which starts at a packet header. The first
+// `skip` pixels of that packet belong to earlier rows and are dropped. Pixels
+// that are not color mapped are converted from file_format to the format of
+// the image.
+// If the last packet runs past last_row, the buffer is left at its header and
+// the number of its pixels that were used is stored in next_skip, so that the
+// next rows can be decoded by another call. Otherwise next_skip is set to 0.
+// Handles any kind of pixels, the common ones go through the specialized
+// kernels below instead.
+// Still a C style function
+tga::tga_error decode_rle_rows_generic(uint8_t *data,
+                                       const tga::tga_info *info,
+                                       uint8_t pixel_size,
+                                       tga::tga_pixel_format file_format,
+                                       bool is_color_mapped,
+                                       const color_map *map,
+                                       read_buffer *buffer, bool b_flip_h,
+                                       bool b_flip_v, int first_row,
+                                       int last_row, size_t skip,
+                                       size_t *next_skip) {
+    size_t pixel_count = (size_t)info->width * (last_row - first_row);
+    row_writer writer(data, info, b_flip_h, b_flip_v);
+    writer.row = (uint16_t)first_row;
+
+    // The actual pixel size of the image, In order not to be confused with the
+    // name of the parameter pixel_size, named data element.
+    uint8_t data_element_size = writer.element_size;
+    bool convert = file_format != info->pixel_format;
+    if (next_skip != nullptr) {
+        *next_skip = 0;
+    }
+    // Counted here and recorded once, the packets are too many to record
+    // one by one.
+    TGA_STATS_ONLY(uint64_t run_packets = 0; uint64_t raw_packets = 0;
+                   uint64_t palette_lookups = 0;)
+
+    while (pixel_count > 0) {
+        if (!ensure_bytes(buffer, 1)) {
+            return tga::tga_error::TGA_ERROR_FILE_CANNOT_READ;
+        }
+        uint8_t repetition_count_field = buffer->bytes[buffer->pos];
+        bool is_run_length_packet = repetition_count_field & 0x80;
+        size_t full_count = (repetition_count_field & 0x7F) + 1;
+        size_t packet_skip = skip < full_count ? skip : full_count;
+        size_t packet_count = full_count - packet_skip;
+        skip = 0;
+        bool is_cut = packet_count > pixel_count;
+        if (is_cut) {
+            // Packet runs past the last row, the excess belongs to the next
+            // rows, if any.
+            packet_count = pixel_count;
+        }
+        pixel_count -= packet_count;
+
+        // The header stays in the buffer until the packet is done with, so
+        // that a cut packet can be decoded again from its header.
+        size_t used_size =
+            1 + (is_run_length_packet ? 1 : packet_skip + packet_count) *
+                    pixel_size;
+        if (!ensure_bytes(buffer, used_size)) {
+            return tga::tga_error::TGA_ERROR_FILE_CANNOT_READ;
+        }
+        const uint8_t *packet = buffer->bytes + buffer->pos + 1;
+        if (is_cut) {
+            if (next_skip != nullptr) {
+                *next_skip = packet_skip + packet_count;
+            }
+        } else {
+            buffer->pos += used_size;
+        }
+
+        TGA_STATS_ONLY(if (is_run_length_packet) {
+            ++run_packets;
+            palette_lookups += is_color_mapped;
+        } else {
+            ++raw_packets;
+            palette_lookups += is_color_mapped ? packet_count : 0;
+        })
+        if (is_run_length_packet) {
+            uint8_t pixel[4];
+            if (is_color_mapped) {
+                // In color mapped image, the pixel as the index value of
+                // the color map. The actual pixel value is found from the
+                // color map.
+                uint16_t index = pixel_to_map_index(packet, pixel_size);
+                if (!try_get_color_from_map(pixel, index, map)) {
+                    return tga::tga_error::TGA_ERROR_COLOR_MAP_INDEX_FAILED;
+                }
+            } else if (convert) {
+                convert_pixels(pixel, info->pixel_format, packet, file_format,
+                               1);
+            } else {
+                memcpy(pixel, packet, data_element_size);
+            }
+            // A packet may continue on the next scanline, which is somewhere
+            // else in the output, so fill it one scanline piece at a time.
+            while (packet_count > 0) {
+                size_t span = writer.width - writer.x;
+                span = packet_count < span ? packet_count : span;
+                uint8_t *dest = next_span(&writer, span);
+                memcpy(dest, pixel, data_element_size);
+                fill_run(dest, data_element_size, span);
+                advance_span(&writer, span);
+                packet_count -= span;
+            }
+        } else {
+            const uint8_t *src = packet + packet_skip * pixel_size;
+            while (packet_count > 0) {
+                size_t span = writer.width - writer.x;
+                span = packet_count < span ? packet_count : span;
+                uint8_t *dest = next_span(&writer, span);
+                if (is_color_mapped) {
+                    // Again, in color mapped image, the pixel as the index
+                    // value of the color map. The actual pixel value is found
+                    // from the color map.
+                    if (!expand_indices(dest, src, span, map, pixel_size)) {
+                        return tga::tga_error::TGA_ERROR_COLOR_MAP_INDEX_FAILED;
+                    }
+                } else if (convert) {
+                    convert_pixels(dest, info->pixel_format, src, file_format,
+                                   span);
+                } else {
+                    memcpy(dest, src, span * pixel_size);
+                }
+                if (b_flip_h) {
+                    reverse_row(dest, span, data_element_size);
+                }
+                src += span * pixel_size;
+                advance_span(&writer, span);
+                packet_count -= span;
+            }
+        }
+    }
+
+    TGA_STATS_ONLY(stats_add(&tga::Stats::rle_run_packets, run_packets);
+                   stats_add(&tga::Stats::rle_raw_packets, raw_packets);
+                   stats_add(&tga::Stats::palette_lookups, palette_lookups);)
+    return tga::tga_error::TGA_NO_ERROR;
+}
+
+// Fills `count` pixels of E bytes at dest with pixel, which holds the pixel in
+// its low bytes.
+template <int E>
+inline void fill_pixels(uint8_t *dest, uint32_t pixel, size_t count) {
+    if constexpr (E == 1) {
+        memset(dest, (uint8_t)pixel, count);
+    } else if constexpr (E == 3) {
+        // Store 4 bytes at a time, the extra byte is overwritten by the next
+        // pixel.
+        size_t i = 0;
+        for (; i + 1 < count; ++i) {
+            memcpy(dest + i * 3, &pixel, 4);
+        }
+        memcpy(dest + i * 3, &pixel, 3);
+    } else {
+        for (size_t i = 0; i < count; ++i) {
+            memcpy(dest + i * E, &pixel, E);
+        }
+    }
+}
+
+// Copies `count` pixels of E bytes from src to dest in reverse order, for a
+// scanline stored right-to-left.
+template <int E>
+inline void copy_reversed(uint8_t *dest, const uint8_t *src, size_t count) {
+    uint8_t *last = dest + (count - 1) * E;
+    for (size_t i = 0; i < count; ++i) {
+        memcpy(last - i * E, src + i * E, E);
+    }
+}
+
+// decode_rle_rows_generic compiled for one kind of pixels: E-byte pixels in
+// the image, N-byte pixels, or color map indices, in the file, and scanlines
+// stored right-to-left or not. With the sizes known, the copies and fills
+// become fixed-size moves the compiler can unroll and vectorize, and no
+// per-pixel branch is left on the kind of pixels. Pixels that are not color
+// mapped are stored as they are, conversions go through the generic decoder.
+// Still a C style function
+template <int E, int N, bool IsColorMapped, bool FlipH>
+tga::tga_error decode_rle_rows_as(uint8_t *data, const tga::tga_info *info,
+                                  uint8_t, tga::tga_pixel_format, bool,
+                                  const color_map *map, read_buffer *buffer,
+                                  bool, bool b_flip_v, int first_row,
+                                  int last_row, size_t skip,
+                                  size_t *next_skip) {
+    static_assert(IsColorMapped || E == N, "Pixels are stored as they are");
+    size_t pixel_count = (size_t)info->width * (last_row - first_row);
+    size_t width = info->width;
+    ptrdiff_t row_step = (ptrdiff_t)(width * E);
+    row_step = b_flip_v ? -row_step : row_step;
+    uint8_t *row = dest_row(data, info, first_row, b_flip_v);
+    size_t x = 0;
+    if (next_skip != nullptr) {
+        *next_skip = 0;
+    }
+    TGA_STATS_ONLY(uint64_t run_packets = 0; uint64_t raw_packets = 0;
+                   uint64_t palette_lookups = 0;)
+
+    while (pixel_count > 0) {
+        if (!ensure_bytes(buffer, 1)) {
+            return tga::tga_error::TGA_ERROR_FILE_CANNOT_READ;
+        }
+        uint8_t repetition_count_field = buffer->bytes[buffer->pos];
+        bool is_run_length_packet = repetition_count_field & 0x80;
+        size_t full_count = (repetition_count_field & 0x7F) + 1;
+        size_t packet_skip = skip < full_count ? skip : full_count;
+        size_t packet_count = full_count - packet_skip;
+        skip = 0;
+        bool is_cut = packet_count > pixel_count;
+        if (is_cut) {
+            packet_count = pixel_count;
+        }
+        pixel_count -= packet_count;
+
+        size_t used_size =
+            1 + (is_run_length_packet ? 1 : packet_skip + packet_count) * N;
+        if (!ensure_bytes(buffer, used_size)) {
+            return tga::tga_error::TGA_ERROR_FILE_CANNOT_READ;
+        }
+        const uint8_t *packet = buffer->bytes + buffer->pos + 1;
+        if (is_cut) {
+            if (next_skip != nullptr) {
+                *next_skip = packet_skip + packet_count;
+            }
+        } else {
+            buffer->pos += used_size;
+        }
+
+        TGA_STATS_ONLY(if (is_run_length_packet) {
+            ++run_packets;
+            palette_lookups += IsColorMapped;
+        } else {
+            ++raw_packets;
+            palette_lookups += IsColorMapped ? packet_count : 0;
+        })
+        uint32_t pixel = 0;
+        const uint8_t *src = packet + packet_skip * N;
+        if (is_run_length_packet) {
+            if constexpr (IsColorMapped) {
+                uint32_t index = N == 1 ? packet[0] : read_u16_le(packet);
+                // Indices below first_index wrap around to large offsets.
+                uint32_t offset = index - map->first_index;
+                if (offset >= map->entry_count) {
+                    return tga::tga_error::TGA_ERROR_COLOR_MAP_INDEX_FAILED;
+                }
+                pixel = map->table[offset];
+            } else {
+                memcpy(&pixel, packet, N);
+            }
+        }
+        // Packets may continue on the next scanline, so they are written one
+        // scanline piece at a time.
+        while (packet_count > 0) {
+            size_t span = width - x;
+            span = packet_count < span ? packet_count : span;
+            uint8_t *dest = row + (FlipH ? width - x - span : x) * E;
+            if (is_run_length_packet) {
+                fill_pixels<E>(dest, pixel, span);
+            } else if constexpr (IsColorMapped) {
+                if (!expand_indices<E, N>(dest, src, span, map)) {
+                    return tga::tga_error::TGA_ERROR_COLOR_MAP_INDEX_FAILED;
+                }
+                if (FlipH) {
+                    reverse_row<E>(dest, span);
+                }
+            } else if (FlipH) {
+                copy_reversed<E>(dest, src, span);
+            } else {
+                memcpy(dest, src, span * E);
+            }
+            src += span * N;
+            packet_count -= span;
+            x += span;
+            if (x == width) {
+                x = 0;
+                // Only step to rows that exist, the pointer would leave the
+                // image past the last one.
+                if (pixel_count > 0 || packet_count > 0) {
+                    row += row_step;
+                }
+            }
+        }
+    }
+
+    TGA_STATS_ONLY(stats_add(&tga::Stats::rle_run_packets, run_packets);
+                   stats_add(&tga::Stats::rle_raw_packets, raw_packets);
+                   stats_add(&tga::Stats::palette_lookups, palette_lookups);)
+    return tga::tga_error::TGA_NO_ERROR;
+}
+
+typedef tga::tga_error (*rle_rows_kernel)(
+    uint8_t *data, const tga::tga_info *info, uint8_t pixel_size,
+    tga::tga_pixel_format file_format, bool is_color_mapped,
+    const color_map *map, read_buffer *buffer, bool b_flip_h, bool b_flip_v,
+    int first_row, int last_row, size_t skip, size_t *next_skip);
+
+template <int E, int N, bool IsColorMapped>
+rle_rows_kernel select_rle_rows_kernel(bool b_flip_h) {
+    return b_flip_h ? decode_rle_rows_as<E, N, IsColorMapped, true>
+                    : decode_rle_rows_as<E, N, IsColorMapped, false>;
+}
+
+// Picks the decoder of RLE rows for the kind of pixels of an image, once per
+// image rather than per packet.
+rle_rows_kernel select_rle_rows_kernel(const tga::tga_info *info,
+                                       uint8_t pixel_size,
+                                       tga::tga_pixel_format file_format,
+                                       bool is_color_mapped, bool b_flip_h) {
+    int element_size = pixel_format_to_pixel_size(info->pixel_format);
+    if (is_color_mapped) {
+        switch (element_size * 2 + pixel_size - 1) {
+            case 1 * 2:
+                return select_rle_rows_kernel<1, 1, true>(b_flip_h);
+            case 1 * 2 + 1:
+                return select_rle_rows_kernel<1, 2, true>(b_flip_h);
+            case 2 * 2:
+                return select_rle_rows_kernel<2, 1, true>(b_flip_h);
+            case 2 * 2 + 1:
+                return select_rle_rows_kernel<2, 2, true>(b_flip_h);
+            case 3 * 2:
+                return select_rle_rows_kernel<3, 1, true>(b_flip_h);
+            case 3 * 2 + 1:
+                return select_rle_rows_kernel<3, 2, true>(b_flip_h);
+            case 4 * 2:
+                return select_rle_rows_kernel<4, 1, true>(b_flip_h);
+            case 4 * 2 + 1:
+                return select_rle_rows_kernel<4, 2, true>(b_flip_h);
+        }
+    } else if (file_format == info->pixel_format) {
+        switch (element_size) {
+            case 1:
+                return select_rle_rows_kernel<1, 1, false>(b_flip_h);
+            case 2:
+                return select_rle_rows_kernel<2, 2, false>(b_flip_h);
+            case 3:
+                return select_rle_rows_kernel<3, 3, false>(b_flip_h);
+            case 4:
+                return select_rle_rows_kernel<4, 4, false>(b_flip_h);
+        }
+    }
+    return decode_rle_rows_generic;
+}
+
+// Decodes RLE rows as decode_rle_rows_generic does, with the kernel for the
+// kind of pixels of the image.
+tga::tga_error decode_rle_rows(uint8_t *data, const tga::tga_info *info,
+                               uint8_t pixel_size,
+                               tga::tga_pixel_format file_format,
+                               bool is_color_mapped, const color_map *map,
+                               read_buffer *buffer, bool b_flip_h,
+                               bool b_flip_v, int first_row, int last_row,
+                               size_t skip, size_t *next_skip) {
+    rle_rows_kernel kernel = select_rle_rows_kernel(
+        info, pixel_size, file_format, is_color_mapped, b_flip_h);
+    return kernel(data, info, pixel_size, file_format, is_color_mapped, map,
+                  buffer, b_flip_h, b_flip_v, first_row, last_row, skip,
+                  next_skip);
+}
+
+// Moves the read buffer past `count` pixels of RLE data without decoding
+// them. As with decode_rle_rows, the first `skip` pixels of the packet at the
+// buffer position are already used, and a packet that runs past `count` is
+// left at its header, with the pixels used so far stored in skip.
+tga::tga_error skip_rle_pixels(read_buffer *buffer, uint8_t pixel_size,
+                               size_t count, size_t *skip) {
+    while (count > 0) {
+        if (!ensure_bytes(buffer, 1)) {
+            return tga::tga_error::TGA_ERROR_FILE_CANNOT_READ;
+        }
+        uint8_t repetition_count_field = buffer->bytes[buffer->pos];
+        size_t packet_count = (repetition_count_field & 0x7F) + 1 - *skip;
+        if (packet_count > count) {
+            *skip += count;
+            return tga::tga_error::TGA_NO_ERROR;
+        }
+        count -= packet_count;
+        *skip = 0;
+        size_t packet_size = repetition_count_field & 0x80
+                                 ? 1 + pixel_size
+                                 : 1 + ((repetition_count_field & 0x7F) + 1) *
+                                           pixel_size;
+        if (!skip_bytes(buffer, packet_size)) {
+            return tga::tga_error::TGA_ERROR_FILE_CANNOT_READ;
+        }
+    }
+    return tga::tga_error::TGA_NO_ERROR;
+}
+
+// Where a stored scanline starts in RLE data: the offset of the packet
+// header, and how many pixels of that packet belong to earlier rows.
+struct rle_row_start {
+    size_t offset;
+    uint8_t skip;
+};
+
+// Scans the packet headers of RLE data, without decoding any pixel, and
+// records where each stored scanline starts, as offsets from the start of the
+// data. With keep_payload, all the data ends up in the read buffer, starting
+// at its current position. Otherwise the data is consumed as it is scanned,
+// so that only a block of it is held at a time.
+// Returns the size of the data in payload_size.
+tga::tga_error index_rle_rows(read_buffer *buffer, const tga::tga_info *info,
+                              uint8_t pixel_size, bool keep_payload,
+                              scratch_vector<rle_row_start> *rows,
+                              size_t *payload_size) {
+    size_t pixel_count = (size_t)info->width * info->height;
+    size_t pixel = 0;
+    size_t cursor = 0;
+    // Offset of the first byte still in the buffer.
+    size_t dropped = 0;
+    size_t next_row_pixel = 0;
+    rows->clear();
+    rows->reserve(info->height);
+
+    const uint8_t *bytes = buffer->bytes + buffer->pos;
+    size_t available = buffer->end - buffer->pos;
+    while (pixel < pixel_count) {
+        if (cursor - dropped >= available) {
+            if (!keep_payload) {
+                // Only the headers matter, let go of what has been scanned.
+                buffer->pos += available;
+                if (!skip_bytes(buffer, cursor - dropped - available)) {
+                    return tga::tga_error::TGA_ERROR_FILE_CANNOT_READ;
+                }
+                dropped = cursor;
+            }
+            if (!ensure_bytes(buffer, cursor - dropped + 1)) {
+                return tga::tga_error::TGA_ERROR_FILE_CANNOT_READ;
+            }
+            bytes = buffer->bytes + buffer->pos;
+            available = buffer->end - buffer->pos;
+        }
+        uint8_t repetition_count_field = bytes[cursor - dropped];
+        size_t packet_count = (repetition_count_field & 0x7F) + 1;
+        size_t packet_size = repetition_count_field & 0x80
+                                 ? 1 + pixel_size
+                                 : 1 + packet_count * pixel_size;
+        // A packet may hold the start of several rows if they are narrow.
+        while (next_row_pixel < pixel + packet_count &&
+               next_row_pixel < pixel_count) {
+            rows->push_back({cursor, (uint8_t)(next_row_pixel - pixel)});
+            next_row_pixel += info->width;
+        }
+        cursor += packet_size;
+        pixel += packet_count;
+    }
+    if (!keep_payload) {
+        size_t rest = cursor - dropped;
+        size_t in_buffer = rest < available ? rest : available;
+        buffer->pos += in_buffer;
+        if (!skip_bytes(buffer, rest - in_buffer)) {
+            return tga::tga_error::TGA_ERROR_FILE_CANNOT_READ;
+        }
+    } else if (!ensure_bytes(buffer, cursor)) {
+        return tga::tga_error::TGA_ERROR_FILE_CANNOT_READ;
+    }
+    *payload_size = cursor;
+    return tga::tga_error::TGA_NO_ERROR;
+}
+
+// Decode image data with run-length encoding from the read buffer.
+// When the policy allows more than one band, a first pass indexes where each
+// scanline starts, then the bands are decoded in parallel from the index.
+// Still a C style function
+tga::tga_error decode_data_rle(uint8_t *data, const tga::tga_info *info,
+                               uint8_t pixel_size,
+                               tga::tga_pixel_format file_format,
+                               bool is_color_mapped, const color_map *map,
+                               read_buffer *buffer, bool b_flip_h,
+                               bool b_flip_v,
+                               const tga::ExecutionPolicy &policy) {
+    size_t row_size = (size_t)info->width *
+                      pixel_format_to_pixel_size(info->pixel_format);
+    rle_rows_kernel kernel = select_rle_rows_kernel(
+        info, pixel_size, file_format, is_color_mapped, b_flip_h);
+    if (get_band_count(info->height, row_size, policy) <= 1) {
+        return kernel(data, info, pixel_size, file_format, is_color_mapped,
+                      map, buffer, b_flip_h, b_flip_v, 0, info->height, 0,
+                      nullptr);
+    }
+
+    scratch_vector<rle_row_start> rows;
+    size_t payload_size;
+    tga::tga_error index_error =
+        index_rle_rows(buffer, info, pixel_size, true, &rows, &payload_size);
+    if (index_error != tga::tga_error::TGA_NO_ERROR) {
+        return index_error;
+    }
+    const uint8_t *payload = buffer->bytes + buffer->pos;
+    buffer->pos += payload_size;
+
+    std::atomic<tga::tga_error> error_code{tga::tga_error::TGA_NO_ERROR};
+    run_row_bands(
+        info->height, row_size, policy, [&](int first_row, int last_row) {
+            const rle_row_start &start = rows[first_row];
+            read_buffer band(payload + start.offset,
+                             payload_size - start.offset);
+            tga::tga_error band_error = kernel(
+                data, info, pixel_size, file_format, is_color_mapped, map,
+                &band, b_flip_h, b_flip_v, first_row, last_row, start.skip,
+                nullptr);
+            if (band_error != tga::tga_error::TGA_NO_ERROR) {
+                error_code = band_error;
+            }
+        });
+    return error_code;
+}
+
+// Reads everything that comes before the pixel data: the header, the ID field
+// and the color map. The image gets the pixel format requested by the options,
+// the format of the pixels, or of the color map entries, in the file is stored
+// in file_format. Color map entries are converted to the image format.
+tga::tga_error load_image_head(read_buffer *buffer,
+                               const tga::LoadOptions &options,
+                               tga_header *out_header, tga::tga_info *info,
+                               tga::tga_pixel_format *file_format,
+                               color_map *map) {
+    if (options.convert &&
+        pixel_format_to_pixel_size(options.pixel_format) == -1) {
+        return tga::tga_error::TGA_ERROR_UNSUPPORTED_PIXEL_FORMAT;
+    }
+
+    tga_header &header = *out_header;
+
+    // -----------Start load header-----------
+    {
+        TGA_STATS_ONLY(stage_timer timer(&tga::Stats::header_ns);)
+        uint8_t header_bytes[HEADER_SIZE];
+        if (!read_bytes(buffer, header_bytes, HEADER_SIZE)) {
+            return tga::tga_error::TGA_ERROR_FILE_CANNOT_READ;
+        }
+        parse_header(header_bytes, &header);
+        tga::tga_error error_code = check_header(header, info);
+        if (error_code != tga::tga_error::TGA_NO_ERROR) {
+            return error_code;
+        }
+        // No need to handle the content of the ID field, so skip directly.
+        if (!skip_bytes(buffer, header.id_length)) {
+            return tga::tga_error::TGA_ERROR_FILE_CANNOT_READ;
+        }
+    }
+
+    *file_format = info->pixel_format;
+    if (options.convert) {
+        info->pixel_format = options.pixel_format;
+    }
+
+    // -----------Handle color map field-----------
+    TGA_STATS_ONLY(stage_timer timer(&tga::Stats::color_map_ns);)
+    size_t map_size = header.map_length * BITS_TO_BYTES(header.map_entry_size);
+    if (IS_COLOR_MAPPED(header)) {
+        map->first_index = header.map_first_entry;
+        map->entry_count = header.map_length;
+        map->bytes_per_entry = BITS_TO_BYTES(header.map_entry_size);
+        map->pixels.resize(map_size);
+
+        if (!read_bytes(buffer, map->pixels.data(), map_size)) {
+            return tga::tga_error::TGA_ERROR_FILE_CANNOT_READ;
+        }
+        if (*file_format != info->pixel_format) {
+            // Converting the entries once lets the indices expand straight to
+            // the requested format.
+            uint8_t entry_size = pixel_format_to_pixel_size(info->pixel_format);
+            scratch_vector<uint8_t> entries(
+                (size_t)map->entry_count * entry_size,
+                map->pixels.get_allocator());
+            convert_pixels(entries.data(), info->pixel_format,
+                           map->pixels.data(), *file_format,
+                           map->entry_count);
+            map->pixels.swap(entries);
+            map->bytes_per_entry = entry_size;
+        }
+        build_color_table(map);
+    } else if (header.map_type == 1) {
+        // The image is not color mapped at this time, but contains a color
+        // map. So skips the color map data block directly.
+        if (!skip_bytes(buffer, map_size)) {
+            return tga::tga_error::TGA_ERROR_FILE_CANNOT_READ;
+        }
+    }
+    return tga::tga_error::TGA_NO_ERROR;
+}
+
+// Gets the offset of the pixel data from the start of the file.
+size_t get_payload_offset(const tga_header &header) {
+    size_t offset = HEADER_SIZE + header.id_length;
+    if (IS_COLOR_MAPPED(header) || header.map_type == 1) {
+        offset += header.map_length * BITS_TO_BYTES(header.map_entry_size);
+    }
+    return offset;
+}
+
+// Loads the whole image from the read buffer, with the origin in the upper
+// left corner, and in the pixel format requested by the options.
+tga::tga_error load_image(read_buffer *buffer, tga::PixelBuffer &data,
+                          tga::tga_info *info,
+                          const tga::LoadOptions &options,
+                          const tga::ExecutionPolicy &policy) {
+    TGA_STATS_ONLY(stats_add(&tga::Stats::loads, 1);
+                   stage_timer timer(&tga::Stats::load_ns);)
+    tga_header header;
+    tga::tga_pixel_format file_format;
+    color_map color_map;
+    tga::tga_error error_code = load_image_head(buffer, options, &header, info,
+                                                &file_format, &color_map);
+    if (error_code != tga::tga_error::TGA_NO_ERROR) {
+        return error_code;
+    }
+
+    // The pixel buffer of the previous image is reused if it is large enough.
+    // Otherwise it is emptied first, so that growing it copies nothing.
+    size_t data_size = (size_t)header.image_width * header.image_height *
+                       pixel_format_to_pixel_size(info->pixel_format);
+    if (data_size > data.capacity()) {
+        data.clear();
+    }
+    data.resize(data_size);
+
+    // -----------Load image data-----------
+    // The decoders write each scanline straight to its final place, to keep
+    // the origin in upper left corner.
+    bool b_flip_h = header.image_descriptor & 0x10;
+    bool b_flip_v = !(header.image_descriptor & 0x20);
+    uint8_t pixel_size = BITS_TO_BYTES(header.pixel_depth);
+    bool is_color_mapped = IS_COLOR_MAPPED(header);
+    TGA_STATS_ONLY(stage_timer decode_timer(&tga::Stats::decode_ns);)
+    if (IS_RLE(header)) {
+        return decode_data_rle(data.data(), info, pixel_size, file_format,
+                               is_color_mapped, &color_map, buffer, b_flip_h,
+                               b_flip_v, policy);
+    }
+    return decode_data(data.data(), info, pixel_size, file_format,
+                       is_color_mapped, &color_map, buffer, b_flip_h, b_flip_v,
+                       policy);
+}
+
+// Identifies the file a ScanlineIndex is made for, from an FNV-1a hash of
+// its header and of its size.
+uint64_t scanline_index_key(const tga_header &header, uint64_t file_size) {
+    const uint64_t fields[] = {header.id_length,
+                               header.map_type,
+                               header.image_type,
+                               header.map_first_entry,
+                               header.map_length,
+                               header.map_entry_size,
+                               header.image_x_origin,
+                               header.image_y_origin,
+                               header.image_width,
+                               header.image_height,
+                               header.pixel_depth,
+                               header.image_descriptor,
+                               file_size};
+    uint64_t key = 14695981039346656037ull;
+    for (uint64_t field : fields) {
+        for (int i = 0; i < 8; ++i) {
+            key = (key ^ ((field >> (i * 8)) & 0xFF)) * 1099511628211ull;
+        }
+    }
+    // 0 is the key of an empty index.
+    return key != 0 ? key : 1;
+}
+
+// Loads the pixels of the region [x, x + width) x [y, y + height), in the
+// coordinates of the upper left origin, from the read buffer. Raw rows are
+// read for the region only, whole RLE rows are decoded and the region cut out
+// of them. Given index_rows, the start of the RLE rows is looked up there,
+// after scanning the file for it if the index was made for another file, as
+// told by index_key, and the source must be able to seek. file_size is the
+// size of the whole source.
+tga::tga_error load_image_region(read_buffer *buffer, tga::PixelBuffer &data,
+                                 tga::tga_info *info,
+                                 const tga::LoadOptions &options, int x,
+                                 int y, int width, int height,
+                                 uint64_t file_size,
+                                 std::vector<uint64_t> *index_rows,
+                                 uint64_t *index_key) {
+    TGA_STATS_ONLY(stats_add(&tga::Stats::loads, 1);
+                   stage_timer timer(&tga::Stats::load_ns);)
+    tga_header header;
+    tga::tga_info file_info;
+    tga::tga_pixel_format file_format;
+    color_map color_map;
+    tga::tga_error error_code = load_image_head(
+        buffer, options, &header, &file_info, &file_format, &color_map);
+    if (error_code != tga::tga_error::TGA_NO_ERROR) {
+        return error_code;
+    }
+    if (x < 0 || y < 0 || width <= 0 || height <= 0 ||
+        x + width > file_info.width || y + height > file_info.height) {
+        return tga::tga_error::TGA_ERROR_INVALID_IMAGE_DIMENSIONS;
+    }
+
+    *info = tga::tga_info{(uint16_t)width, (uint16_t)height,
+                          file_info.pixel_format};
+    int data_element_size = pixel_format_to_pixel_size(info->pixel_format);
+    size_t row_size = (size_t)width * data_element_size;
+    if (row_size * height > data.capacity()) {
+        data.clear();
+    }
+    data.resize(row_size * height);
+
+    bool b_flip_h = header.image_descriptor & 0x10;
+    bool b_flip_v = !(header.image_descriptor & 0x20);
+    uint8_t pixel_size = BITS_TO_BYTES(header.pixel_depth);
+    bool is_color_mapped = IS_COLOR_MAPPED(header);
+    // The first stored row of the region.
+    int first_row = b_flip_v ? file_info.height - y - height : y;
+    TGA_STATS_ONLY(stage_timer decode_timer(&tga::Stats::decode_ns);)
+
+    if (!IS_RLE(header)) {
+        int first_column = b_flip_h ? file_info.width - x - width : x;
+        size_t src_row_size = (size_t)file_info.width * pixel_size;
+        size_t src_size = (size_t)width * pixel_size;
+        if (!skip_bytes(buffer, first_row * src_row_size +
+                                    first_column * pixel_size)) {
+            return tga::tga_error::TGA_ERROR_FILE_CANNOT_READ;
+        }
+        tga::tga_info row_info{(uint16_t)width, 1, info->pixel_format};
+        for (int row = 0; row < height; ++row) {
+            if (row > 0 && !skip_bytes(buffer, src_row_size - src_size)) {
+                return tga::tga_error::TGA_ERROR_FILE_CANNOT_READ;
+            }
+            if (!ensure_bytes(buffer, src_size)) {
+                return tga::tga_error::TGA_ERROR_FILE_CANNOT_READ;
+            }
+            error_code = decode_rows(dest_row(data.data(), info, row, b_flip_v),
+                                     &row_info, pixel_size, file_format,
+                                     is_color_mapped, &color_map,
+                                     buffer->bytes + buffer->pos, 0, 1,
+                                     b_flip_h, false);
+            if (error_code != tga::tga_error::TGA_NO_ERROR) {
+                return error_code;
+            }
+            buffer->pos += src_size;
+        }
+        return tga::tga_error::TGA_NO_ERROR;
+    }
+
+    size_t skip = 0;
+    if (index_rows == nullptr) {
+        error_code = skip_rle_pixels(buffer, pixel_size,
+                                     (size_t)first_row * file_info.width,
+                                     &skip);
+    } else {
+        uint64_t key = scanline_index_key(header, file_size);
+        size_t payload_offset = get_payload_offset(header);
+        if (*index_key != key ||
+            index_rows->size() != (size_t)file_info.height + 1) {
+            scratch_vector<rle_row_start> rows;
+            size_t payload_size;
+            error_code = index_rle_rows(buffer, &file_info, pixel_size, false,
+                                        &rows, &payload_size);
+            if (error_code != tga::tga_error::TGA_NO_ERROR) {
+                return error_code;
+            }
+            index_rows->resize(rows.size() + 1);
+            for (size_t i = 0; i < rows.size(); ++i) {
+                (*index_rows)[i] =
+                    (uint64_t)(payload_offset + rows[i].offset) << 8 |
+                    rows[i].skip;
+            }
+            index_rows->back() = (uint64_t)(payload_offset + payload_size)
+                                 << 8;
+            *index_key = key;
+        }
+        // The row must start inside the payload, which must be inside the
+        // file.
+        uint64_t start = (*index_rows)[first_row] >> 8;
+        uint64_t payload_end = index_rows->back() >> 8;
+        if (start < payload_offset || start >= payload_end ||
+            payload_end > file_size || !seek_bytes(buffer, start)) {
+            return tga::tga_error::TGA_ERROR_FILE_CANNOT_READ;
+        }
+        skip = (*index_rows)[first_row] & 0xFF;
+    }
+    if (error_code != tga::tga_error::TGA_NO_ERROR) {
+        return error_code;
+    }
+
+    // Decoding stops after the last row of the region.
+    tga::tga_info row_info{file_info.width, 1, info->pixel_format};
+    scratch_vector<uint8_t> row((size_t)file_info.width * data_element_size);
+    rle_rows_kernel kernel = select_rle_rows_kernel(
+        &row_info, pixel_size, file_format, is_color_mapped, b_flip_h);
+    for (int i = 0; i < height; ++i) {
+        error_code = kernel(row.data(), &row_info, pixel_size, file_format,
+                            is_color_mapped, &color_map, buffer, b_flip_h,
+                            false, 0, 1, skip, &skip);
+        if (error_code != tga::tga_error::TGA_NO_ERROR) {
+            return error_code;
+        }
+        memcpy(dest_row(data.data(), info, i, b_flip_v),
+               row.data() + (size_t)x * data_element_size, row_size);
+    }
+    return tga::tga_error::TGA_NO_ERROR;
+}
+
+// Gets the index of the lowest set bit, mask must not be 0.
+inline int count_trailing_zeros(uint32_t mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+// Shortest run the encoder writes as a run-length packet. For 8-bit pixels a
+// run of 2 takes as many bytes as a raw packet would, and ends the raw packet
+// it interrupts.
+template <int N>
+constexpr size_t min_run_length() {
+    return N == 1 ? 3 : 2;
+}
+
+// Counts how many pixels from start have the same value as the pixel at
+// start, up to 128 and the end of the row.
+// Pixels are compared through shifted byte compares: byte k of the row
+// against byte k + N. Pixel j equals pixel j + 1 exactly when the N byte
+// compares starting at j * N all match, whatever N is.
+template <int N>
+size_t count_run(const uint8_t *row, size_t start, size_t end) {
+    size_t limit = end - start > 128 ? start + 128 : end;
+    size_t j = start;
+#ifdef TGA_USE_SSE2
+    while (j * N + N + 16 <= limit * N) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(row + j * N));
+        __m128i b = _mm_loadu_si128((const __m128i *)(row + j * N + N));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+        if (mask != 0xFFFF) {
+            j += count_trailing_zeros(~mask) / N;
+            break;
+        }
+        j += 16 / N;
+    }
+#endif
+    while (j + 1 < limit && memcmp(row + j * N, row + j * N + N, N) == 0) {
+        ++j;
+    }
+    return j - start + 1;
+}
+
+// Checks if a run worth a run-length packet starts at pixel k.
+template <int N>
+bool is_run_start(const uint8_t *row, size_t k, size_t end) {
+    if (k + min_run_length<N>() > end) {
+        return false;
+    }
+    for (size_t i = 0; i + 1 < min_run_length<N>(); ++i) {
+        if (memcmp(row + (k + i) * N, row + (k + i + 1) * N, N) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Counts how many pixels from start go into a raw packet: up to the next run
+// worth a run-length packet, 128 pixels or the end of the row. There is no
+// such run at start.
+template <int N>
+size_t count_raw(const uint8_t *row, size_t start, size_t end) {
+    size_t limit = end - start > 128 ? start + 128 : end;
+    size_t k = start + 1;
+#ifdef TGA_USE_SSE2
+    // Bit k * N of the mask is set when pixel k equals pixel k + 1 (and k + 2
+    // for 8-bit pixels), i.e. when a run starts there.
+    const uint32_t pixel_bits = N == 1   ? 0x7FFF
+                                : N == 2 ? 0x5555
+                                : N == 3 ? 0x1249
+                                         : 0x1111;
+    const size_t pixels_per_step = N == 1 ? 15 : 16 / N;
+    while (k < limit && k * N + N + 16 <= end * N) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(row + k * N));
+        __m128i b = _mm_loadu_si128((const __m128i *)(row + k * N + N));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+        uint32_t run_mask = mask;
+        for (int shift = 1; shift < (N == 1 ? 2 : N); ++shift) {
+            run_mask &= mask >> shift;
+        }
+        run_mask &= pixel_bits;
+        if (run_mask != 0) {
+            k += count_trailing_zeros(run_mask) / N;
+            return (k < limit ? k : limit) - start;
+        }
+        k += pixels_per_step;
+    }
+#endif
+    while (k < limit && !is_run_start<N>(row, k, end)) {
+        ++k;
+    }
+    return (k < limit ? k : limit) - start;
+}
+
+// Encodes one row with run-length encoding, packets never cross rows.
+// dest must hold at least width * (N + 1) bytes.
+// Returns the number of bytes written.
+template <int N>
+size_t encode_row_rle(const uint8_t *row, size_t width, uint8_t *dest) {
+    uint8_t *out = dest;
+    size_t i = 0;
+    while (i < width) {
+        size_t run = count_run<N>(row, i, width);
+        if (run >= min_run_length<N>()) {
+            *out++ = (uint8_t)(0x80 | (run - 1));
+            memcpy(out, row + i * N, N);
+            out += N;
+            i += run;
+        } else {
+            size_t raw = count_raw<N>(row, i, width);
+            *out++ = (uint8_t)(raw - 1);
+            memcpy(out, row + i * N, raw * N);
+            out += raw * N;
+            i += raw;
+        }
+    }
+    return out - dest;
+}
+
+// Encodes rows [first_row, last_row) with run-length encoding, appending
+// them to out. Rows are row_stride bytes apart in data. If writer is set, out
+// is flushed to it whenever it grows past a block, otherwise everything is
+// kept in out.
+tga::tga_error encode_rows_rle(const uint8_t *data, const tga::tga_info *info,
+                               ptrdiff_t row_stride, int first_row,
+                               int last_row, std::vector<uint8_t> *out,
+                               const tga::tga_writer *writer) {
+    int pixel_size = pixel_format_to_pixel_size(info->pixel_format);
+    size_t max_row_size = (size_t)info->width * (pixel_size + 1);
+    const uint8_t *row = data + first_row * row_stride;
+    for (int y = first_row; y < last_row; ++y, row += row_stride) {
+        size_t used = out->size();
+        out->resize(used + max_row_size);
+        uint8_t *dest = out->data() + used;
+        size_t written = 0;
+        switch (pixel_size) {
+            case 1:
+                written = encode_row_rle<1>(row, info->width, dest);
+                break;
+            case 2:
+                written = encode_row_rle<2>(row, info->width, dest);
+                break;
+            case 3:
+                written = encode_row_rle<3>(row, info->width, dest);
+                break;
+            case 4:
+                written = encode_row_rle<4>(row, info->width, dest);
+                break;
+        }
+        out->resize(used + written);
+        if (writer != nullptr && out->size() >= READ_BLOCK_SIZE) {
+            if (!writer->write(out->data(), out->size())) {
+                return tga::tga_error::TGA_ERROR_FILE_CANNOT_WRITE;
+            }
+            out->clear();
+        }
+    }
+    return tga::tga_error::TGA_NO_ERROR;
+}
+
+// Writes the pixels with run-length encoding. Bands of rows are encoded in
+// parallel into their own buffers, then written in order.
+tga::tga_error save_data_rle(const uint8_t *data, const tga::tga_info *info,
+                             ptrdiff_t row_stride,
+                             const tga::tga_writer &writer,
+                             const tga::ExecutionPolicy &policy) {
+    size_t row_size = (size_t)info->width *
+                      pixel_format_to_pixel_size(info->pixel_format);
+    size_t band_count = get_band_count(info->height, row_size, policy);
+    if (band_count <= 1) {
+        std::vector<uint8_t> out;
+        out.reserve(READ_BLOCK_SIZE + (size_t)info->width * 5);
+        tga::tga_error error_code = encode_rows_rle(
+            data, info, row_stride, 0, info->height, &out, &writer);
+        if (error_code != tga::tga_error::TGA_NO_ERROR) {
+            return error_code;
+        }
+        if (!out.empty() && !writer.write(out.data(), out.size())) {
+            return tga::tga_error::TGA_ERROR_FILE_CANNOT_WRITE;
+        }
+        return tga::tga_error::TGA_NO_ERROR;
+    }
+
+    std::vector<std::vector<uint8_t>> bands(band_count);
+    run_bands(band_count, info->height,
+              [&](size_t band, int first_row, int last_row) {
+                  encode_rows_rle(data, info, row_stride, first_row,
+                                  last_row, &bands[band], nullptr);
+              });
+    for (const auto &band : bands) {
+        if (!band.empty() && !writer.write(band.data(), band.size())) {
+            return tga::tga_error::TGA_ERROR_FILE_CANNOT_WRITE;
+        }
+    }
+    return tga::tga_error::TGA_NO_ERROR;
+}
+
+// Palette and index plane built for color mapped output.
+struct palette_image {
+    std::vector<uint8_t> entries;
+    uint16_t entry_count{0};
+    std::vector<uint8_t> indices;
+};
+
+// Loads a pixel of N bytes as an integer key.
+template <int N>
+inline uint32_t load_pixel_key(const uint8_t *pixel) {
+    uint32_t key = 0;
+    memcpy(&key, pixel, N);
+    return key;
+}
+
+// Builds the palette from the exact colors of the image, if there are no
+// more than 256 of them. The colors go into a small open addressing hash
+// table that stays in L1 cache, and the pixel indices are found in the same
+// pass. Returns false if the image has too many colors.
+template <int N>
+bool build_exact_palette(const uint8_t *data, size_t pixel_count,
+                         palette_image *palette) {
+    // Twice the palette size keeps the probe sequences short.
+    const size_t table_size = 512;
+    uint32_t keys[table_size];
+    uint16_t slots[table_size];
+    for (size_t i = 0; i < table_size; ++i) {
+        slots[i] = 0xFFFF;
+    }
+
+    palette->entries.clear();
+    palette->indices.resize(pixel_count);
+    uint32_t last_key = 0;
+    uint8_t last_index = 0;
+    bool has_last = false;
+    for (size_t i = 0; i < pixel_count; ++i, data += N) {
+        uint32_t key = load_pixel_key<N>(data);
+        // Neighbouring pixels often share a color, skip the lookup then.
+        if (has_last && key == last_key) {
+            palette->indices[i] = last_index;
+            continue;
+        }
+        size_t slot = (key * 0x9E3779B1u) >> 23;
+        while (slots[slot] != 0xFFFF && keys[slot] != key) {
+            slot = (slot + 1) & (table_size - 1);
+        }
+        if (slots[slot] == 0xFFFF) {
+            size_t count = palette->entries.size() / N;
+            if (count == 256) {
+                return false;
+            }
+            keys[slot] = key;
+            slots[slot] = (uint16_t)count;
+            palette->entries.insert(palette->entries.end(), data, data + N);
+        }
+        last_key = key;
+        last_index = (uint8_t)slots[slot];
+        has_last = true;
+        palette->indices[i] = last_index;
+    }
+    palette->entry_count = (uint16_t)(palette->entries.size() / N);
+    return true;
+}
+
+// Reduced precision color used by the quantizer: 5 bits per channel for
+// RGB555 and RGB24, 4 bits per channel for ARGB32, packed into 16 bits.
+template <int N>
+constexpr int quantizer_channel_count() {
+    return N == 4 ? 4 : 3;
+}
+
+template <int N>
+constexpr int quantizer_channel_bits() {
+    return N == 4 ? 4 : 5;
+}
+
+template <int N>
+inline uint16_t quantizer_key(const uint8_t *pixel) {
+    if constexpr (N == 2) {
+        return (uint16_t)((pixel[0] | (pixel[1] << 8)) & 0x7FFF);
+    } else if constexpr (N == 3) {
+        return (uint16_t)((pixel[0] >> 3) | ((pixel[1] >> 3) << 5) |
+                          ((pixel[2] >> 3) << 10));
+    } else {
+        return (uint16_t)((pixel[0] >> 4) | ((pixel[1] >> 4) << 4) |
+                          ((pixel[2] >> 4) << 8) | ((pixel[3] >> 4) << 12));
+    }
+}
+
+template <int N>
+inline int quantizer_channel(uint16_t key, int channel) {
+    const int bits = quantizer_channel_bits<N>();
+    return (key >> (channel * bits)) & ((1 << bits) - 1);
+}
+
+// Occupied cell of the quantizer histogram.
+struct color_bin {
+    uint16_t key;
+    uint32_t count;
+};
+
+// Builds a palette of at most 256 colors with median cut over a reduced
+// precision histogram. The box with the widest channel range is split at
+// the weighted median of that channel until there are 256 boxes. Every
+// histogram cell belongs to exactly one box, so a 64K entry table maps the
+// reduced color of a pixel straight to its palette index.
+template <int N>
+void build_median_cut_palette(const uint8_t *data, const tga::tga_info *info,
+                              palette_image *palette,
+                              const tga::ExecutionPolicy &policy) {
+    const int channel_count = quantizer_channel_count<N>();
+    size_t pixel_count = (size_t)info->width * info->height;
+
+    // RGB555 cells hold a single color. Wider formats also sum the full
+    // precision channels of each cell, so that the palette keeps the exact
+    // colors, e.g. opaque alpha, black and white.
+    const int sum_count = N == 2 ? 0 : channel_count;
+    std::vector<uint32_t> histogram(1 << 16, 0);
+    std::vector<uint64_t> channel_sums((size_t)sum_count << 16, 0);
+    const uint8_t *pixel = data;
+    for (size_t i = 0; i < pixel_count; ++i, pixel += N) {
+        uint16_t key = quantizer_key<N>(pixel);
+        ++histogram[key];
+        for (int c = 0; c < sum_count; ++c) {
+            channel_sums[(size_t)key * sum_count + c] += pixel[c];
+        }
+    }
+    std::vector<color_bin> bins;
+    for (uint32_t key = 0; key < histogram.size(); ++key) {
+        if (histogram[key] != 0) {
+            bins.push_back({(uint16_t)key, histogram[key]});
+        }
+    }
+
+    struct box {
+        size_t begin;
+        size_t end;
+        // Channel with the widest range in the box, and that range.
+        int channel;
+        int range;
+    };
+    auto make_box = [&](size_t begin, size_t end) {
+        box b{begin, end, 0, -1};
+        for (int c = 0; c < channel_count; ++c) {
+            int low = 255, high = 0;
+            for (size_t i = begin; i < end; ++i) {
+                int value = quantizer_channel<N>(bins[i].key, c);
+                low = value < low ? value : low;
+                high = value > high ? value : high;
+            }
+            if (high - low > b.range) {
+                b.range = high - low;
+                b.channel = c;
+            }
+        }
+        return b;
+    };
+
+    std::vector<box> boxes{make_box(0, bins.size())};
+    while (boxes.size() < 256) {
+        size_t split = boxes.size();
+        int split_range = 0;
+        for (size_t i = 0; i < boxes.size(); ++i) {
+            if (boxes[i].end - boxes[i].begin >= 2 &&
+                boxes[i].range > split_range) {
+                split = i;
+                split_range = boxes[i].range;
+            }
+        }
+        if (split == boxes.size()) {
+            break;
+        }
+
+        box b = boxes[split];
+        std::sort(bins.begin() + b.begin, bins.begin() + b.end,
+                  [&](const color_bin &l, const color_bin &r) {
+                      return quantizer_channel<N>(l.key, b.channel) <
+                             quantizer_channel<N>(r.key, b.channel);
+                  });
+        uint64_t total = 0;
+        for (size_t i = b.begin; i < b.end; ++i) {
+            total += bins[i].count;
+        }
+        // Weighted median, keeping at least one cell on each side.
+        size_t middle = b.begin + 1;
+        uint64_t below = bins[b.begin].count;
+        while (middle + 1 < b.end && below * 2 < total) {
+            below += bins[middle++].count;
+        }
+        boxes[split] = make_box(b.begin, middle);
+        boxes.push_back(make_box(middle, b.end));
+    }
+
+    // Each palette entry is the mean color of the pixels in its box.
+    std::vector<uint8_t> lut(1 << 16, 0);
+    palette->entry_count = (uint16_t)boxes.size();
+    palette->entries.assign(boxes.size() * N, 0);
+    for (size_t index = 0; index < boxes.size(); ++index) {
+        uint64_t sum[4] = {0, 0, 0, 0};
+        uint64_t total = 0;
+        for (size_t i = boxes[index].begin; i < boxes[index].end; ++i) {
+            uint16_t key = bins[i].key;
+            lut[key] = (uint8_t)index;
+            for (int c = 0; c < channel_count; ++c) {
+                sum[c] += N == 2 ? (uint64_t)quantizer_channel<N>(key, c) *
+                                       bins[i].count
+                                 : channel_sums[(size_t)key * sum_count + c];
+            }
+            total += bins[i].count;
+        }
+        uint8_t *entry = palette->entries.data() + index * N;
+        int mean[4];
+        for (int c = 0; c < channel_count; ++c) {
+            mean[c] = (int)((sum[c] + total / 2) / total);
+        }
+        if constexpr (N == 2) {
+            uint16_t value =
+                (uint16_t)(mean[0] | (mean[1] << 5) | (mean[2] << 10));
+            entry[0] = value & 0xFF;
+            entry[1] = value >> 8;
+        } else {
+            for (int c = 0; c < channel_count; ++c) {
+                entry[c] = (uint8_t)mean[c];
+            }
+        }
+    }
+
+    palette->indices.resize(pixel_count);
+    size_t row_size = (size_t)info->width * N;
+    run_row_bands(info->height, row_size, policy,
+                  [&](int first_row, int last_row) {
+                      size_t first = (size_t)first_row * info->width;
+                      size_t last = (size_t)last_row * info->width;
+                      const uint8_t *src = data + first * N;
+                      for (size_t i = first; i < last; ++i, src += N) {
+                          palette->indices[i] = lut[quantizer_key<N>(src)];
+                      }
+                  });
+}
+
+template <int N>
+void build_palette(const uint8_t *data, const tga::tga_info *info,
+                   palette_image *palette,
+                   const tga::ExecutionPolicy &policy) {
+    size_t pixel_count = (size_t)info->width * info->height;
+    if (!build_exact_palette<N>(data, pixel_count, palette)) {
+        build_median_cut_palette<N>(data, info, palette, policy);
+    }
+}
+
+// Writes a color mapped image (type 1, or 9 with run-length encoding) with
+// 8-bit indices into a palette of the image's pixel format. The rows of data
+// must be packed.
+tga::tga_error save_color_mapped_image(const uint8_t *data,
+                                       const tga::tga_info *info,
+                                       const tga::tga_writer &writer,
+                                       const tga::SaveOptions &options,
+                                       const tga::ExecutionPolicy &policy) {
+    int pixel_size = pixel_format_to_pixel_size(info->pixel_format);
+    palette_image palette;
+    switch (pixel_size) {
+        case 2:
+            build_palette<2>(data, info, &palette, policy);
+            break;
+        case 3:
+            build_palette<3>(data, info, &palette, policy);
+            break;
+        case 4:
+            build_palette<4>(data, info, &palette, policy);
+            break;
+    }
+
+    uint8_t header[HEADER_SIZE];
+    memset(header, 0, HEADER_SIZE);
+    header[1] = 1;
+    header[2] = (uint8_t)(options.rle ? TGA_TYPE_RLE_COLOR_MAPPED
+                                      : TGA_TYPE_COLOR_MAPPED);
+    header[5] = palette.entry_count & 0xFF;
+    header[6] = (palette.entry_count >> 8) & 0xFF;
+    header[7] = pixel_size * 8;
+    header[12] = info->width & 0xFF;
+    header[13] = (info->width >> 8) & 0xFF;
+    header[14] = info->height & 0xFF;
+    header[15] = (info->height >> 8) & 0xFF;
+    header[16] = 8;
+    if (info->pixel_format == tga::tga_pixel_format::TGA_PIXEL_ARGB32) {
+        header[17] = 0x28;
+    } else {
+        header[17] = 0x20;
+    }
+
+    if (!writer.write(header, HEADER_SIZE) ||
+        !writer.write(palette.entries.data(), palette.entries.size())) {
+        return tga::tga_error::TGA_ERROR_FILE_CANNOT_WRITE;
+    }
+
+    // The index plane is written like an 8-bit grayscale image.
+    tga::tga_info index_info{info->width, info->height,
+                             tga::tga_pixel_format::TGA_PIXEL_BW8};
+    if (options.rle) {
+        return save_data_rle(palette.indices.data(), &index_info,
+                             info->width, writer, policy);
+    }
+    if (!writer.write(palette.indices.data(), palette.indices.size())) {
+        return tga::tga_error::TGA_ERROR_FILE_CANNOT_WRITE;
+    }
+    return tga::tga_error::TGA_NO_ERROR;
+}
+
+// Builds the header of a true-color or grayscale image, with the origin in
+// the upper left corner.
+void make_header(const tga::tga_info *info, bool rle, uint8_t *header) {
+    bool is_grayscale =
+        info->pixel_format == tga::tga_pixel_format::TGA_PIXEL_BW8 ||
+        info->pixel_format == tga::tga_pixel_format::TGA_PIXEL_BW16;
+    memset(header, 0, HEADER_SIZE);
+    if (is_grayscale) {
+        header[2] =
+            (uint8_t)(rle ? TGA_TYPE_RLE_GRAYSCALE : TGA_TYPE_GRAYSCALE);
+    } else {
+        header[2] =
+            (uint8_t)(rle ? TGA_TYPE_RLE_TRUE_COLOR : TGA_TYPE_TRUE_COLOR);
+    }
+    header[12] = info->width & 0xFF;
+    header[13] = (info->width >> 8) & 0xFF;
+    header[14] = info->height & 0xFF;
+    header[15] = (info->height >> 8) & 0xFF;
+    header[16] = pixel_format_to_pixel_size(info->pixel_format) * 8;
+    if (info->pixel_format == tga::tga_pixel_format::TGA_PIXEL_ARGB32) {
+        header[17] = 0x28;
+    } else {
+        header[17] = 0x20;
+    }
+}
+
+// Writes the image whose rows are row_stride bytes apart in data.
+tga::tga_error save_image(const uint8_t *data, const tga::tga_info *info,
+                          ptrdiff_t row_stride, const tga::tga_writer &writer,
+                          const tga::SaveOptions &options,
+                          const tga::ExecutionPolicy &policy) {
+    int pixel_size = pixel_format_to_pixel_size(info->pixel_format);
+    size_t row_size = (size_t)info->width * pixel_size;
+    bool is_grayscale =
+        info->pixel_format == tga::tga_pixel_format::TGA_PIXEL_BW8 ||
+        info->pixel_format == tga::tga_pixel_format::TGA_PIXEL_BW16;
+    bool is_color_mapped = options.color_mapped && !is_grayscale;
+    bool is_abgr32 =
+        info->pixel_format == tga::tga_pixel_format::TGA_PIXEL_ABGR32;
+    if (is_abgr32 || (is_color_mapped && row_stride != (ptrdiff_t)row_size)) {
+        // TGA has no ABGR32 pixel order, those pixels are saved as ARGB32.
+        // The palette is built from packed rows.
+        tga::tga_info packed_info = *info;
+        if (is_abgr32) {
+            packed_info.pixel_format = tga::tga_pixel_format::TGA_PIXEL_ARGB32;
+        }
+        std::vector<uint8_t> packed_data(row_size * info->height);
+        run_row_bands(info->height, row_size, policy,
+                      [&](int first_row, int last_row) {
+                          for (int y = first_row; y < last_row; ++y) {
+                              convert_pixels(
+                                  packed_data.data() + y * row_size,
+                                  packed_info.pixel_format,
+                                  data + y * row_stride, info->pixel_format,
+                                  info->width);
+                          }
+                      });
+        return save_image(packed_data.data(), &packed_info, row_size, writer,
+                          options, policy);
+    }
+
+    if (is_color_mapped) {
+        return save_color_mapped_image(data, info, writer, options, policy);
+    }
+
+    uint8_t header[HEADER_SIZE];
+    make_header(info, options.rle, header);
+    if (!writer.write(header, HEADER_SIZE)) {
+        return tga::tga_error::TGA_ERROR_FILE_CANNOT_WRITE;
+    }
+
+    if (options.rle) {
+        return save_data_rle(data, info, row_stride, writer, policy);
+    }
+
+    // Packed rows are written as is, with a single write.
+    if (row_stride == (ptrdiff_t)row_size) {
+        if (!writer.write(data, row_size * info->height)) {
+            return tga::tga_error::TGA_ERROR_FILE_CANNOT_WRITE;
+        }
+        return tga::tga_error::TGA_NO_ERROR;
+    }
+    for (int y = 0; y < info->height; ++y) {
+        if (!writer.write(data + y * row_stride, row_size)) {
+            return tga::tga_error::TGA_ERROR_FILE_CANNOT_WRITE;
+        }
+    }
+    return tga::tga_error::TGA_NO_ERROR;
+}
+
+// Maps the whole file into memory, read-only.
+// Returns nullptr if the file cannot be mapped, otherwise returns the address
+// of the mapping and stores its length in size.
+const uint8_t *map_file(std::string_view filepath, size_t *size) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filepath.data(), GENERIC_READ, FILE_SHARE_READ,
+                              nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                              nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return nullptr;
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+        CloseHandle(file);
+        return nullptr;
+    }
+    HANDLE mapping =
+        CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (mapping == nullptr) {
+        return nullptr;
+    }
+    // The view keeps the mapping alive, so the handle can be closed now.
+    void *address = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (address == nullptr) {
+        return nullptr;
+    }
+    *size = (size_t)file_size.QuadPart;
+    return (const uint8_t *)address;
+#else
+    int fd = ::open(filepath.data(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        return nullptr;
+    }
+    void *address =
+        mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (address == MAP_FAILED) {
+        return nullptr;
+    }
+    *size = (size_t)st.st_size;
+    return (const uint8_t *)address;
+#endif
+}
+
+void unmap_file(const uint8_t *mapping, size_t size) {
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile(mapping);
+#else
+    munmap((void *)mapping, size);
+#endif
+}
+
+// Read-only file, read with positional reads, so that several threads never
+// share a file pointer.
+struct input_file {
+#ifdef _WIN32
+    HANDLE handle{INVALID_HANDLE_VALUE};
+#else
+    int fd{-1};
+#endif
+
+    input_file() = default;
+    input_file(const input_file &) = delete;
+    input_file &operator=(const input_file &) = delete;
+    ~input_file() {
+#ifdef _WIN32
+        if (handle != INVALID_HANDLE_VALUE) {
+            CloseHandle(handle);
+        }
+#else
+        if (fd >= 0) {
+            ::close(fd);
+        }
+#endif
+    }
+
+    // Opens the file and gets its size.
+    // Returns false if failed, otherwise returns true.
+    bool open(std::string_view filepath, size_t *size) {
+#ifdef _WIN32
+        handle = CreateFileA(filepath.data(), GENERIC_READ, FILE_SHARE_READ,
+                             nullptr, OPEN_EXISTING,
+                             FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+                             nullptr);
+        LARGE_INTEGER file_size;
+        if (handle == INVALID_HANDLE_VALUE ||
+            !GetFileSizeEx(handle, &file_size)) {
+            return false;
+        }
+        *size = (size_t)file_size.QuadPart;
+#else
+        fd = ::open(filepath.data(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            return false;
+        }
+        *size = (size_t)st.st_size;
+#endif
+        return true;
+    }
+
+    // Reads size bytes at offset.
+    // Returns false if the file ends before that, otherwise returns true.
+    bool read_at(uint8_t *dest, size_t size, uint64_t offset) {
+        while (size > 0) {
+#ifdef _WIN32
+            OVERLAPPED overlapped = {};
+            overlapped.Offset = (DWORD)offset;
+            overlapped.OffsetHigh = (DWORD)(offset >> 32);
+            DWORD chunk = size < 0x40000000 ? (DWORD)size : 0x40000000;
+            DWORD count = 0;
+            if (!ReadFile(handle, dest, chunk, &count, &overlapped) ||
+                count == 0) {
+                return false;
+            }
+#else
+            ssize_t count = pread(fd, dest, size, (off_t)offset);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                return false;
+            }
+#endif
+            dest += count;
+            size -= count;
+            offset += count;
+        }
+        return true;
+    }
+};
+
+// Gets the size and the last modification time of a file, the time in units
+// that only need to change when the file does.
+// Returns false if failed, otherwise returns true.
+bool stat_file(std::string_view filepath, uint64_t *size, int64_t *mtime) {
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExA(filepath.data(), GetFileExInfoStandard, &data)) {
+        return false;
+    }
+    *size = (uint64_t)data.nFileSizeHigh << 32 | data.nFileSizeLow;
+    *mtime = (int64_t)((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32 |
+                       data.ftLastWriteTime.dwLowDateTime);
+#else
+    struct stat st;
+    if (::stat(filepath.data(), &st) != 0) {
+        return false;
+    }
+    *size = (uint64_t)st.st_size;
+#ifdef __APPLE__
+    *mtime = (int64_t)st.st_mtimespec.tv_sec * 1000000000 +
+             st.st_mtimespec.tv_nsec;
+#else
+    *mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+#endif
+    return true;
+}
+
+// A file of a BatchLoader batch, on its way from the I/O threads to the
+// decode threads.
+struct batch_job {
+    size_t index{0};
+    std::string filepath;
+    const uint8_t *data{nullptr};
+    size_t size{0};
+    // The file contents, when the loader reads them. Left uninitialized
+    // before the read.
+    std::unique_ptr<uint8_t[]> contents;
+    bool read_failed{false};
+    std::promise<tga::Image> promise;
+    std::shared_ptr<const tga::BatchLoader::Callback> callback;
+};
+
+// Fills the probe information from the header.
+tga::tga_error probe_header(const uint8_t *header_bytes,
+                            tga::tga_file_info *info) {
+    tga_header header;
+    parse_header(header_bytes, &header);
+    tga::tga_error error_code = check_header(header, info);
+    if (error_code != tga::tga_error::TGA_NO_ERROR) {
+        return error_code;
+    }
+    info->image_type = header.image_type;
+    info->is_rle = IS_RLE(header);
+    info->is_color_mapped = IS_COLOR_MAPPED(header);
+    info->origin_right = header.image_descriptor & 0x10;
+    info->origin_top = header.image_descriptor & 0x20;
+    info->pixel_depth = header.pixel_depth;
+    info->alpha_bits = header.image_descriptor & 0x0F;
+    info->x_origin = header.image_x_origin;
+    info->y_origin = header.image_y_origin;
+    info->id_length = header.id_length;
+    info->map_type = header.map_type;
+    info->map_first_entry = header.map_first_entry;
+    info->map_length = header.map_length;
+    info->map_entry_size = header.map_entry_size;
+    info->has_footer = false;
+    return tga::tga_error::TGA_NO_ERROR;
+}
+
+// Checks the signature of the footer bytes.
+bool is_footer(const uint8_t *footer_bytes) {
+    // The signature is followed by its terminating null character.
+    return memcmp(footer_bytes + 8, FOOTER_SIGNATURE,
+                  sizeof(FOOTER_SIGNATURE)) == 0;
+}
+
+// The resampler works on rows of floats in [0, 1], one per channel: 1 channel
+// for grayscale, 4 for the other formats, in the order of the bytes of
+// ARGB32 or ABGR32 pixels. Formats without alpha get an opaque alpha.
+
+// Gets the half width of a filter, in pixels at scale 1.
+double filter_radius(tga::ResampleFilter filter) {
+    switch (filter) {
+        case tga::ResampleFilter::BOX:
+            return 0.5;
+        case tga::ResampleFilter::TRIANGLE:
+            return 1;
+        case tga::ResampleFilter::CUBIC:
+            return 2;
+        case tga::ResampleFilter::LANCZOS3:
+            return 3;
+    }
+    return 0.5;
+}
+
+inline double sinc(double x) {
+    const double pi = 3.14159265358979323846;
+    return x == 0 ? 1 : std::sin(pi * x) / (pi * x);
+}
+
+// Evaluates a filter at distance x, in pixels at scale 1. The box is not
+// evaluated, its weights are the coverage of the source pixels.
+double filter_weight(tga::ResampleFilter filter, double x) {
+    x = std::fabs(x);
+    switch (filter) {
+        case tga::ResampleFilter::TRIANGLE:
+            return x < 1 ? 1 - x : 0;
+        case tga::ResampleFilter::CUBIC:
+            // Catmull-Rom, i.e. Keys with a = -0.5.
+            if (x < 1) {
+                return (1.5 * x - 2.5) * x * x + 1;
+            }
+            if (x < 2) {
+                return ((-0.5 * x + 2.5) * x - 4) * x + 2;
+            }
+            return 0;
+        case tga::ResampleFilter::LANCZOS3:
+            return x < 3 ? sinc(x) * sinc(x / 3) : 0;
+        default:
+            return x < 0.5 ? 1 : 0;
+    }
+}
+
+// The source pixels and weights that make up each destination pixel along
+// one axis. Destination pixel i is made of the count[i] source pixels from
+// first[i], with the weights from weights[i * max_count].
+struct resample_axis {
+    std::vector<int> first;
+    std::vector<int> count;
+    std::vector<float> weights;
+    int max_count{0};
+    // The most source pixels from first[i] to the last source pixel of any
+    // destination pixel up to i. Trimming zero weights can leave first and
+    // count slightly out of order.
+    int window{0};
+};
+
+// Computes the weights to resample src_size pixels to dest_size pixels.
+// Source pixels past the edges are taken as copies of the edge pixels, and
+// the weights of each destination pixel add up to 1.
+void make_resample_axis(int src_size, int dest_size,
+                        tga::ResampleFilter filter, resample_axis *axis) {
+    double scale = (double)src_size / dest_size;
+    // When enlarging, the filter keeps its size.
+    double filter_scale = scale > 1 ? scale : 1;
+    double support = filter_radius(filter) * filter_scale;
+    axis->max_count = (int)std::ceil(support * 2) + 3;
+    axis->first.resize(dest_size);
+    axis->count.resize(dest_size);
+    axis->weights.assign((size_t)dest_size * axis->max_count, 0);
+
+    std::vector<double> weights(axis->max_count);
+    for (int i = 0; i < dest_size; ++i) {
+        double center = (i + 0.5) * scale;
+        int low, high;
+        if (filter == tga::ResampleFilter::BOX) {
+            low = (int)std::floor(i * scale);
+            high = (int)std::ceil((i + 1) * scale) - 1;
+        } else {
+            low = (int)std::floor(center - support);
+            high = (int)std::ceil(center + support);
+        }
+        int first = std::max(low, 0);
+        int last = std::min(high, src_size - 1);
+        std::fill(weights.begin(), weights.end(), 0);
+        double total = 0;
+        for (int k = low; k <= high; ++k) {
+            double weight;
+            if (filter == tga::ResampleFilter::BOX) {
+                weight = std::min((i + 1) * scale, k + 1.0) -
+                         std::max(i * scale, (double)k);
+            } else {
+                weight = filter_weight(filter, (k + 0.5 - center) /
+                                                   filter_scale);
+            }
+            int clamped = std::min(std::max(k, first), last);
+            weights[clamped - first] += weight;
+            total += weight;
+        }
+        // Drop the pixels that end up with no weight at either end.
+        int count = last - first + 1;
+        int skip = 0;
+        while (skip < count - 1 && weights[skip] == 0) {
+            ++skip;
+        }
+        while (count > skip + 1 && weights[count - 1] == 0) {
+            --count;
+        }
+        axis->first[i] = first + skip;
+        axis->count[i] = count - skip;
+        float *dest = axis->weights.data() + (size_t)i * axis->max_count;
+        for (int k = skip; k < count; ++k) {
+            dest[k - skip] = (float)(total != 0 ? weights[k] / total : 1);
+        }
+    }
+
+    axis->window = 0;
+    int last = 0;
+    for (int i = 0; i < dest_size; ++i) {
+        last = std::max(last, axis->first[i] + axis->count[i]);
+        axis->window = std::max(axis->window, last - axis->first[i]);
+    }
+}
+
+// Resamples a row of C channel pixels along the axis.
+template <int C>
+void resample_row(float *dest, const float *src, const resample_axis &axis) {
+    size_t dest_size = axis.first.size();
+    for (size_t i = 0; i < dest_size; ++i) {
+        const float *pixel = src + (size_t)axis.first[i] * C;
+        const float *weights = axis.weights.data() + i * axis.max_count;
+        int count = axis.count[i];
+#ifdef TGA_USE_SSE2
+        if constexpr (C == 4) {
+            __m128 sum = _mm_setzero_ps();
+            for (int k = 0; k < count; ++k) {
+                sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[k]),
+                                                 _mm_loadu_ps(pixel + k * 4)));
+            }
+            _mm_storeu_ps(dest + i * 4, sum);
+            continue;
+        }
+        if (C == 1 && count >= 4) {
+            // Four taps at a time, then the taps left.
+            __m128 sums = _mm_setzero_ps();
+            int k = 0;
+            for (; k + 4 <= count; k += 4) {
+                sums = _mm_add_ps(sums, _mm_mul_ps(_mm_loadu_ps(weights + k),
+                                                   _mm_loadu_ps(pixel + k)));
+            }
+            sums = _mm_add_ps(sums, _mm_movehl_ps(sums, sums));
+            sums = _mm_add_ss(sums, _mm_shuffle_ps(sums, sums, 1));
+            float sum = _mm_cvtss_f32(sums);
+            for (; k < count; ++k) {
+                sum += weights[k] * pixel[k];
+            }
+            dest[i] = sum;
+            continue;
+        }
+#endif
+        float sum[C] = {};
+        for (int k = 0; k < count; ++k) {
+            for (int c = 0; c < C; ++c) {
+                sum[c] += weights[k] * pixel[k * C + c];
+            }
+        }
+        for (int c = 0; c < C; ++c) {
+            dest[i * C + c] = sum[c];
+        }
+    }
+}
+
+// Adds up count rows of size floats into dest, each scaled by its weight.
+void blend_rows(float *dest, const float *const *rows, const float *weights,
+                int count, size_t size) {
+    size_t i = 0;
+#ifdef TGA_USE_SSE2
+    for (; i + 4 <= size; i += 4) {
+        __m128 sum = _mm_setzero_ps();
+        for (int k = 0; k < count; ++k) {
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[k]),
+                                             _mm_loadu_ps(rows[k] + i)));
+        }
+        _mm_storeu_ps(dest + i, sum);
+    }
+#endif
+    for (; i < size; ++i) {
+        float sum = 0;
+        for (int k = 0; k < count; ++k) {
+            sum += weights[k] * rows[k][i];
+        }
+        dest[i] = sum;
+    }
+}
+
+float srgb_to_linear(float value) {
+    return value <= 0.04045f ? value / 12.92f
+                             : std::pow((value + 0.055f) / 1.055f, 2.4f);
+}
+
+float linear_to_srgb(float value) {
+    return value <= 0.0031308f ? value * 12.92f
+                               : 1.055f * std::pow(value, 1 / 2.4f) - 0.055f;
+}
+
+// Fine enough that the darkest 8-bit sRGB values are told apart.
+#define LINEAR_TABLE_SIZE (1 << 14)
+
+struct resample_tables {
+    float to_float[256];
+    float to_linear[256];
+    uint8_t to_srgb[LINEAR_TABLE_SIZE];
+};
+
+resample_tables make_resample_tables() {
+    resample_tables tables;
+    for (int i = 0; i < 256; ++i) {
+        tables.to_float[i] = i / 255.0f;
+        tables.to_linear[i] = srgb_to_linear(i / 255.0f);
+    }
+    for (int i = 0; i < LINEAR_TABLE_SIZE; ++i) {
+        float srgb = linear_to_srgb((float)i / (LINEAR_TABLE_SIZE - 1));
+        tables.to_srgb[i] = (uint8_t)(srgb * 255 + 0.5f);
+    }
+    return tables;
+}
+
+const resample_tables &get_resample_tables() {
+    static const resample_tables tables = make_resample_tables();
+    return tables;
+}
+
+// How the pixels of an image become rows of the resampler and back.
+struct resample_format {
+    tga::tga_pixel_format format;
+    int channels;
+    // The color channels are sRGB, they are resampled in linear light.
+    bool gamma_correct;
+    // The color channels are premultiplied by alpha while resampled.
+    bool alpha_weighted;
+    // Gets the value of each byte of a color channel.
+    const float *byte_values;
+    const uint8_t *to_srgb;
+
+    resample_format(tga::tga_pixel_format pixel_format, bool gamma,
+                    bool alpha)
+        : format(pixel_format), gamma_correct(gamma) {
+        const resample_tables &tables = get_resample_tables();
+        byte_values = gamma ? tables.to_linear : tables.to_float;
+        to_srgb = tables.to_srgb;
+        bool is_grayscale =
+            format == tga::tga_pixel_format::TGA_PIXEL_BW8 ||
+            format == tga::tga_pixel_format::TGA_PIXEL_BW16;
+        channels = is_grayscale ? 1 : 4;
+        alpha_weighted =
+            alpha && (format == tga::tga_pixel_format::TGA_PIXEL_ARGB32 ||
+                      format == tga::tga_pixel_format::TGA_PIXEL_ABGR32);
+    }
+
+    float to_float(uint8_t value) const { return byte_values[value]; }
+
+    uint8_t to_byte(float value) const {
+        value = value < 0 ? 0 : value > 1 ? 1 : value;
+        if (gamma_correct) {
+            return to_srgb[(int)(value * (LINEAR_TABLE_SIZE - 1) + 0.5f)];
+        }
+        return (uint8_t)(value * 255 + 0.5f);
+    }
+};
+
+#ifdef TGA_USE_SSE2
+// Gets the 4 channels of a pixel of the resampler from the 4 bytes of
+// packed, without sRGB.
+inline __m128 unpack_linear_pixel(uint32_t packed,
+                                  const resample_format &format) {
+    __m128i bytes = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)packed),
+                                      _mm_setzero_si128());
+    __m128 value = _mm_mul_ps(
+        _mm_cvtepi32_ps(_mm_unpacklo_epi16(bytes, _mm_setzero_si128())),
+        _mm_set1_ps(1 / 255.0f));
+    if (format.alpha_weighted) {
+        float alpha = (packed >> 24) * (1 / 255.0f);
+        value = _mm_mul_ps(value, _mm_setr_ps(alpha, alpha, alpha, 1));
+    }
+    return value;
+}
+
+// Rounds the 4 channels of a pixel of the resampler to bytes, without sRGB.
+inline uint32_t pack_linear_pixel(__m128 value,
+                                  const resample_format &format) {
+    if (format.alpha_weighted) {
+        float alpha = _mm_cvtss_f32(
+            _mm_shuffle_ps(value, value, _MM_SHUFFLE(3, 3, 3, 3)));
+        float weight = alpha > 0 ? 1 / std::min(alpha, 1.0f) : 0;
+        value = _mm_mul_ps(value, _mm_setr_ps(weight, weight, weight, 1));
+    }
+    value = _mm_min_ps(_mm_max_ps(value, _mm_setzero_ps()), _mm_set1_ps(1));
+    __m128i rounded = _mm_cvttps_epi32(_mm_add_ps(
+        _mm_mul_ps(value, _mm_set1_ps(255)), _mm_set1_ps(0.5f)));
+    rounded = _mm_packs_epi32(rounded, rounded);
+    return (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(rounded, rounded));
+}
+#endif
+
+// Turns a row of width pixels into a row of the resampler.
+void decode_resample_row(float *dest, const uint8_t *src, int width,
+                         const resample_format &format) {
+    switch (format.format) {
+        case tga::tga_pixel_format::TGA_PIXEL_BW8:
+            for (int i = 0; i < width; ++i) {
+                dest[i] = format.to_float(src[i]);
+            }
+            break;
+        case tga::tga_pixel_format::TGA_PIXEL_BW16:
+            for (int i = 0; i < width; ++i) {
+                float value = read_u16_le(src + i * 2) * (1 / 65535.0f);
+                dest[i] = format.gamma_correct ? srgb_to_linear(value) : value;
+            }
+            break;
+        case tga::tga_pixel_format::TGA_PIXEL_RGB555:
+            for (int i = 0; i < width; ++i, dest += 4) {
+                uint16_t value = read_u16_le(src + i * 2);
+                dest[0] = format.to_float(expand_5_bits(value & 0x1F));
+                dest[1] = format.to_float(expand_5_bits((value >> 5) & 0x1F));
+                dest[2] = format.to_float(expand_5_bits((value >> 10) & 0x1F));
+                dest[3] = 1;
+            }
+            break;
+        case tga::tga_pixel_format::TGA_PIXEL_RGB24:
+#ifdef TGA_USE_SSE2
+            if (!format.gamma_correct) {
+                for (int i = 0; i < width; ++i, src += 3, dest += 4) {
+                    uint32_t packed = src[0] | (src[1] << 8) |
+                                      (src[2] << 16) | 0xFF000000u;
+                    _mm_storeu_ps(dest, unpack_linear_pixel(packed, format));
+                }
+                break;
+            }
+#endif
+            for (int i = 0; i < width; ++i, src += 3, dest += 4) {
+                dest[0] = format.to_float(src[0]);
+                dest[1] = format.to_float(src[1]);
+                dest[2] = format.to_float(src[2]);
+                dest[3] = 1;
+            }
+            break;
+        case tga::tga_pixel_format::TGA_PIXEL_ARGB32:
+        case tga::tga_pixel_format::TGA_PIXEL_ABGR32:
+#ifdef TGA_USE_SSE2
+            if (!format.gamma_correct) {
+                for (int i = 0; i < width; ++i, src += 4, dest += 4) {
+                    uint32_t packed;
+                    memcpy(&packed, src, 4);
+                    _mm_storeu_ps(dest, unpack_linear_pixel(packed, format));
+                }
+                break;
+            }
+#endif
+            for (int i = 0; i < width; ++i, src += 4, dest += 4) {
+                float alpha = src[3] * (1 / 255.0f);
+                float weight = format.alpha_weighted ? alpha : 1;
+                dest[0] = format.to_float(src[0]) * weight;
+                dest[1] = format.to_float(src[1]) * weight;
+                dest[2] = format.to_float(src[2]) * weight;
+                dest[3] = alpha;
+            }
+            break;
+    }
+}
+
+// Turns a row of the resampler back into width pixels.
+void encode_resample_row(uint8_t *dest, const float *src, int width,
+                         const resample_format &format) {
+    switch (format.format) {
+        case tga::tga_pixel_format::TGA_PIXEL_BW8:
+            for (int i = 0; i < width; ++i) {
+                dest[i] = format.to_byte(src[i]);
+            }
+            break;
+        case tga::tga_pixel_format::TGA_PIXEL_BW16:
+            for (int i = 0; i < width; ++i) {
+                float value = src[i] < 0 ? 0 : src[i] > 1 ? 1 : src[i];
+                if (format.gamma_correct) {
+                    value = linear_to_srgb(value);
+                }
+                uint16_t gray = (uint16_t)(value * 65535 + 0.5f);
+                dest[i * 2] = gray & 0xFF;
+                dest[i * 2 + 1] = gray >> 8;
+            }
+            break;
+        case tga::tga_pixel_format::TGA_PIXEL_RGB555:
+            for (int i = 0; i < width; ++i, src += 4) {
+                uint32_t channels[3];
+                for (int c = 0; c < 3; ++c) {
+                    channels[c] = (format.to_byte(src[c]) * 31 + 127) / 255;
+                }
+                uint16_t value = (uint16_t)(channels[0] | (channels[1] << 5) |
+                                            (channels[2] << 10));
+                dest[i * 2] = value & 0xFF;
+                dest[i * 2 + 1] = value >> 8;
+            }
+            break;
+        case tga::tga_pixel_format::TGA_PIXEL_RGB24:
+#ifdef TGA_USE_SSE2
+            if (!format.gamma_correct) {
+                for (int i = 0; i < width; ++i, src += 4, dest += 3) {
+                    uint32_t packed =
+                        pack_linear_pixel(_mm_loadu_ps(src), format);
+                    memcpy(dest, &packed, 3);
+                }
+                break;
+            }
+#endif
+            for (int i = 0; i < width; ++i, src += 4, dest += 3) {
+                dest[0] = format.to_byte(src[0]);
+                dest[1] = format.to_byte(src[1]);
+                dest[2] = format.to_byte(src[2]);
+            }
+            break;
+        case tga::tga_pixel_format::TGA_PIXEL_ARGB32:
+        case tga::tga_pixel_format::TGA_PIXEL_ABGR32:
+#ifdef TGA_USE_SSE2
+            if (!format.gamma_correct) {
+                for (int i = 0; i < width; ++i, src += 4, dest += 4) {
+                    uint32_t packed =
+                        pack_linear_pixel(_mm_loadu_ps(src), format);
+                    memcpy(dest, &packed, 4);
+                }
+                break;
+            }
+#endif
+            for (int i = 0; i < width; ++i, src += 4, dest += 4) {
+                float alpha = src[3] < 0 ? 0 : src[3] > 1 ? 1 : src[3];
+                float weight = 1;
+                if (format.alpha_weighted) {
+                    weight = alpha > 0 ? 1 / alpha : 0;
+                }
+                dest[0] = format.to_byte(src[0] * weight);
+                dest[1] = format.to_byte(src[1] * weight);
+                dest[2] = format.to_byte(src[2] * weight);
+                dest[3] = (uint8_t)(alpha * 255 + 0.5f);
+            }
+            break;
+    }
+}
+
+// Rows [first, last) of an image, empty if first >= last.
+struct row_range {
+    int first;
+    int last;
+
+    bool empty() const { return first >= last; }
+};
+
+// Gets the smallest range holding both ranges.
+row_range merge_rows(row_range a, row_range b) {
+    if (a.empty()) {
+        return b;
+    }
+    if (b.empty()) {
+        return a;
+    }
+    return {std::min(a.first, b.first), std::max(a.last, b.last)};
+}
+
+// Gets the source rows the rows of range are made of.
+row_range source_rows(const resample_axis &axis, row_range range) {
+    row_range rows{0, 0};
+    for (int i = range.first; i < range.last; ++i) {
+        rows = merge_rows(rows, {axis.first[i], axis.first[i] + axis.count[i]});
+    }
+    return rows;
+}
+
+// An image being resampled, e.g. a level of a mip chain, with the axes that
+// make it from the image above.
+struct resample_level {
+    int width;
+    int height;
+    resample_axis horizontal;
+    resample_axis vertical;
+    uint8_t *data;
+    ptrdiff_t row_stride;
+};
+
+// Makes the rows of a level from the rows of the image above, as they come,
+// in order. Each row that comes in is resampled horizontally into a ring,
+// and each row of the level is blended from the ring as soon as its last
+// source row is in. The row then goes on to the next stage, if any, while
+// still in cache.
+struct resample_stage {
+    const resample_level *level;
+    int channels;
+    size_t row_floats;
+    std::vector<float> ring;
+    int ring_rows;
+    std::vector<const float *> blend_rows;
+    std::vector<float> row;
+    // The rows to make, of which those in owned are stored in the level.
+    row_range rows;
+    row_range owned;
+    // Where all the rows go at full precision, if not null.
+    float *floats;
+    resample_stage *next;
+};
+
+void init_resample_stage(resample_stage *stage, const resample_level *level,
+                         int channels, row_range rows, row_range owned,
+                         float *floats, resample_stage *next) {
+    stage->level = level;
+    stage->channels = channels;
+    stage->row_floats = (size_t)level->width * channels;
+    stage->ring_rows = level->vertical.window;
+    stage->ring.resize(stage->row_floats * stage->ring_rows);
+    stage->blend_rows.resize(level->vertical.max_count);
+    stage->row.resize(stage->row_floats);
+    stage->rows = rows;
+    stage->owned = owned;
+    stage->floats = floats;
+    stage->next = next;
+}
+
+// Hands source row y, the next one in order, to the stage.
+void push_resample_row(resample_stage *stage, int y, const float *src,
+                       const resample_format &format) {
+    if (stage->rows.empty()) {
+        return;
+    }
+    const resample_level &level = *stage->level;
+    float *slot = stage->ring.data() + (y % stage->ring_rows) *
+                                           stage->row_floats;
+    if (stage->channels == 1) {
+        resample_row<1>(slot, src, level.horizontal);
+    } else {
+        resample_row<4>(slot, src, level.horizontal);
+    }
+
+    while (!stage->rows.empty()) {
+        int row = stage->rows.first;
+        int first = level.vertical.first[row];
+        int count = level.vertical.count[row];
+        if (first + count - 1 > y) {
+            break;
+        }
+        for (int k = 0; k < count; ++k) {
+            stage->blend_rows[k] = stage->ring.data() +
+                                   ((first + k) % stage->ring_rows) *
+                                       stage->row_floats;
+        }
+        blend_rows(stage->row.data(), stage->blend_rows.data(),
+                   level.vertical.weights.data() +
+                       (size_t)row * level.vertical.max_count,
+                   count, stage->row_floats);
+        if (row >= stage->owned.first && row < stage->owned.last) {
+            encode_resample_row(level.data + row * level.row_stride,
+                                stage->row.data(), level.width, format);
+            if (stage->floats != nullptr) {
+                memcpy(stage->floats + row * stage->row_floats,
+                       stage->row.data(), stage->row_floats * sizeof(float));
+            }
+        }
+        if (stage->next != nullptr) {
+            push_resample_row(stage->next, row, stage->row.data(), format);
+        }
+        ++stage->rows.first;
+    }
+}
+
+// Hands rows of src, the next ones in order, to the stage.
+void push_view_rows(resample_stage *stage, const tga::ImageView &src,
+                    row_range rows, const resample_format &format) {
+    std::vector<float> row((size_t)src.get_width() * format.channels);
+    for (int y = rows.first; y < rows.last; ++y) {
+        decode_resample_row(row.data(), src.get_row(y), src.get_width(),
+                            format);
+        push_resample_row(stage, y, row.data(), format);
+    }
+}
+
+// Resamples the image from reader into data, which is resized to hold it,
+// a row at a time as the rows are decoded. The rows are taken in the order
+// the file stores them, and the source rows below the last one needed are
+// not decoded.
+tga::tga_error load_resized_image(tga::ScanlineReader *reader,
+                                  tga::PixelBuffer &data, tga::tga_info *info,
+                                  int width, int height,
+                                  tga::ResampleFilter filter) {
+    if (!check_dimensions(width, height)) {
+        return tga::tga_error::TGA_ERROR_INVALID_IMAGE_DIMENSIONS;
+    }
+    int src_width = reader->get_width();
+    int src_height = reader->get_height();
+    resample_level level;
+    level.width = width;
+    level.height = height;
+    // The filters are symmetric, so the rows can be resampled bottom up as
+    // well as top down.
+    make_resample_axis(src_width, width, filter, &level.horizontal);
+    make_resample_axis(src_height, height, filter, &level.vertical);
+    size_t row_size = (size_t)width * reader->get_pixel_size();
+    // The pixel buffer of the previous image is reused if it is large enough.
+    // Otherwise it is emptied first, so that growing it copies nothing.
+    if (row_size * height > data.capacity()) {
+        data.clear();
+    }
+    data.resize(row_size * height);
+    *info = {(uint16_t)width, (uint16_t)height, reader->get_pixel_format()};
+    bool is_bottom_up = reader->get_next_row() != 0;
+    level.data = data.data() + (is_bottom_up ? row_size * (height - 1) : 0);
+    level.row_stride = is_bottom_up ? -(ptrdiff_t)row_size : row_size;
+
+    resample_format format(info->pixel_format, false, false);
+    resample_stage stage;
+    init_resample_stage(&stage, &level, format.channels, {0, height},
+                        {0, height}, nullptr, nullptr);
+    scratch_vector<uint8_t> row(reader->get_row_size());
+    scratch_vector<float> floats((size_t)src_width * format.channels);
+    for (int y = 0; !stage.rows.empty(); ++y) {
+        if (!reader->read_row(row.data())) {
+            tga::tga_error error_code = reader->last_error();
+            return error_code != tga::tga_error::TGA_NO_ERROR
+                       ? error_code
+                       : tga::tga_error::TGA_ERROR_FILE_CANNOT_READ;
+        }
+        decode_resample_row(floats.data(), row.data(), src_width, format);
+        push_resample_row(&stage, y, floats.data(), format);
+    }
+    return tga::tga_error::TGA_NO_ERROR;
+}
+
+// Bands of a mip level smaller than this, in rows, end a pass of the chain.
+#define MIN_MIP_BAND_ROWS 32
+
+// ----------------------tga::Image implementation----------------------
+namespace tga {
+
+Image::Image(int width, int height, tga_pixel_format format)
+    : img_info{(uint16_t)width, (uint16_t)height, format} {
+    if (!check_dimensions(width, height)) {
+        err = tga_error::TGA_ERROR_INVALID_IMAGE_DIMENSIONS;
+        return;
+    }
+
+    int pixel_size = pixel_format_to_pixel_size(format);
+    if (pixel_size == -1) {
+        err = tga_error::TGA_ERROR_UNSUPPORTED_PIXEL_FORMAT;
+        return;
+    }
+
+    // reallocate data, a new image starts out black.
+    data.assign((size_t)width * height * pixel_size, 0);
+
+    err = tga_error::TGA_NO_ERROR;
+}
+
+Image::Image(std::pmr::memory_resource *resource) : data(resource) {}
+
+Image::Image(std::string_view filepath) { load(filepath); }
+
+bool Image::load(std::string_view filepath, const LoadOptions &options,
+                 const ExecutionPolicy &policy) {
+    // Bands decode from a mapping of the file. An RLE file is then indexed
+    // and decoded in place, instead of its whole payload being read into the
+    // read buffer first.
+    if (resolve_thread_count(policy) > 1) {
+        size_t mapping_size = 0;
+        const uint8_t *mapping = map_file(filepath, &mapping_size);
+        if (mapping != nullptr) {
+            struct unmap_on_exit {
+                const uint8_t *mapping;
+                size_t size;
+                ~unmap_on_exit() { unmap_file(mapping, size); }
+            } unmap{mapping, mapping_size};
+            return load_from_memory(mapping, mapping_size, options, policy);
+        }
+    }
+
+    // The decoders read in large blocks of their own, so the stream doesn't
+    // need a buffer, which saves an allocation per load.
+    std::ifstream inFile;
+    inFile.rdbuf()->pubsetbuf(nullptr, 0);
+    inFile.open(filepath.data(), std::ios::binary);
+    if (!inFile.good()) {
+        err = tga_error::TGA_ERROR_FILE_CANNOT_READ;
+        return false;
+    }
+
+    tga_reader reader;
+    reader.read = [&inFile](uint8_t *dest, size_t size) {
+        return (size_t)inFile.read((char *)dest, size).gcount();
+    };
+    reader.skip = [&inFile](size_t count) {
+        return (bool)inFile.seekg(count, std::ios::cur);
+    };
+    return load(reader, options, policy);
+}
+
+bool Image::load(const tga_reader &reader, const LoadOptions &options,
+                 const ExecutionPolicy &policy) {
+    if (!reader.read) {
+        err = tga_error::TGA_ERROR_FILE_CANNOT_READ;
+        return false;
+    }
+    // The read block and the other scratch buffers come from the arena of
+    // this thread.
+    arena_scope scope;
+#ifdef TGA_ENABLE_STATS
+    // Times the reads and counts the bytes for the stats.
+    tga_reader counted_reader;
+    if (active_recorder != nullptr) {
+        counted_reader = reader;
+        counted_reader.read = [&reader](uint8_t *dest, size_t size) {
+            stage_timer timer(&Stats::read_ns);
+            size_t count = reader.read(dest, size);
+            stats_add(&Stats::bytes_read, count);
+            return count;
+        };
+    }
+    read_buffer buffer(active_recorder != nullptr ? counted_reader : reader);
+#else
+    read_buffer buffer(reader);
+#endif
+    err = load_image(&buffer, data, &img_info, options, policy);
+    return err == tga_error::TGA_NO_ERROR;
+}
+
+bool Image::load_from_memory(const uint8_t *buffer, size_t size,
+                             const LoadOptions &options,
+                             const ExecutionPolicy &policy) {
+    if (buffer == nullptr) {
+        err = tga_error::TGA_ERROR_FILE_CANNOT_READ;
+        return false;
+    }
+    // Decodes straight from the caller's memory, nothing is copied.
+    arena_scope scope;
+    read_buffer memory(buffer, size);
+    err = load_image(&memory, data, &img_info, options, policy);
+    TGA_STATS_ONLY(stats_add(&Stats::bytes_read, memory.pos);)
+    return err == tga_error::TGA_NO_ERROR;
+}
+
+bool Image::load_region(std::string_view filepath, int x, int y, int width,
+                        int height, const LoadOptions &options,
+                        ScanlineIndex *index) {
+    std::ifstream inFile;
+    inFile.rdbuf()->pubsetbuf(nullptr, 0);
+    inFile.open(filepath.data(), std::ios::binary);
+    if (!inFile.good()) {
+        err = tga_error::TGA_ERROR_FILE_CANNOT_READ;
+        return false;
+    }
+
+    // Rows out of the region are skipped by seeking over them.
+    tga_reader reader;
+    reader.read = [&inFile](uint8_t *dest, size_t size) {
+        return (size_t)inFile.read((char *)dest, size).gcount();
+    };
+    reader.skip = [&inFile](size_t count) {
+        return (bool)inFile.seekg(count, std::ios::cur);
+    };
+    reader.seek = [&inFile](uint64_t offset) {
+        inFile.clear();
+        return (bool)inFile.seekg((std::streamoff)offset, std::ios::beg);
+    };
+    inFile.seekg(0, std::ios::end);
+    uint64_t file_size = (uint64_t)inFile.tellg();
+    inFile.seekg(0, std::ios::beg);
+    arena_scope scope;
+    read_buffer buffer(reader);
+    err = load_image_region(&buffer, data, &img_info, options, x, y, width,
+                            height, file_size,
+                            index ? &index->rows : nullptr,
+                            index ? &index->key : nullptr);
+    return err == tga_error::TGA_NO_ERROR;
+}
+
+bool Image::load_region_from_memory(const uint8_t *buffer, size_t size, int x,
+                                    int y, int width, int height,
+                                    const LoadOptions &options,
+                                    ScanlineIndex *index) {
+    if (buffer == nullptr) {
+        err = tga_error::TGA_ERROR_FILE_CANNOT_READ;
+        return false;
+    }
+    arena_scope scope;
+    read_buffer memory(buffer, size);
+    err = load_image_region(&memory, data, &img_info, options, x, y, width,
+                            height, size, index ? &index->rows : nullptr,
+                            index ? &index->key : nullptr);
+    return err == tga_error::TGA_NO_ERROR;
+}
+
+bool Image::load_resized(std::string_view filepath, int width, int height,
+                         ResampleFilter filter, const LoadOptions &options) {
+    ScanlineReader reader;
+    if (!reader.open(filepath, options, ScanlineOrder::STORED)) {
+        err = reader.last_error();
+        return false;
+    }
+    arena_scope scope;
+    err = load_resized_image(&reader, data, &img_info, width, height, filter);
+    return err == tga_error::TGA_NO_ERROR;
+}
+
+bool Image::load_resized_from_memory(const uint8_t *buffer, size_t size,
+                                     int width, int height,
+                                     ResampleFilter filter,
+                                     const LoadOptions &options) {
+    ScanlineReader reader;
+    if (!reader.open_from_memory(buffer, size, options,
+                                 ScanlineOrder::STORED)) {
+        err = reader.last_error();
+        return false;
+    }
+    arena_scope scope;
+    err = load_resized_image(&reader, data, &img_info, width, height, filter);
+    return err == tga_error::TGA_NO_ERROR;
+}
+
+bool Image::save(std::string_view filepath, const SaveOptions &options,
+                 const ExecutionPolicy &policy) {
+    err = get_view().save(filepath, options, policy);
+    return err == tga_error::TGA_NO_ERROR;
+}
+
+bool Image::save(const tga_writer &writer, const SaveOptions &options,
+                 const ExecutionPolicy &policy) {
+    err = get_view().save(writer, options, policy);
+    return err == tga_error::TGA_NO_ERROR;
+}
+
+bool Image::save_to_memory(std::vector<uint8_t> &buffer,
+                           const SaveOptions &options,
+                           const ExecutionPolicy &policy) {
+    buffer.clear();
+    tga_writer writer;
+    writer.write = [&buffer](const uint8_t *src, size_t size) {
+        buffer.insert(buffer.end(), src, src + size);
+        return true;
+    };
+    return save(writer, options, policy);
+}
+
+bool Image::convert(tga_pixel_format format, const ExecutionPolicy &policy) {
+    int pixel_size = pixel_format_to_pixel_size(format);
+    if (pixel_size == -1) {
+        err = tga_error::TGA_ERROR_UNSUPPORTED_PIXEL_FORMAT;
+        return false;
+    }
+    if (data.empty()) {
+        err = tga_error::TGA_ERROR_NO_DATA;
+        return false;
+    }
+    err = tga_error::TGA_NO_ERROR;
+    if (format == img_info.pixel_format) {
+        return true;
+    }
+
+    PixelBuffer converted((size_t)img_info.width * img_info.height * pixel_size,
+                          data.get_allocator());
+    tga::convert(ImageView(converted.data(), img_info.width, img_info.height,
+                           format),
+                 get_view(), policy);
+    data.swap(converted);
+    img_info.pixel_format = format;
+    return true;
+}
+
+void Image::flip_h(const ExecutionPolicy &policy) {
+    get_view().flip_h(policy);
+}
+
+void Image::flip_v(const ExecutionPolicy &policy) {
+    get_view().flip_v(policy);
+}
+
+tga_error Image::last_error() const { return err; }
+
+uint8_t *Image::get_pixel(int x, int y) {
+    if (x < 0) {
+        x = 0;
+    } else if (x >= img_info.width) {
+        x = img_info.width - 1;
+    }
+    if (y < 0) {
+        y = 0;
+    } else if (y >= img_info.height) {
+        y = img_info.height - 1;
+    }
+    int pixel_size = pixel_format_to_pixel_size(img_info.pixel_format);
+    return data.data() + (y * img_info.width + x) * pixel_size;
+}
+
+uint8_t *Image::get_raw_data() { return data.data(); }
+
+PixelBuffer &Image::get_data() { return data; }
+
+ImageView Image::get_view() {
+    return ImageView(data.data(), img_info.width, img_info.height,
+                     img_info.pixel_format);
+}
+
+ImageView Image::get_view(int x, int y, int width, int height) {
+    return get_view().subview(x, y, width, height);
+}
+
+uint16_t Image::get_width() const { return img_info.width; }
+
+uint16_t Image::get_height() const { return img_info.height; }
+
+tga_pixel_format Image::get_pixel_format() const {
+    return img_info.pixel_format;
+}
+
+uint8_t Image::get_pixel_size() const {
+    return pixel_format_to_pixel_size(img_info.pixel_format);
+}
+
+const uint8_t *Image::get_raw_data() const { return data.data(); }
+
+const PixelBuffer &Image::get_data() const { return data; }
+
+// ----------------------tga::ImageView implementation----------------------
+
+ImageView::ImageView(uint8_t *data, int width, int height,
+                     tga_pixel_format format, ptrdiff_t row_stride) {
+    int size = pixel_format_to_pixel_size(format);
+    if (data == nullptr || !check_dimensions(width, height) || size == -1) {
+        return;
+    }
+    this->data = data;
+    this->row_stride = row_stride != 0 ? row_stride : (ptrdiff_t)width * size;
+    img_info = {(uint16_t)width, (uint16_t)height, format};
+    pixel_size = (uint8_t)size;
+}
+
+ImageView ImageView::subview(int x, int y, int width, int height) const {
+    if (x < 0 || y < 0 || width <= 0 || height <= 0 ||
+        x + width > img_info.width || y + height > img_info.height) {
+        return ImageView();
+    }
+    return ImageView(get_pixel(x, y), width, height, img_info.pixel_format,
+                     row_stride);
+}
+
+tga_error ImageView::save(std::string_view filepath,
+                          const SaveOptions &options,
+                          const ExecutionPolicy &policy) const {
+    if (empty()) {
+        return tga_error::TGA_ERROR_NO_DATA;
+    }
+
+    // Check if a file with the same name already exists.
+    std::ofstream outFile(filepath.data(), std::ios::binary);
+    if (!outFile.good()) {
+        return tga_error::TGA_ERROR_FILE_CANNOT_WRITE;
+    }
+
+    tga_writer writer;
+    writer.write = [&outFile](const uint8_t *src, size_t size) {
+        return (bool)outFile.write((const char *)src, size);
+    };
+    tga_error error_code = save(writer, options, policy);
+    outFile.close();  // you can't delete a file while it's opened.
+
+    if (error_code != tga_error::TGA_NO_ERROR) {
+        std::remove(filepath.data());
+    }
+    return error_code;
+}
+
+tga_error ImageView::save(const tga_writer &writer, const SaveOptions &options,
+                          const ExecutionPolicy &policy) const {
+    if (empty()) {
+        return tga_error::TGA_ERROR_NO_DATA;
+    }
+    if (!writer.write) {
+        return tga_error::TGA_ERROR_FILE_CANNOT_WRITE;
+    }
+#ifdef TGA_ENABLE_STATS
+    stats_add(&Stats::saves, 1);
+    stage_timer timer(&Stats::save_ns);
+    // Times the writes and counts the bytes for the stats.
+    tga_writer counted_writer;
+    if (active_recorder != nullptr) {
+        counted_writer.write = [&writer](const uint8_t *src, size_t size) {
+            stage_timer timer(&Stats::write_ns);
+            stats_add(&Stats::bytes_written, size);
+            return writer.write(src, size);
+        };
+    }
+    return save_image(data, &img_info, row_stride,
+                      active_recorder != nullptr ? counted_writer : writer,
+                      options, policy);
+#else
+    return save_image(data, &img_info, row_stride, writer, options, policy);
+#endif
+}
+
+tga_error ImageView::save_to_memory(std::vector<uint8_t> &buffer,
+                                    const SaveOptions &options,
+                                    const ExecutionPolicy &policy) const {
+    buffer.clear();
+    tga_writer writer;
+    writer.write = [&buffer](const uint8_t *src, size_t size) {
+        buffer.insert(buffer.end(), src, src + size);
+        return true;
+    };
+    return save(writer, options, policy);
+}
+
+void ImageView::flip_h(const ExecutionPolicy &policy) const {
+    if (empty()) {
+        return;
+    }
+    TGA_STATS_ONLY(stage_timer timer(&Stats::flip_ns);)
+
+    // Reverse each row in turn, so the flip streams through memory once.
+    size_t row_size = (size_t)img_info.width * pixel_size;
+    run_row_bands(img_info.height, row_size, policy,
+                  [&](int first_row, int last_row) {
+                      for (int y = first_row; y < last_row; ++y) {
+                          reverse_row(get_row(y), img_info.width, pixel_size);
+                      }
+                  });
+}
+
+void ImageView::flip_v(const ExecutionPolicy &policy) const {
+    if (empty()) {
+        return;
+    }
+    TGA_STATS_ONLY(stage_timer timer(&Stats::flip_ns);)
+
+    // Swap whole rows, from the outside in. The bands are made of pairs of
+    // rows, each pair swapped by one thread.
+    size_t row_size = (size_t)img_info.width * pixel_size;
+    run_row_bands(img_info.height / 2, row_size * 2, policy,
+                  [&](int first_pair, int last_pair) {
+                      for (int i = first_pair; i < last_pair; ++i) {
+                          uint8_t *top = get_row(i);
+                          uint8_t *bottom = get_row(img_info.height - 1 - i);
+                          std::swap_ranges(top, top + row_size, bottom);
+                      }
+                  });
+}
+
+tga_error convert(const ImageView &dest, const ImageView &src,
+                  const ExecutionPolicy &policy) {
+    if (dest.empty() || src.empty()) {
+        return tga_error::TGA_ERROR_NO_DATA;
+    }
+    if (dest.get_width() != src.get_width() ||
+        dest.get_height() != src.get_height()) {
+        return tga_error::TGA_ERROR_INVALID_IMAGE_DIMENSIONS;
+    }
+    TGA_STATS_ONLY(stage_timer timer(&Stats::convert_ns);)
+
+    int width = src.get_width();
+    size_t row_size = (size_t)width *
+                      std::max(dest.get_pixel_size(), src.get_pixel_size());
+    // Packed views are converted in one go per band.
+    bool is_packed =
+        dest.get_row_stride() == (ptrdiff_t)width * dest.get_pixel_size() &&
+        src.get_row_stride() == (ptrdiff_t)width * src.get_pixel_size();
+    run_row_bands(src.get_height(), row_size, policy,
+                  [&](int first_row, int last_row) {
+                      if (is_packed) {
+                          convert_pixels(dest.get_row(first_row),
+                                         dest.get_pixel_format(),
+                                         src.get_row(first_row),
+                                         src.get_pixel_format(),
+                                         (size_t)width *
+                                             (last_row - first_row));
+                          return;
+                      }
+                      for (int y = first_row; y < last_row; ++y) {
+                          convert_pixels(dest.get_row(y),
+                                         dest.get_pixel_format(),
+                                         src.get_row(y),
+                                         src.get_pixel_format(), width);
+                      }
+                  });
+    return tga_error::TGA_NO_ERROR;
+}
+
+tga_error copy_rect(const ImageView &dest, int dest_x, int dest_y,
+                    const ImageView &src, int src_x, int src_y, int width,
+                    int height) {
+    if (dest.empty() || src.empty()) {
+        return tga_error::TGA_ERROR_NO_DATA;
+    }
+    ImageView dest_rect = dest.subview(dest_x, dest_y, width, height);
+    ImageView src_rect = src.subview(src_x, src_y, width, height);
+    if (dest_rect.empty() || src_rect.empty()) {
+        return tga_error::TGA_ERROR_INVALID_IMAGE_DIMENSIONS;
+    }
+    return convert(dest_rect, src_rect);
+}
+
+tga_error blit(const ImageView &dest, int x, int y, const ImageView &src) {
+    if (dest.empty() || src.empty()) {
+        return tga_error::TGA_ERROR_NO_DATA;
+    }
+    // Clip the source to the part that lands inside dest.
+    int left = std::max(x, 0);
+    int top = std::max(y, 0);
+    int right = std::min(x + src.get_width(), (int)dest.get_width());
+    int bottom = std::min(y + src.get_height(), (int)dest.get_height());
+    if (left >= right || top >= bottom) {
+        return tga_error::TGA_NO_ERROR;
+    }
+    return copy_rect(dest, left, top, src, left - x, top - y, right - left,
+                     bottom - top);
+}
+
+// --------------------tga::generate_mipmaps implementation--------------------
+
+tga_error generate_mipmaps(const ImageView &image, std::vector<Image> &levels,
+                           const MipmapOptions &options,
+                           const ExecutionPolicy &policy) {
+    if (image.empty()) {
+        return tga_error::TGA_ERROR_NO_DATA;
+    }
+
+    std::vector<resample_level> chain;
+    int width = image.get_width();
+    int height = image.get_height();
+    while ((width > 1 || height > 1) &&
+           (options.max_levels <= 0 ||
+            (int)chain.size() < options.max_levels)) {
+        resample_level level;
+        level.width = std::max(width / 2, 1);
+        level.height = std::max(height / 2, 1);
+        make_resample_axis(width, level.width, options.filter,
+                           &level.horizontal);
+        make_resample_axis(height, level.height, options.filter,
+                           &level.vertical);
+        chain.push_back(std::move(level));
+        width = chain.back().width;
+        height = chain.back().height;
+    }
+
+    tga_pixel_format pixel_format = image.get_pixel_format();
+    levels.resize(chain.size());
+    for (size_t i = 0; i < chain.size(); ++i) {
+        resample_level &level = chain[i];
+        Image &img = levels[i];
+        size_t row_size = (size_t)level.width * image.get_pixel_size();
+        img.data.resize(row_size * level.height);
+        img.img_info = {(uint16_t)level.width, (uint16_t)level.height,
+                        pixel_format};
+        img.err = tga_error::TGA_NO_ERROR;
+        level.data = img.data.data();
+        level.row_stride = row_size;
+    }
+
+    resample_format format(pixel_format, options.gamma_correct,
+                           options.alpha_weighted);
+    int channels = format.channels;
+    // The last level of a pass at full precision, for the next pass.
+    std::vector<float> floats;
+    std::vector<float> next_floats;
+    size_t first = 0;
+    while (first < chain.size()) {
+        // A pass makes levels [first, last), each band of threads taking
+        // the same share of the rows of every level. The levels below
+        // would leave too few rows per band, they start a new pass.
+        int src_width =
+            first == 0 ? image.get_width() : chain[first - 1].width;
+        size_t band_count = get_band_count(
+            chain[first].height,
+            (size_t)src_width * channels * sizeof(float) * 2, policy);
+        band_count = std::max(band_count, (size_t)1);
+        size_t last = first + 1;
+        while (last < chain.size() &&
+               (band_count <= 1 ||
+                chain[last].height / band_count >= MIN_MIP_BAND_ROWS)) {
+            ++last;
+        }
+        float *last_floats = nullptr;
+        if (last < chain.size()) {
+            const resample_level &level = chain[last - 1];
+            next_floats.resize((size_t)level.width * level.height * channels);
+            last_floats = next_floats.data();
+        }
+
+        run_bands(band_count, (int)band_count, [&](size_t band, int, int) {
+            // The band makes the rows it owns of each level, and the rows
+            // of the levels above that those are made of. Rows at the edges
+            // of the band are made by both bands next to it, in the same
+            // way, so the result doesn't depend on the number of bands.
+            size_t stage_count = last - first;
+            std::vector<resample_stage> stages(stage_count);
+            row_range rows{0, 0};
+            for (size_t i = stage_count; i-- > 0;) {
+                const resample_level &level = chain[first + i];
+                row_range owned{(int)(level.height * band / band_count),
+                                (int)(level.height * (band + 1) / band_count)};
+                row_range needed = merge_rows(owned, rows);
+                init_resample_stage(
+                    &stages[i], &level, channels, needed, owned,
+                    i + 1 == stage_count ? last_floats : nullptr,
+                    i + 1 == stage_count ? nullptr : &stages[i + 1]);
+                rows = source_rows(level.vertical, needed);
+            }
+
+            if (first == 0) {
+                push_view_rows(&stages[0], image, rows, format);
+                return;
+            }
+            size_t row_floats = (size_t)chain[first - 1].width * channels;
+            for (int y = rows.first; y < rows.last; ++y) {
+                push_resample_row(&stages[0], y,
+                                  floats.data() + y * row_floats, format);
+            }
+        });
+
+        floats.swap(next_floats);
+        first = last;
+    }
+    return tga_error::TGA_NO_ERROR;
+}
+
+// -------------------------tga::resize implementation-------------------------
+
+tga_error resize(const ImageView &dest, const ImageView &src,
+                 ResampleFilter filter, const ExecutionPolicy &policy) {
+    if (dest.empty() || src.empty()) {
+        return tga_error::TGA_ERROR_NO_DATA;
+    }
+    if (dest.get_pixel_format() != src.get_pixel_format()) {
+        return tga_error::TGA_ERROR_UNSUPPORTED_PIXEL_FORMAT;
+    }
+
+    resample_level level;
+    level.width = dest.get_width();
+    level.height = dest.get_height();
+    make_resample_axis(src.get_width(), level.width, filter,
+                       &level.horizontal);
+    make_resample_axis(src.get_height(), level.height, filter,
+                       &level.vertical);
+    level.data = dest.get_row(0);
+    level.row_stride = dest.get_row_stride();
+
+    resample_format format(src.get_pixel_format(), false, false);
+    size_t band_count = get_band_count(
+        level.height,
+        (size_t)src.get_width() * format.channels * sizeof(float) * 2,
+        policy);
+    run_bands(band_count, level.height,
+              [&](size_t, int first_row, int last_row) {
+                  // Each band makes its rows from the source rows they span,
+                  // which the bands next to it may decode as well.
+                  resample_stage stage;
+                  row_range rows{first_row, last_row};
+                  init_resample_stage(&stage, &level, format.channels, rows,
+                                      rows, nullptr, nullptr);
+                  push_view_rows(&stage, src,
+                                 source_rows(level.vertical, rows), format);
+              });
+    return tga_error::TGA_NO_ERROR;
+}
+
+Image resize(const Image &image, int width, int height, ResampleFilter filter,
+             const ExecutionPolicy &policy) {
+    Image result(image.data.get_allocator().get_resource());
+    if (image.data.empty()) {
+        result.err = tga_error::TGA_ERROR_NO_DATA;
+        return result;
+    }
+    if (!check_dimensions(width, height)) {
+        result.err = tga_error::TGA_ERROR_INVALID_IMAGE_DIMENSIONS;
+        return result;
+    }
+    const tga_info &info = image.img_info;
+    int pixel_size = pixel_format_to_pixel_size(info.pixel_format);
+    result.data.resize((size_t)width * height * pixel_size);
+    result.img_info = {(uint16_t)width, (uint16_t)height, info.pixel_format};
+    // The view of the source is only read.
+    ImageView src(const_cast<uint8_t *>(image.data.data()), info.width,
+                  info.height, info.pixel_format);
+    result.err = resize(result.get_view(), src, filter, policy);
+    if (result.err != tga_error::TGA_NO_ERROR) {
+        result.data.clear();
+        result.img_info = {0, 0, info.pixel_format};
+    }
+    return result;
+}
+
+// ----------------------tga::MappedImage implementation----------------------
+
+MappedImage::MappedImage(std::string_view filepath) { open(filepath); }
+
+MappedImage::~MappedImage() { close(); }
+
+MappedImage::MappedImage(MappedImage &&other) noexcept {
+    *this = std::move(other);
+}
+
+MappedImage &MappedImage::operator=(MappedImage &&other) noexcept {
+    if (this != &other) {
+        close();
+        mapping = other.mapping;
+        mapping_size = other.mapping_size;
+        payload = other.payload;
+        origin = other.origin;
+        row_stride = other.row_stride;
+        pixel_stride = other.pixel_stride;
+        img_info = other.img_info;
+        err = other.err;
+        other.mapping = nullptr;
+        other.close();
+    }
+    return *this;
+}
+
+bool MappedImage::open(std::string_view filepath) {
+    close();
+
+    mapping = map_file(filepath, &mapping_size);
+    if (mapping == nullptr) {
+        err = tga_error::TGA_ERROR_FILE_CANNOT_READ;
+        return false;
+    }
+    if (mapping_size < HEADER_SIZE) {
+        close();
+        err = tga_error::TGA_ERROR_FILE_CANNOT_READ;
+        return false;
+    }
+
+    tga_header header;
+    parse_header(mapping, &header);
+    tga_info info;
+    tga_error error_code = check_header(header, &info);
+    if (error_code == tga_error::TGA_NO_ERROR &&
+        (IS_COLOR_MAPPED(header) || IS_RLE(header))) {
+        // The payload of these images can't be used in place.
+        error_code = tga_error::TGA_ERROR_UNSUPPORTED_IMAGE_TYPE;
+    }
+    if (error_code != tga_error::TGA_NO_ERROR) {
+        close();
+        err = error_code;
+        return false;
+    }
+
+    // Skip the ID field and the color map, which may be present even if the
+    // image is not color mapped.
+    size_t offset = HEADER_SIZE + header.id_length;
+    if (header.map_type == 1) {
+        offset += header.map_length * BITS_TO_BYTES(header.map_entry_size);
+    }
+    int pixel_size = pixel_format_to_pixel_size(info.pixel_format);
+    size_t data_size = (size_t)info.width * info.height * pixel_size;
+    if (offset > mapping_size || mapping_size - offset < data_size) {
+        close();
+        err = tga_error::TGA_ERROR_FILE_CANNOT_READ;
+        return false;
+    }
+
+    img_info = info;
+    payload = mapping + offset;
+
+    // Work out how to walk the stored pixels from the upper left corner,
+    // instead of flipping them like Image::load does.
+    bool b_flip_h = header.image_descriptor & 0x10;
+    bool b_flip_v = !(header.image_descriptor & 0x20);
+    ptrdiff_t stored_row_size = (ptrdiff_t)info.width * pixel_size;
+    row_stride = b_flip_v ? -stored_row_size : stored_row_size;
+    pixel_stride = b_flip_h ? -pixel_size : pixel_size;
+    origin = payload;
+    if (b_flip_v) {
+        origin += (ptrdiff_t)(info.height - 1) * stored_row_size;
+    }
+    if (b_flip_h) {
+        origin += (ptrdiff_t)(info.width - 1) * pixel_size;
+    }
+
+    err = tga_error::TGA_NO_ERROR;
+    return true;
+}
+
+void MappedImage::close() {
+    if (mapping != nullptr) {
+        unmap_file(mapping, mapping_size);
+    }
+    mapping = nullptr;
+    mapping_size = 0;
+    payload = nullptr;
+    origin = nullptr;
+    row_stride = 0;
+    pixel_stride = 0;
+    img_info = tga_info{0, 0, tga_pixel_format::TGA_PIXEL_BW8};
+}
+
+const uint8_t *MappedImage::get_pixel(int x, int y) const {
+    if (origin == nullptr) {
+        return nullptr;
+    }
+    if (x < 0) {
         x = 0;
     } else if (x >= img_info.width) {
         x = img_info.width - 1;
     }
-    if (y < 0) {
-        y = 0;
-    } else if (y >= img_info.height) {
-        y = img_info.height - 1;
+    if (y < 0) {
+        y = 0;
+    } else if (y >= img_info.height) {
+        y = img_info.height - 1;
+    }
+    return origin + y * row_stride + x * pixel_stride;
+}
+
+const uint8_t *MappedImage::get_row(int y) const { return get_pixel(0, y); }
+
+const uint8_t *MappedImage::get_raw_data() const { return payload; }
+
+size_t MappedImage::get_data_size() const {
+    return payload == nullptr ? 0
+                              : (size_t)img_info.width * img_info.height *
+                                    get_pixel_size();
+}
+
+ptrdiff_t MappedImage::get_row_stride() const { return row_stride; }
+
+ptrdiff_t MappedImage::get_pixel_stride() const { return pixel_stride; }
+
+tga_error MappedImage::last_error() const { return err; }
+
+uint16_t MappedImage::get_width() const { return img_info.width; }
+
+uint16_t MappedImage::get_height() const { return img_info.height; }
+
+tga_pixel_format MappedImage::get_pixel_format() const {
+    return img_info.pixel_format;
+}
+
+uint8_t MappedImage::get_pixel_size() const {
+    return pixel_format_to_pixel_size(img_info.pixel_format);
+}
+
+// ---------------------tga::ScanlineReader implementation---------------------
+
+// Rows handed out in the reverse of the stored order are decoded a window of
+// about this size at a time, then served from the window.
+#define SCANLINE_WINDOW_SIZE (256 * 1024)
+
+struct ScanlineReader::state {
+    std::ifstream file;
+    tga_reader file_reader;
+    std::optional<read_buffer> buffer;
+    tga_header header;
+    tga_info info;
+    tga_pixel_format file_format;
+    color_map map;
+    uint8_t pixel_size{0};
+    bool is_rle{false};
+    bool is_color_mapped{false};
+    bool b_flip_h{false};
+    bool b_flip_v{false};
+    ScanlineOrder order{ScanlineOrder::TOP_DOWN};
+    // The rows are handed out in the reverse of the stored order.
+    bool reversed{false};
+    // Number of rows handed out.
+    int next_row{0};
+    // Pixels of the RLE packet at the buffer position that are already
+    // decoded.
+    size_t rle_skip{0};
+    size_t payload_offset{0};
+    scratch_vector<rle_row_start> rle_rows;
+    scratch_vector<uint8_t> window;
+    int window_first{0};
+    int window_rows{0};
+
+    // The scratch buffers outlive the call that opens the reader, which may
+    // then be used from another thread, so they come from the heap.
+    state() : map(nullptr), rle_rows(nullptr), window(nullptr) {}
+
+    tga_error start(const LoadOptions &options, ScanlineOrder row_order);
+    tga_error decode_next(uint8_t *dest, int count);
+    tga_error fill_window(int stored_row);
+};
+
+tga_error ScanlineReader::state::start(const LoadOptions &options,
+                                       ScanlineOrder row_order) {
+    tga_error error_code = load_image_head(&*buffer, options, &header, &info,
+                                           &file_format, &map);
+    if (error_code != tga_error::TGA_NO_ERROR) {
+        return error_code;
+    }
+    pixel_size = BITS_TO_BYTES(header.pixel_depth);
+    is_rle = IS_RLE(header);
+    is_color_mapped = IS_COLOR_MAPPED(header);
+    b_flip_h = header.image_descriptor & 0x10;
+    b_flip_v = !(header.image_descriptor & 0x20);
+    order = row_order;
+    reversed = order == ScanlineOrder::TOP_DOWN && b_flip_v;
+    if (!reversed) {
+        return tga_error::TGA_NO_ERROR;
+    }
+
+    // Rows are read backwards a window at a time, which needs seeking.
+    if (buffer->reader != nullptr && !buffer->reader->seek) {
+        return tga_error::TGA_ERROR_FILE_CANNOT_READ;
+    }
+    payload_offset = get_payload_offset(header);
+    if (is_rle) {
+        size_t payload_size;
+        error_code = index_rle_rows(&*buffer, &info, pixel_size, false,
+                                    &rle_rows, &payload_size);
+        if (error_code != tga_error::TGA_NO_ERROR) {
+            return error_code;
+        }
+    }
+    size_t row_size =
+        (size_t)info.width * pixel_format_to_pixel_size(info.pixel_format);
+    size_t rows = SCANLINE_WINDOW_SIZE / row_size;
+    window_rows = rows < 1 ? 1 : rows > info.height ? info.height : (int)rows;
+    window.resize(window_rows * row_size);
+    window_first = info.height;
+    return tga_error::TGA_NO_ERROR;
+}
+
+// Decodes the next count stored rows from the read buffer into dest, in
+// stored order.
+tga_error ScanlineReader::state::decode_next(uint8_t *dest, int count) {
+    tga_info rows_info{info.width, (uint16_t)count, info.pixel_format};
+    if (is_rle) {
+        return decode_rle_rows(dest, &rows_info, pixel_size, file_format,
+                               is_color_mapped, &map, &*buffer, b_flip_h,
+                               false, 0, count, rle_skip, &rle_skip);
+    }
+    size_t src_size = (size_t)info.width * pixel_size * count;
+    if (!ensure_bytes(&*buffer, src_size)) {
+        return tga_error::TGA_ERROR_FILE_CANNOT_READ;
+    }
+    const uint8_t *src = buffer->bytes + buffer->pos;
+    buffer->pos += src_size;
+    return decode_rows(dest, &rows_info, pixel_size, file_format,
+                       is_color_mapped, &map, src, 0, count, b_flip_h, false);
+}
+
+// Decodes the window of stored rows that ends with stored_row.
+tga_error ScanlineReader::state::fill_window(int stored_row) {
+    int first = stored_row + 1 - window_rows;
+    first = first < 0 ? 0 : first;
+    size_t offset;
+    if (is_rle) {
+        offset = rle_rows[first].offset;
+        rle_skip = rle_rows[first].skip;
+    } else {
+        offset = (size_t)first * info.width * pixel_size;
+    }
+    if (!seek_bytes(&*buffer, payload_offset + offset)) {
+        return tga_error::TGA_ERROR_FILE_CANNOT_READ;
+    }
+    tga_error error_code =
+        decode_next(window.data(), stored_row + 1 - first);
+    if (error_code != tga_error::TGA_NO_ERROR) {
+        return error_code;
+    }
+    window_first = first;
+    return tga_error::TGA_NO_ERROR;
+}
+
+ScanlineReader::ScanlineReader() = default;
+
+ScanlineReader::ScanlineReader(std::string_view filepath,
+                               const LoadOptions &options,
+                               ScanlineOrder order) {
+    open(filepath, options, order);
+}
+
+ScanlineReader::~ScanlineReader() = default;
+
+ScanlineReader::ScanlineReader(ScanlineReader &&other) noexcept {
+    *this = std::move(other);
+}
+
+ScanlineReader &ScanlineReader::operator=(ScanlineReader &&other) noexcept {
+    if (this != &other) {
+        impl = std::move(other.impl);
+        img_info = other.img_info;
+        err = other.err;
+        other.close();
+    }
+    return *this;
+}
+
+bool ScanlineReader::open(std::string_view filepath,
+                          const LoadOptions &options, ScanlineOrder order) {
+    close();
+    impl = std::make_unique<state>();
+
+    // Same as Image::load, the read buffer makes the stream buffer useless.
+    std::ifstream &file = impl->file;
+    file.rdbuf()->pubsetbuf(nullptr, 0);
+    file.open(filepath.data(), std::ios::binary);
+    if (!file.good()) {
+        impl.reset();
+        err = tga_error::TGA_ERROR_FILE_CANNOT_READ;
+        return false;
+    }
+
+    tga_reader &reader = impl->file_reader;
+    reader.read = [&file](uint8_t *dest, size_t size) {
+        return (size_t)file.read((char *)dest, size).gcount();
+    };
+    reader.skip = [&file](size_t count) {
+        return (bool)file.seekg(count, std::ios::cur);
+    };
+    reader.seek = [&file](uint64_t offset) {
+        file.clear();
+        return (bool)file.seekg((std::streamoff)offset, std::ios::beg);
+    };
+    impl->buffer.emplace(reader, nullptr);
+    return begin(options, order);
+}
+
+bool ScanlineReader::open(const tga_reader &reader, const LoadOptions &options,
+                          ScanlineOrder order) {
+    close();
+    if (!reader.read) {
+        err = tga_error::TGA_ERROR_FILE_CANNOT_READ;
+        return false;
+    }
+    impl = std::make_unique<state>();
+    impl->buffer.emplace(reader, nullptr);
+    return begin(options, order);
+}
+
+bool ScanlineReader::open_from_memory(const uint8_t *buffer, size_t size,
+                                      const LoadOptions &options,
+                                      ScanlineOrder order) {
+    close();
+    if (buffer == nullptr) {
+        err = tga_error::TGA_ERROR_FILE_CANNOT_READ;
+        return false;
+    }
+    impl = std::make_unique<state>();
+    impl->buffer.emplace(buffer, size);
+    return begin(options, order);
+}
+
+bool ScanlineReader::begin(const LoadOptions &options, ScanlineOrder order) {
+    err = impl->start(options, order);
+    if (err != tga_error::TGA_NO_ERROR) {
+        impl.reset();
+        return false;
+    }
+    img_info = impl->info;
+    return true;
+}
+
+void ScanlineReader::close() {
+    impl.reset();
+    img_info = tga_info{0, 0, tga_pixel_format::TGA_PIXEL_BW8};
+}
+
+bool ScanlineReader::read_row(uint8_t *dest) {
+    if (impl == nullptr || impl->next_row >= img_info.height) {
+        err = tga_error::TGA_ERROR_NO_DATA;
+        return false;
+    }
+    state &s = *impl;
+    if (!s.reversed) {
+        err = s.decode_next(dest, 1);
+    } else {
+        int stored_row = img_info.height - 1 - s.next_row;
+        if (stored_row < s.window_first) {
+            err = s.fill_window(stored_row);
+        }
+        if (err == tga_error::TGA_NO_ERROR) {
+            size_t row_size = get_row_size();
+            memcpy(dest,
+                   s.window.data() + (stored_row - s.window_first) * row_size,
+                   row_size);
+        }
+    }
+    if (err != tga_error::TGA_NO_ERROR) {
+        return false;
+    }
+    ++s.next_row;
+    return true;
+}
+
+int ScanlineReader::get_next_row() const {
+    if (impl == nullptr || impl->next_row >= img_info.height) {
+        return -1;
+    }
+    if (impl->order == ScanlineOrder::STORED && impl->b_flip_v) {
+        return img_info.height - 1 - impl->next_row;
+    }
+    return impl->next_row;
+}
+
+size_t ScanlineReader::get_row_size() const {
+    return (size_t)img_info.width *
+           pixel_format_to_pixel_size(img_info.pixel_format);
+}
+
+tga_error ScanlineReader::last_error() const { return err; }
+
+uint16_t ScanlineReader::get_width() const { return img_info.width; }
+
+uint16_t ScanlineReader::get_height() const { return img_info.height; }
+
+tga_pixel_format ScanlineReader::get_pixel_format() const {
+    return img_info.pixel_format;
+}
+
+uint8_t ScanlineReader::get_pixel_size() const {
+    return pixel_format_to_pixel_size(img_info.pixel_format);
+}
+
+// ---------------------tga::ScanlineWriter implementation---------------------
+
+struct ScanlineWriter::state {
+    std::ofstream file;
+    // Removed if the image is not complete.
+    std::string filepath;
+    tga_writer writer;
+    bool rle{false};
+    // The rows as they are saved, ABGR32 rows are saved as ARGB32.
+    tga_info row_info;
+    // Number of rows written.
+    int next_row{0};
+    // Encoded rows waiting to be written.
+    std::vector<uint8_t> out;
+    // The current row, converted to the format of the file.
+    std::vector<uint8_t> row;
+    tga_error error{tga_error::TGA_NO_ERROR};
+};
+
+// Checks that an image can be written row by row.
+tga_error check_scanline_target(int width, int height, tga_pixel_format format,
+                                const SaveOptions &options) {
+    if (!check_dimensions(width, height)) {
+        return tga_error::TGA_ERROR_INVALID_IMAGE_DIMENSIONS;
+    }
+    if (pixel_format_to_pixel_size(format) == -1) {
+        return tga_error::TGA_ERROR_UNSUPPORTED_PIXEL_FORMAT;
+    }
+    bool is_grayscale = format == tga_pixel_format::TGA_PIXEL_BW8 ||
+                        format == tga_pixel_format::TGA_PIXEL_BW16;
+    if (options.color_mapped && !is_grayscale) {
+        // The palette is built from the whole image.
+        return tga_error::TGA_ERROR_UNSUPPORTED_IMAGE_TYPE;
+    }
+    return tga_error::TGA_NO_ERROR;
+}
+
+ScanlineWriter::ScanlineWriter() = default;
+
+ScanlineWriter::~ScanlineWriter() { close(); }
+
+ScanlineWriter::ScanlineWriter(ScanlineWriter &&other) noexcept {
+    *this = std::move(other);
+}
+
+ScanlineWriter &ScanlineWriter::operator=(ScanlineWriter &&other) noexcept {
+    if (this != &other) {
+        close();
+        impl = std::move(other.impl);
+        img_info = other.img_info;
+        err = other.err;
+        other.img_info = tga_info{0, 0, tga_pixel_format::TGA_PIXEL_BW8};
+    }
+    return *this;
+}
+
+bool ScanlineWriter::open(std::string_view filepath, int width, int height,
+                          tga_pixel_format format,
+                          const SaveOptions &options) {
+    close();
+    err = check_scanline_target(width, height, format, options);
+    if (err != tga_error::TGA_NO_ERROR) {
+        return false;
+    }
+    impl = std::make_unique<state>();
+    std::ofstream &file = impl->file;
+    file.open(filepath.data(), std::ios::binary);
+    if (!file.good()) {
+        impl.reset();
+        err = tga_error::TGA_ERROR_FILE_CANNOT_WRITE;
+        return false;
+    }
+    impl->filepath = filepath;
+    impl->writer.write = [&file](const uint8_t *src, size_t size) {
+        return (bool)file.write((const char *)src, size);
+    };
+    img_info = tga_info{(uint16_t)width, (uint16_t)height, format};
+    return begin(options);
+}
+
+bool ScanlineWriter::open(const tga_writer &writer, int width, int height,
+                          tga_pixel_format format,
+                          const SaveOptions &options) {
+    close();
+    if (!writer.write) {
+        err = tga_error::TGA_ERROR_FILE_CANNOT_WRITE;
+        return false;
+    }
+    err = check_scanline_target(width, height, format, options);
+    if (err != tga_error::TGA_NO_ERROR) {
+        return false;
+    }
+    impl = std::make_unique<state>();
+    impl->writer = writer;
+    img_info = tga_info{(uint16_t)width, (uint16_t)height, format};
+    return begin(options);
+}
+
+bool ScanlineWriter::begin(const SaveOptions &options) {
+    state &s = *impl;
+    s.rle = options.rle;
+    s.row_info = tga_info{img_info.width, 1, img_info.pixel_format};
+    if (img_info.pixel_format == tga_pixel_format::TGA_PIXEL_ABGR32) {
+        s.row_info.pixel_format = tga_pixel_format::TGA_PIXEL_ARGB32;
+        s.row.resize(get_row_size());
+    }
+    s.out.reserve(READ_BLOCK_SIZE + (size_t)img_info.width * 5);
+
+    tga_info file_info = s.row_info;
+    file_info.height = img_info.height;
+    uint8_t header[HEADER_SIZE];
+    make_header(&file_info, s.rle, header);
+    if (!s.writer.write(header, HEADER_SIZE)) {
+        s.error = tga_error::TGA_ERROR_FILE_CANNOT_WRITE;
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool ScanlineWriter::write_row(const uint8_t *row) {
+    if (impl == nullptr) {
+        err = tga_error::TGA_ERROR_FILE_CANNOT_WRITE;
+        return false;
+    }
+    state &s = *impl;
+    if (s.error == tga_error::TGA_NO_ERROR && s.next_row >= img_info.height) {
+        s.error = tga_error::TGA_ERROR_INVALID_IMAGE_DIMENSIONS;
+    }
+    if (s.error != tga_error::TGA_NO_ERROR) {
+        err = s.error;
+        return false;
+    }
+
+    if (img_info.pixel_format != s.row_info.pixel_format) {
+        convert_pixels(s.row.data(), s.row_info.pixel_format, row,
+                       img_info.pixel_format, img_info.width);
+        row = s.row.data();
+    }
+    if (s.rle) {
+        s.error = encode_rows_rle(row, &s.row_info, get_row_size(), 0, 1,
+                                  &s.out, &s.writer);
+    } else {
+        s.out.insert(s.out.end(), row, row + get_row_size());
+        if (s.out.size() >= READ_BLOCK_SIZE) {
+            if (!s.writer.write(s.out.data(), s.out.size())) {
+                s.error = tga_error::TGA_ERROR_FILE_CANNOT_WRITE;
+            }
+            s.out.clear();
+        }
+    }
+    err = s.error;
+    if (err != tga_error::TGA_NO_ERROR) {
+        return false;
+    }
+    ++s.next_row;
+    return true;
+}
+
+bool ScanlineWriter::close() {
+    if (impl == nullptr) {
+        return err == tga_error::TGA_NO_ERROR;
     }
-    int pixel_size = pixel_format_to_pixel_size(img_info.pixel_format);
-    return data.data() + (y * img_info.width + x) * pixel_size;
+    state &s = *impl;
+    tga_error error_code = s.error;
+    if (error_code == tga_error::TGA_NO_ERROR &&
+        s.next_row < img_info.height) {
+        error_code = tga_error::TGA_ERROR_NO_DATA;
+    }
+    if (error_code == tga_error::TGA_NO_ERROR && !s.out.empty() &&
+        !s.writer.write(s.out.data(), s.out.size())) {
+        error_code = tga_error::TGA_ERROR_FILE_CANNOT_WRITE;
+    }
+    if (s.file.is_open()) {
+        s.file.close();
+        if (error_code == tga_error::TGA_NO_ERROR && s.file.fail()) {
+            error_code = tga_error::TGA_ERROR_FILE_CANNOT_WRITE;
+        }
+        if (error_code != tga_error::TGA_NO_ERROR) {
+            std::remove(s.filepath.c_str());
+        }
+    }
+    impl.reset();
+    img_info = tga_info{0, 0, tga_pixel_format::TGA_PIXEL_BW8};
+    err = error_code;
+    return err == tga_error::TGA_NO_ERROR;
 }
 
-uint8_t *Image::get_raw_data() { return data.data(); }
+int ScanlineWriter::get_next_row() const {
+    if (impl == nullptr || impl->next_row >= img_info.height) {
+        return -1;
+    }
+    return impl->next_row;
+}
+
+size_t ScanlineWriter::get_row_size() const {
+    return (size_t)img_info.width *
+           pixel_format_to_pixel_size(img_info.pixel_format);
+}
 
-std::vector<uint8_t> &Image::get_data() { return data; }
+tga_error ScanlineWriter::last_error() const { return err; }
 
-uint16_t Image::get_width() const { return img_info.width; }
+uint16_t ScanlineWriter::get_width() const { return img_info.width; }
 
-uint16_t Image::get_height() const { return img_info.height; }
+uint16_t ScanlineWriter::get_height() const { return img_info.height; }
 
-tga_pixel_format Image::get_pixel_format() const {
+tga_pixel_format ScanlineWriter::get_pixel_format() const {
     return img_info.pixel_format;
 }
 
-uint8_t Image::get_pixel_size() const {
+uint8_t ScanlineWriter::get_pixel_size() const {
     return pixel_format_to_pixel_size(img_info.pixel_format);
 }
 
-const uint8_t *Image::get_raw_data() const { return data.data(); }
+// -------------------tga::IncrementalDecoder implementation-------------------
+
+struct IncrementalDecoder::state {
+    LoadOptions options;
+    // The head of the file, before the pixels, until it is all in.
+    std::vector<uint8_t> head;
+    // The stored pixels of the row being decoded, in the format of the file,
+    // of which row_fill bytes are in.
+    std::vector<uint8_t> row;
+    size_t row_fill{0};
+    // Bytes before the pixels, known once the header is in.
+    size_t head_size{0};
+    bool has_head{false};
+    tga_header header;
+    tga_info info{0, 0, tga_pixel_format::TGA_PIXEL_BW8};
+    tga_pixel_format file_format{tga_pixel_format::TGA_PIXEL_BW8};
+    color_map map;
+    uint8_t pixel_size{0};
+    size_t src_row_size{0};
+    bool is_rle{false};
+    bool is_color_mapped{false};
+    bool b_flip_h{false};
+    bool b_flip_v{false};
+    int rows_decoded{0};
+    // The RLE packet being decoded: for a run, the pixels left and the bytes
+    // of its pixel read so far; for raw pixels, the bytes left.
+    bool is_run{false};
+    size_t run_count{0};
+    size_t run_pixel_bytes{0};
+    uint8_t run_pixel[4];
+    size_t raw_bytes{0};
+
+    // The buffers outlive the calls that fill them, so they come from the
+    // heap.
+    state() : map(nullptr) {}
+
+    size_t feed_head(const uint8_t *data, size_t size, PixelBuffer &pixels,
+                     tga_error *error_code);
+    size_t feed_raw(const uint8_t *data, size_t size, uint8_t *pixels,
+                    tga_error *error_code);
+    size_t feed_rle(const uint8_t *data, size_t size, uint8_t *pixels,
+                    tga_error *error_code);
+    tga_error decode_row(uint8_t *pixels);
+};
+
+// Takes the bytes of the head of the file, then reads it once it is all in.
+// Returns the number of bytes taken.
+size_t IncrementalDecoder::state::feed_head(const uint8_t *data, size_t size,
+                                            PixelBuffer &pixels,
+                                            tga_error *error_code) {
+    size_t needed = head_size > 0 ? head_size : HEADER_SIZE;
+    size_t count = std::min(needed - head.size(), size);
+    head.insert(head.end(), data, data + count);
+    if (head.size() < needed) {
+        return count;
+    }
+    if (head_size == 0) {
+        // Fail early on a header that can't be loaded, and find out how
+        // long the ID field and the color map are.
+        tga_header file_header;
+        parse_header(head.data(), &file_header);
+        *error_code = check_header(file_header, &info);
+        head_size = get_payload_offset(file_header);
+        if (*error_code != tga_error::TGA_NO_ERROR ||
+            head_size > HEADER_SIZE) {
+            return count;
+        }
+    }
+
+    read_buffer buffer(head.data(), head.size());
+    *error_code = load_image_head(&buffer, options, &header, &info,
+                                  &file_format, &map);
+    if (*error_code != tga_error::TGA_NO_ERROR) {
+        return count;
+    }
+    pixel_size = BITS_TO_BYTES(header.pixel_depth);
+    src_row_size = (size_t)info.width * pixel_size;
+    is_rle = IS_RLE(header);
+    is_color_mapped = IS_COLOR_MAPPED(header);
+    b_flip_h = header.image_descriptor & 0x10;
+    b_flip_v = !(header.image_descriptor & 0x20);
+    has_head = true;
+    head.clear();
+    head.shrink_to_fit();
+    row.resize(src_row_size);
+
+    // Like Image::load, the previous pixel buffer is reused if it is large
+    // enough.
+    size_t data_size = (size_t)info.width * info.height *
+                       pixel_format_to_pixel_size(info.pixel_format);
+    if (data_size > pixels.capacity()) {
+        pixels.clear();
+    }
+    pixels.resize(data_size);
+    return count;
+}
+
+// Decodes the stored row in row, which is complete.
+tga_error IncrementalDecoder::state::decode_row(uint8_t *pixels) {
+    tga_error error_code =
+        decode_rows(pixels, &info, pixel_size, file_format, is_color_mapped,
+                    &map, row.data(), rows_decoded, rows_decoded + 1,
+                    b_flip_h, b_flip_v);
+    row_fill = 0;
+    ++rows_decoded;
+    return error_code;
+}
+
+// Decodes the rows of uncompressed pixels that data completes. Whole rows
+// are decoded in place, only a partial row is copied.
+// Returns the number of bytes taken.
+size_t IncrementalDecoder::state::feed_raw(const uint8_t *data, size_t size,
+                                           uint8_t *pixels,
+                                           tga_error *error_code) {
+    size_t taken = 0;
+    if (row_fill > 0) {
+        size_t count = std::min(src_row_size - row_fill, size);
+        memcpy(row.data() + row_fill, data, count);
+        row_fill += count;
+        taken = count;
+        if (row_fill < src_row_size) {
+            return taken;
+        }
+        *error_code = decode_row(pixels);
+        if (*error_code != tga_error::TGA_NO_ERROR) {
+            return taken;
+        }
+    }
+
+    size_t row_count = std::min((size - taken) / src_row_size,
+                                (size_t)(info.height - rows_decoded));
+    if (row_count > 0) {
+        *error_code = decode_rows(pixels, &info, pixel_size, file_format,
+                                  is_color_mapped, &map, data + taken,
+                                  rows_decoded, rows_decoded + (int)row_count,
+                                  b_flip_h, b_flip_v);
+        rows_decoded += (int)row_count;
+        taken += row_count * src_row_size;
+        if (*error_code != tga_error::TGA_NO_ERROR) {
+            return taken;
+        }
+    }
+    if (rows_decoded < info.height) {
+        memcpy(row.data(), data + taken, size - taken);
+        row_fill = size - taken;
+        taken = size;
+    }
+    return taken;
+}
+
+// Expands the RLE packets of data into the stored row, and decodes each row
+// once it is complete. Packets may span rows and chunks.
+// Returns the number of bytes taken.
+size_t IncrementalDecoder::state::feed_rle(const uint8_t *data, size_t size,
+                                           uint8_t *pixels,
+                                           tga_error *error_code) {
+    const uint8_t *start = data;
+    const uint8_t *end = data + size;
+    // Counted here and recorded once per chunk, the packets are too many to
+    // record one by one.
+    TGA_STATS_ONLY(uint64_t run_packets = 0; uint64_t raw_packets = 0;)
+    while (data < end && rows_decoded < info.height) {
+        if (run_count == 0 && raw_bytes == 0) {
+            uint8_t repetition_count_field = *data++;
+            size_t packet_count = (repetition_count_field & 0x7F) + 1;
+            is_run = repetition_count_field & 0x80;
+            if (is_run) {
+                run_count = packet_count;
+                run_pixel_bytes = 0;
+            } else {
+                raw_bytes = packet_count * pixel_size;
+            }
+            TGA_STATS_ONLY(run_packets += is_run; raw_packets += !is_run;)
+            continue;
+        }
+
+        size_t row_left = src_row_size - row_fill;
+        uint8_t *dest = row.data() + row_fill;
+        if (is_run) {
+            if (run_pixel_bytes < pixel_size) {
+                size_t count = std::min((size_t)(pixel_size - run_pixel_bytes),
+                                        (size_t)(end - data));
+                memcpy(run_pixel + run_pixel_bytes, data, count);
+                run_pixel_bytes += count;
+                data += count;
+                if (run_pixel_bytes < pixel_size) {
+                    break;
+                }
+            }
+            size_t count = std::min(run_count, row_left / pixel_size);
+            uint32_t pixel = 0;
+            memcpy(&pixel, run_pixel, pixel_size);
+            switch (pixel_size) {
+                case 1:
+                    fill_pixels<1>(dest, pixel, count);
+                    break;
+                case 2:
+                    fill_pixels<2>(dest, pixel, count);
+                    break;
+                case 3:
+                    fill_pixels<3>(dest, pixel, count);
+                    break;
+                default:
+                    fill_pixels<4>(dest, pixel, count);
+                    break;
+            }
+            row_fill += count * pixel_size;
+            run_count -= count;
+        } else {
+            size_t count =
+                std::min({raw_bytes, row_left, (size_t)(end - data)});
+            memcpy(dest, data, count);
+            row_fill += count;
+            raw_bytes -= count;
+            data += count;
+        }
+        if (row_fill == src_row_size) {
+            *error_code = decode_row(pixels);
+            if (*error_code != tga_error::TGA_NO_ERROR) {
+                break;
+            }
+        }
+    }
+    TGA_STATS_ONLY(stats_add(&Stats::rle_run_packets, run_packets);
+                   stats_add(&Stats::rle_raw_packets, raw_packets);)
+    return data - start;
+}
+
+IncrementalDecoder::IncrementalDecoder(const LoadOptions &options) {
+    reset(options);
+}
+
+IncrementalDecoder::~IncrementalDecoder() = default;
+
+IncrementalDecoder::IncrementalDecoder(IncrementalDecoder &&other) noexcept
+    : impl(std::move(other.impl)), img(std::move(other.img)), err(other.err) {
+}
+
+IncrementalDecoder &IncrementalDecoder::operator=(
+    IncrementalDecoder &&other) noexcept {
+    if (this != &other) {
+        impl = std::move(other.impl);
+        img = std::move(other.img);
+        err = other.err;
+    }
+    return *this;
+}
+
+void IncrementalDecoder::reset(const LoadOptions &options) {
+    impl = std::make_unique<state>();
+    impl->options = options;
+    img.img_info = tga_info{0, 0, tga_pixel_format::TGA_PIXEL_BW8};
+    img.err = tga_error::TGA_NO_ERROR;
+    err = tga_error::TGA_NO_ERROR;
+}
+
+bool IncrementalDecoder::feed(const uint8_t *data, size_t size) {
+    if (impl == nullptr) {
+        err = tga_error::TGA_ERROR_NO_DATA;
+        return false;
+    }
+    if (err != tga_error::TGA_NO_ERROR) {
+        return false;
+    }
+    // Bytes past the last pixel are neither decoded nor counted.
+    if (is_done()) {
+        return true;
+    }
+    TGA_STATS_ONLY(size_t fed = size;)
+    state &s = *impl;
+    while (size > 0 && err == tga_error::TGA_NO_ERROR && !is_done()) {
+        size_t taken;
+        if (!s.has_head) {
+            taken = s.feed_head(data, size, img.data, &err);
+            if (s.has_head) {
+                img.img_info = s.info;
+            }
+        } else {
+            TGA_STATS_ONLY(stage_timer timer(&Stats::decode_ns);)
+            taken = s.is_rle ? s.feed_rle(data, size, img.data.data(), &err)
+                             : s.feed_raw(data, size, img.data.data(), &err);
+        }
+        data += taken;
+        size -= taken;
+    }
+    img.err = err;
+    TGA_STATS_ONLY(stats_add(&Stats::bytes_read, fed - size);)
+    // The call that decodes the last row completes the load.
+    TGA_STATS_ONLY(if (is_done()) { stats_add(&Stats::loads, 1); })
+    return err == tga_error::TGA_NO_ERROR;
+}
+
+bool IncrementalDecoder::finish() {
+    if (err == tga_error::TGA_NO_ERROR && !is_done()) {
+        err = tga_error::TGA_ERROR_FILE_CANNOT_READ;
+        img.err = err;
+    }
+    return err == tga_error::TGA_NO_ERROR;
+}
+
+bool IncrementalDecoder::has_header() const {
+    return impl != nullptr && impl->has_head;
+}
+
+bool IncrementalDecoder::is_done() const {
+    return has_header() && impl->rows_decoded == impl->info.height;
+}
+
+int IncrementalDecoder::get_rows_decoded() const {
+    return impl != nullptr ? impl->rows_decoded : 0;
+}
+
+ImageView IncrementalDecoder::get_decoded_view() {
+    int row_count = get_rows_decoded();
+    if (row_count == 0) {
+        return ImageView();
+    }
+    int first_row = impl->b_flip_v ? img.get_height() - row_count : 0;
+    return img.get_view(0, first_row, img.get_width(), row_count);
+}
+
+const Image &IncrementalDecoder::get_image() const { return img; }
+
+Image IncrementalDecoder::take_image() {
+    Image taken = std::move(img);
+    img = Image(taken.get_data().get_allocator().get_resource());
+    impl.reset();
+    return taken;
+}
+
+tga_error IncrementalDecoder::last_error() const { return err; }
+
+uint16_t IncrementalDecoder::get_width() const { return img.get_width(); }
+
+uint16_t IncrementalDecoder::get_height() const { return img.get_height(); }
+
+tga_pixel_format IncrementalDecoder::get_pixel_format() const {
+    return img.get_pixel_format();
+}
+
+// ----------------------tga::BatchLoader implementation----------------------
+
+struct BatchLoader::state {
+    BatchOptions options;
+    std::mutex mutex;
+    std::condition_variable io_ready;
+    std::condition_variable decode_ready;
+    std::condition_variable memory_ready;
+    std::condition_variable idle;
+    std::deque<std::unique_ptr<batch_job>> io_queue;
+    std::deque<std::unique_ptr<batch_job>> decode_queue;
+    // Bytes of file contents read and not decoded yet.
+    size_t in_flight{0};
+    // Jobs not delivered yet.
+    size_t pending{0};
+    bool stop{false};
+    std::vector<std::thread> threads;
+
+    void submit(std::vector<std::unique_ptr<batch_job>> &jobs);
+    void io_worker();
+    void decode_worker();
+};
+
+void BatchLoader::state::submit(std::vector<std::unique_ptr<batch_job>> &jobs) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending += jobs.size();
+        for (auto &job : jobs) {
+            // Files in memory have nothing to read.
+            if (job->data != nullptr) {
+                decode_queue.push_back(std::move(job));
+            } else {
+                io_queue.push_back(std::move(job));
+            }
+        }
+    }
+    io_ready.notify_all();
+    decode_ready.notify_all();
+}
+
+void BatchLoader::state::io_worker() {
+    for (;;) {
+        std::unique_ptr<batch_job> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            io_ready.wait(lock, [this] { return stop || !io_queue.empty(); });
+            if (io_queue.empty()) {
+                return;
+            }
+            job = std::move(io_queue.front());
+            io_queue.pop_front();
+        }
+
+        input_file file;
+        size_t size = 0;
+        job->read_failed = !file.open(job->filepath, &size);
+        if (!job->read_failed) {
+            {
+                // Wait for the decoders to catch up before reading more.
+                std::unique_lock<std::mutex> lock(mutex);
+                memory_ready.wait(lock, [this, size] {
+                    return in_flight == 0 ||
+                           in_flight + size <= options.max_in_flight_bytes;
+                });
+                in_flight += size;
+            }
+            job->contents.reset(new uint8_t[size]);
+            job->data = job->contents.get();
+            job->size = size;
+            job->read_failed = !file.read_at(job->contents.get(), size, 0);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            decode_queue.push_back(std::move(job));
+        }
+        decode_ready.notify_one();
+    }
+}
+
+void BatchLoader::state::decode_worker() {
+    for (;;) {
+        std::unique_ptr<batch_job> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            decode_ready.wait(lock,
+                              [this] { return stop || !decode_queue.empty(); });
+            if (decode_queue.empty()) {
+                return;
+            }
+            job = std::move(decode_queue.front());
+            decode_queue.pop_front();
+        }
+
+        Image image;
+        if (job->read_failed) {
+            // Loading the file directly reports why it can't be read.
+            image.load(job->filepath, options.load_options);
+        } else {
+            image.load_from_memory(job->data, job->size, options.load_options);
+        }
+        if (job->contents) {
+            job->contents.reset();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                in_flight -= job->size;
+            }
+            memory_ready.notify_all();
+        }
+
+        if (job->callback) {
+            (*job->callback)(job->index, std::move(image));
+        } else {
+            job->promise.set_value(std::move(image));
+        }
+        job.reset();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--pending == 0) {
+            idle.notify_all();
+        }
+    }
+}
+
+BatchLoader::BatchLoader(const BatchOptions &options)
+    : impl(std::make_unique<state>()) {
+    impl->options = options;
+    unsigned io_thread_count = options.io_thread_count;
+    if (io_thread_count == 0) {
+        io_thread_count = 1;
+    }
+    unsigned decode_thread_count = options.decode_thread_count;
+    if (decode_thread_count == 0) {
+        decode_thread_count = std::thread::hardware_concurrency();
+    }
+    if (decode_thread_count == 0) {
+        decode_thread_count = 1;
+    }
+    for (unsigned i = 0; i < io_thread_count; ++i) {
+        impl->threads.emplace_back([this] { impl->io_worker(); });
+    }
+    for (unsigned i = 0; i < decode_thread_count; ++i) {
+        impl->threads.emplace_back([this] { impl->decode_worker(); });
+    }
+}
+
+BatchLoader::~BatchLoader() {
+    wait();
+    {
+        std::lock_guard<std::mutex> lock(impl->mutex);
+        impl->stop = true;
+    }
+    impl->io_ready.notify_all();
+    impl->decode_ready.notify_all();
+    for (auto &thread : impl->threads) {
+        thread.join();
+    }
+}
+
+std::vector<std::future<Image>> BatchLoader::load(
+    const std::vector<std::string> &filepaths) {
+    std::vector<std::future<Image>> futures;
+    std::vector<std::unique_ptr<batch_job>> jobs;
+    futures.reserve(filepaths.size());
+    jobs.reserve(filepaths.size());
+    for (size_t i = 0; i < filepaths.size(); ++i) {
+        auto job = std::make_unique<batch_job>();
+        job->index = i;
+        job->filepath = filepaths[i];
+        futures.push_back(job->promise.get_future());
+        jobs.push_back(std::move(job));
+    }
+    impl->submit(jobs);
+    return futures;
+}
+
+void BatchLoader::load(const std::vector<std::string> &filepaths,
+                       Callback callback) {
+    auto shared = std::make_shared<const Callback>(std::move(callback));
+    std::vector<std::unique_ptr<batch_job>> jobs;
+    jobs.reserve(filepaths.size());
+    for (size_t i = 0; i < filepaths.size(); ++i) {
+        auto job = std::make_unique<batch_job>();
+        job->index = i;
+        job->filepath = filepaths[i];
+        job->callback = shared;
+        jobs.push_back(std::move(job));
+    }
+    impl->submit(jobs);
+}
+
+std::vector<std::future<Image>> BatchLoader::load(
+    const std::vector<MemoryFile> &buffers) {
+    std::vector<std::future<Image>> futures;
+    std::vector<std::unique_ptr<batch_job>> jobs;
+    futures.reserve(buffers.size());
+    jobs.reserve(buffers.size());
+    for (size_t i = 0; i < buffers.size(); ++i) {
+        auto job = std::make_unique<batch_job>();
+        job->index = i;
+        job->data = buffers[i].first;
+        job->size = buffers[i].second;
+        futures.push_back(job->promise.get_future());
+        jobs.push_back(std::move(job));
+    }
+    impl->submit(jobs);
+    return futures;
+}
+
+void BatchLoader::load(const std::vector<MemoryFile> &buffers,
+                       Callback callback) {
+    auto shared = std::make_shared<const Callback>(std::move(callback));
+    std::vector<std::unique_ptr<batch_job>> jobs;
+    jobs.reserve(buffers.size());
+    for (size_t i = 0; i < buffers.size(); ++i) {
+        auto job = std::make_unique<batch_job>();
+        job->index = i;
+        job->data = buffers[i].first;
+        job->size = buffers[i].second;
+        job->callback = shared;
+        jobs.push_back(std::move(job));
+    }
+    impl->submit(jobs);
+}
+
+void BatchLoader::wait() {
+    std::unique_lock<std::mutex> lock(impl->mutex);
+    impl->idle.wait(lock, [this] { return impl->pending == 0; });
+}
+
+// ----------------------tga::ImageCache implementation----------------------
+
+struct ImageCache::state {
+    struct entry {
+        uint64_t size;
+        int64_t mtime;
+        // Tells a load apart from a later one for the same key.
+        uint64_t id;
+        // Set once loaded, until then the callers wait for the load.
+        std::shared_ptr<const Image> image;
+        std::shared_future<std::shared_ptr<const Image>> pending;
+        size_t bytes{0};
+        std::list<const std::string *>::iterator lru_position;
+    };
+
+    size_t max_bytes;
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, entry> entries;
+    // Keys of the loaded entries, most recently used first.
+    std::list<const std::string *> lru;
+    uint64_t next_id{0};
+    ImageCacheStats stats;
+
+    void erase(std::unordered_map<std::string, entry>::iterator it);
+};
+
+void ImageCache::state::erase(
+    std::unordered_map<std::string, entry>::iterator it) {
+    if (it->second.image) {
+        lru.erase(it->second.lru_position);
+        stats.bytes -= it->second.bytes;
+    }
+    entries.erase(it);
+}
+
+ImageCache::ImageCache(size_t max_bytes) : impl(std::make_unique<state>()) {
+    impl->max_bytes = max_bytes;
+}
+
+ImageCache::~ImageCache() = default;
+
+std::shared_ptr<const Image> ImageCache::get(std::string_view filepath,
+                                             const LoadOptions &options) {
+    uint64_t size;
+    int64_t mtime;
+    if (!stat_file(filepath, &size, &mtime)) {
+        // Loading the file directly reports why it can't be read.
+        auto image = std::make_shared<Image>();
+        image->load(filepath, options);
+        std::lock_guard<std::mutex> lock(impl->mutex);
+        ++impl->stats.misses;
+        return image;
+    }
+
+    // The same file converted to different formats is cached separately.
+    std::string key(filepath);
+    key += '\0';
+    key += options.convert ? (char)('0' + (int)options.pixel_format) : '-';
+
+    std::unique_lock<std::mutex> lock(impl->mutex);
+    auto it = impl->entries.find(key);
+    if (it != impl->entries.end() && it->second.size == size &&
+        it->second.mtime == mtime) {
+        state::entry &found = it->second;
+        ++impl->stats.hits;
+        if (found.image) {
+            impl->lru.splice(impl->lru.begin(), impl->lru,
+                             found.lru_position);
+            return found.image;
+        }
+        // Another thread is loading it.
+        auto pending = found.pending;
+        lock.unlock();
+        return pending.get();
+    }
+
+    ++impl->stats.misses;
+    if (it != impl->entries.end()) {
+        // The file changed, callers waiting for the old load still get it.
+        impl->erase(it);
+    }
+    std::promise<std::shared_ptr<const Image>> promise;
+    uint64_t id = ++impl->next_id;
+    it = impl->entries.emplace(key, state::entry{}).first;
+    it->second.size = size;
+    it->second.mtime = mtime;
+    it->second.id = id;
+    it->second.pending = promise.get_future().share();
+    lock.unlock();
+
+    auto image = std::make_shared<Image>();
+    image->load(filepath, options);
+    std::shared_ptr<const Image> result = image;
+
+    lock.lock();
+    it = impl->entries.find(key);
+    if (it != impl->entries.end() && it->second.id == id) {
+        size_t bytes = image->get_data().size();
+        if (image->last_error() != tga_error::TGA_NO_ERROR ||
+            bytes > impl->max_bytes) {
+            impl->entries.erase(it);
+        } else {
+            state::entry &loaded = it->second;
+            loaded.image = result;
+            loaded.pending = {};
+            loaded.bytes = bytes;
+            impl->lru.push_front(&it->first);
+            loaded.lru_position = impl->lru.begin();
+            impl->stats.bytes += bytes;
+            while (impl->stats.bytes > impl->max_bytes) {
+                impl->erase(impl->entries.find(*impl->lru.back()));
+                ++impl->stats.evictions;
+            }
+        }
+    }
+    lock.unlock();
+    promise.set_value(result);
+    return result;
+}
+
+void ImageCache::clear() {
+    std::lock_guard<std::mutex> lock(impl->mutex);
+    for (auto it = impl->entries.begin(); it != impl->entries.end();) {
+        // Loads in progress finish on their own.
+        auto next = std::next(it);
+        if (it->second.image) {
+            impl->erase(it);
+        }
+        it = next;
+    }
+}
+
+ImageCacheStats ImageCache::get_stats() const {
+    std::lock_guard<std::mutex> lock(impl->mutex);
+    ImageCacheStats stats = impl->stats;
+    stats.entries = impl->lru.size();
+    return stats;
+}
+
+size_t ImageCache::get_max_bytes() const { return impl->max_bytes; }
+
+// ----------------------tga allocation counters----------------------
+
+AllocationCounters get_allocation_counters() {
+    AllocationCounters counters;
+    counters.allocations = allocation_count.load(std::memory_order_relaxed);
+    counters.bytes = allocation_bytes.load(std::memory_order_relaxed);
+    return counters;
+}
+
+void reset_allocation_counters() {
+    allocation_count.store(0, std::memory_order_relaxed);
+    allocation_bytes.store(0, std::memory_order_relaxed);
+}
+
+namespace detail {
+
+void count_allocation(size_t bytes) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    allocation_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    TGA_STATS_ONLY(stats_add(&Stats::allocations, 1);
+                   stats_add(&Stats::allocated_bytes, bytes);)
+}
+
+}  // namespace detail
+
+// ----------------------tga stats----------------------
+
+Stats &Stats::operator+=(const Stats &other) {
+    loads += other.loads;
+    load_ns += other.load_ns;
+    header_ns += other.header_ns;
+    color_map_ns += other.color_map_ns;
+    decode_ns += other.decode_ns;
+    read_ns += other.read_ns;
+    bytes_read += other.bytes_read;
+    saves += other.saves;
+    save_ns += other.save_ns;
+    write_ns += other.write_ns;
+    bytes_written += other.bytes_written;
+    flip_ns += other.flip_ns;
+    convert_ns += other.convert_ns;
+    rle_run_packets += other.rle_run_packets;
+    rle_raw_packets += other.rle_raw_packets;
+    palette_lookups += other.palette_lookups;
+    allocations += other.allocations;
+    allocated_bytes += other.allocated_bytes;
+    return *this;
+}
+
+StatsScope::StatsScope(Stats &stats) {
+#ifdef TGA_ENABLE_STATS
+    recorder = std::make_unique<detail::stats_recorder>();
+    recorder->stats = &stats;
+    // What was recorded so far belongs to the enclosing scope.
+    flush_thread_stats();
+    previous = active_recorder;
+    active_recorder = recorder.get();
+#else
+    (void)stats;
+#endif
+}
 
-const std::vector<uint8_t> &Image::get_data() const { return data; }
+StatsScope::~StatsScope() {
+#ifdef TGA_ENABLE_STATS
+    flush_thread_stats();
+    active_recorder = previous;
+#endif
+}
+
+bool stats_enabled() {
+#ifdef TGA_ENABLE_STATS
+    return true;
+#else
+    return false;
+#endif
+}
+
+// ----------------------tga::probe implementation----------------------
+
+tga_error probe(std::string_view filepath, tga_file_info *info,
+                bool check_footer) {
+    FILE *file = std::fopen(filepath.data(), "rb");
+    if (file == nullptr) {
+        return tga_error::TGA_ERROR_FILE_CANNOT_READ;
+    }
+    // Only a few bytes are needed, so skip the stdio buffer entirely.
+    std::setvbuf(file, nullptr, _IONBF, 0);
+
+    tga_error error_code = tga_error::TGA_NO_ERROR;
+    uint8_t header_bytes[HEADER_SIZE];
+    if (std::fread(header_bytes, 1, HEADER_SIZE, file) != HEADER_SIZE) {
+        error_code = tga_error::TGA_ERROR_FILE_CANNOT_READ;
+    } else {
+        error_code = probe_header(header_bytes, info);
+    }
+
+    if (error_code == tga_error::TGA_NO_ERROR && check_footer) {
+        uint8_t footer_bytes[FOOTER_SIZE];
+        if (std::fseek(file, 0, SEEK_END) == 0 &&
+            std::ftell(file) >= HEADER_SIZE + FOOTER_SIZE &&
+            std::fseek(file, -FOOTER_SIZE, SEEK_END) == 0 &&
+            std::fread(footer_bytes, 1, FOOTER_SIZE, file) == FOOTER_SIZE) {
+            info->has_footer = is_footer(footer_bytes);
+        }
+    }
+
+    std::fclose(file);
+    return error_code;
+}
+
+tga_error probe(const uint8_t *buffer, size_t size, tga_file_info *info,
+                bool check_footer) {
+    if (buffer == nullptr || size < HEADER_SIZE) {
+        return tga_error::TGA_ERROR_FILE_CANNOT_READ;
+    }
+    tga_error error_code = probe_header(buffer, info);
+    if (error_code == tga_error::TGA_NO_ERROR && check_footer &&
+        size >= HEADER_SIZE + FOOTER_SIZE) {
+        info->has_footer = is_footer(buffer + size - FOOTER_SIZE);
+    }
+    return error_code;
+}
+
+std::vector<tga_error> probe_batch(const std::vector<std::string> &filepaths,
+                                   std::vector<tga_file_info> *infos,
+                                   bool check_footer, unsigned thread_count) {
+    std::vector<tga_error> errors(filepaths.size());
+    infos->assign(filepaths.size(), tga_file_info{});
+
+    if (thread_count == 0) {
+        thread_count = std::thread::hardware_concurrency();
+    }
+    if (thread_count > filepaths.size()) {
+        thread_count = (unsigned)filepaths.size();
+    }
+
+    // Each worker takes the next unprobed file, so slow files don't hold up
+    // a whole slice of the list.
+    std::atomic<size_t> next{0};
+    auto worker = [&]() {
+        for (size_t i = next++; i < filepaths.size(); i = next++) {
+            errors[i] = probe(filepaths[i], &(*infos)[i], check_footer);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < thread_count; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    return errors;
+}
 }  // namespace tga
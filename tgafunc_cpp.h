@@ -1,8 +1,17 @@
 #pragma once
 
 #include <vector>
+#include <cstddef>
 #include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <string>
 #include <string_view>
+#include <type_traits>
+#include <utility>
 
 namespace tga
 {
@@ -38,7 +47,14 @@ namespace tga
         ///
         /// \brief RGB color with alpha format, 8-bit per channel.
         ///
-        TGA_PIXEL_ARGB32
+        TGA_PIXEL_ARGB32,
+        ///
+        /// \brief ARGB32 with red and blue swapped, i.e. the pixel is stored in
+        /// the memory in the order of RRRRRRRR GGGGGGGG BBBBBBBB AAAAAAAA.
+        /// TGA files never store it, it only comes from a conversion and is
+        /// saved as ARGB32.
+        ///
+        TGA_PIXEL_ABGR32
     };
 
     ///
@@ -64,20 +80,624 @@ namespace tga
         tga_pixel_format pixel_format;
     };
 
+    ///
+    /// \brief Image information read by probe(), without decoding any pixels.
+    ///
+    struct tga_file_info : tga_info
+    {
+        ///
+        /// \brief Image type field of the header, e.g. 10 for RLE true-color.
+        ///
+        uint8_t image_type{0};
+        bool is_rle{false};
+        bool is_color_mapped{false};
+        ///
+        /// \brief Origin of the stored pixels, from the image descriptor.
+        /// Image::load flips the pixels to put the origin in the upper left.
+        ///
+        bool origin_right{false};
+        bool origin_top{false};
+        uint8_t pixel_depth{0};
+        uint8_t alpha_bits{0};
+        uint16_t x_origin{0};
+        uint16_t y_origin{0};
+        uint8_t id_length{0};
+        uint8_t map_type{0};
+        uint16_t map_first_entry{0};
+        uint16_t map_length{0};
+        uint8_t map_entry_size{0};
+        ///
+        /// \brief True if the TGA 2.0 footer signature was found. Only set when
+        /// the footer check was requested.
+        ///
+        bool has_footer{false};
+    };
+
+    ///
+    /// \brief Reads the image information from the 18 bytes header, and
+    /// optionally looks for the TGA 2.0 footer. Returns the same errors as
+    /// Image::load would for the header.
+    ///
+    tga_error probe(std::string_view filepath, tga_file_info *info,
+                    bool check_footer = false);
+    tga_error probe(const uint8_t *buffer, size_t size, tga_file_info *info,
+                    bool check_footer = false);
+
+    ///
+    /// \brief Probes a list of files concurrently. infos is resized to match
+    /// filepaths, and the error of each file is returned in the same order.
+    /// A thread_count of 0 uses the number of hardware threads.
+    ///
+    std::vector<tga_error> probe_batch(
+        const std::vector<std::string> &filepaths,
+        std::vector<tga_file_info> *infos, bool check_footer = false,
+        unsigned thread_count = 0);
+
+    ///
+    /// \brief Source of TGA file bytes, used to load images from anything other
+    /// than a file path.
+    ///
+    struct tga_reader
+    {
+        ///
+        /// \brief Reads up to size bytes into dest.
+        /// Returns the number of bytes actually read, which may be less than
+        /// size. Returning 0 means the source has ended.
+        ///
+        std::function<size_t(uint8_t *dest, size_t size)> read;
+        ///
+        /// \brief Skips count bytes, returns false if failed.
+        /// Optional, when empty the bytes are read and discarded instead.
+        ///
+        std::function<bool(size_t count)> skip;
+        ///
+        /// \brief Moves to offset bytes from the start of the data, returns
+        /// false if failed. Optional, only ScanlineReader uses it, to hand out
+        /// rows in another order than the stored one.
+        ///
+        std::function<bool(uint64_t offset)> seek;
+    };
+
+    ///
+    /// \brief Destination of TGA file bytes, used to save images to anything
+    /// other than a file path.
+    ///
+    struct tga_writer
+    {
+        ///
+        /// \brief Writes size bytes from src, returns false if failed.
+        ///
+        std::function<bool(const uint8_t *src, size_t size)> write;
+    };
+
+    ///
+    /// \brief Controls how many threads an operation may use. The work is
+    /// split into bands of whole scanlines, one band per thread. Besides the
+    /// calling thread, bands run on a pool of threads that the library starts
+    /// on first use and keeps until the process exits.
+    ///
+    /// An RLE file split into bands is first indexed, to find where each
+    /// scanline starts. A file loaded by path is mapped into memory for that,
+    /// and memory is decoded in place, but a load from a tga_reader reads the
+    /// whole compressed payload into memory first.
+    ///
+    struct ExecutionPolicy
+    {
+        ///
+        /// \brief Number of threads, including the calling one. 1 runs
+        /// everything on the calling thread, 0 uses all hardware threads.
+        ///
+        unsigned thread_count{1};
+    };
+
+    ///
+    /// \brief Memory requested by the library since the last reset, from all
+    /// threads: pixel buffers from their memory resource, and scratch memory
+    /// from the heap. Allocations made by the standard library, e.g. by file
+    /// streams or threads, are not counted. Meant for benchmarks, e.g. to check
+    /// that loading into a reused Image doesn't allocate.
+    ///
+    struct AllocationCounters
+    {
+        uint64_t allocations{0};
+        uint64_t bytes{0};
+    };
+
+    AllocationCounters get_allocation_counters();
+    void reset_allocation_counters();
+
+    namespace detail
+    {
+        void count_allocation(size_t bytes);
+        struct stats_recorder;
+    }
+
+    ///
+    /// \brief What loads, saves, flips and conversions spent, recorded while
+    /// a StatsScope is open. Times are in nanoseconds and nest: header_ns,
+    /// color_map_ns and decode_ns are parts of load_ns, read_ns is spread
+    /// over them, and write_ns is part of save_ns. RLE packets and palette
+    /// lookups are counted while decoding. Allocations are those of
+    /// AllocationCounters.
+    ///
+    /// Only recorded if the library is built with TGA_ENABLE_STATS, otherwise
+    /// nothing is measured and the stats stay at zero.
+    ///
+    struct Stats
+    {
+        uint64_t loads{0};
+        uint64_t load_ns{0};
+        uint64_t header_ns{0};
+        uint64_t color_map_ns{0};
+        uint64_t decode_ns{0};
+        uint64_t read_ns{0};
+        uint64_t bytes_read{0};
+        uint64_t saves{0};
+        uint64_t save_ns{0};
+        uint64_t write_ns{0};
+        uint64_t bytes_written{0};
+        uint64_t flip_ns{0};
+        uint64_t convert_ns{0};
+        uint64_t rle_run_packets{0};
+        uint64_t rle_raw_packets{0};
+        uint64_t palette_lookups{0};
+        uint64_t allocations{0};
+        uint64_t allocated_bytes{0};
+
+        Stats &operator+=(const Stats &other);
+    };
+
+    ///
+    /// \brief Records into stats what the calling thread does until the scope
+    /// ends, including the threads the calls split their work onto. Each
+    /// thread counts on its own and adds its counts to stats when its part is
+    /// done, so stats are complete once the scope ends. Scopes may nest, the
+    /// innermost one records. Give each thread its own Stats and add them up
+    /// with += to aggregate.
+    ///
+    class StatsScope
+    {
+    public:
+        explicit StatsScope(Stats &stats);
+        ~StatsScope();
+
+        StatsScope(const StatsScope &) = delete;
+        StatsScope &operator=(const StatsScope &) = delete;
+
+    private:
+        std::unique_ptr<detail::stats_recorder> recorder;
+        detail::stats_recorder *previous{nullptr};
+    };
+
+    ///
+    /// \brief Tells whether the library records Stats, i.e. whether it is
+    /// built with TGA_ENABLE_STATS.
+    ///
+    bool stats_enabled();
+
+
+    ///
+    /// \brief Allocator of the pixel buffers. The memory comes from a
+    /// std::pmr::memory_resource, the default one unless another is given,
+    /// and new elements are left uninitialized instead of being zero-filled.
+    /// The resource follows the buffer when images are assigned or swapped.
+    ///
+    template <typename T>
+    class PixelAllocator
+    {
+    public:
+        using value_type = T;
+        using propagate_on_container_copy_assignment = std::true_type;
+        using propagate_on_container_move_assignment = std::true_type;
+        using propagate_on_container_swap = std::true_type;
+
+        PixelAllocator() noexcept
+            : resource(std::pmr::get_default_resource()) {}
+        PixelAllocator(std::pmr::memory_resource *r) noexcept : resource(r) {}
+        template <typename U>
+        PixelAllocator(const PixelAllocator<U> &other) noexcept
+            : resource(other.get_resource()) {}
+
+        T *allocate(size_t count)
+        {
+            detail::count_allocation(count * sizeof(T));
+            return static_cast<T *>(
+                resource->allocate(count * sizeof(T), alignof(T)));
+        }
+
+        void deallocate(T *ptr, size_t count) noexcept
+        {
+            resource->deallocate(ptr, count * sizeof(T), alignof(T));
+        }
+
+        template <typename U>
+        void construct(U *ptr) noexcept(
+            std::is_nothrow_default_constructible<U>::value)
+        {
+            ::new ((void *)ptr) U;
+        }
+
+        template <typename U, typename... Args>
+        void construct(U *ptr, Args &&...args)
+        {
+            ::new ((void *)ptr) U(std::forward<Args>(args)...);
+        }
+
+        std::pmr::memory_resource *get_resource() const noexcept
+        {
+            return resource;
+        }
+
+    private:
+        std::pmr::memory_resource *resource;
+    };
+
+    template <typename T, typename U>
+    bool operator==(const PixelAllocator<T> &a,
+                    const PixelAllocator<U> &b) noexcept
+    {
+        return a.get_resource()->is_equal(*b.get_resource());
+    }
+
+    template <typename T, typename U>
+    bool operator!=(const PixelAllocator<T> &a,
+                    const PixelAllocator<U> &b) noexcept
+    {
+        return !(a == b);
+    }
+
+    using PixelBuffer = std::vector<uint8_t, PixelAllocator<uint8_t>>;
+
+    ///
+    /// \brief Options for Image::load.
+    ///
+    struct LoadOptions
+    {
+        ///
+        /// \brief Convert the pixels to pixel_format while decoding, instead
+        /// of keeping the format of the file. Each scanline is converted as it
+        /// is decoded, there is no second pass over the image.
+        ///
+        bool convert{false};
+        tga_pixel_format pixel_format{tga_pixel_format::TGA_PIXEL_ARGB32};
+    };
+
+    ///
+    /// \brief Options for Image::save.
+    ///
+    struct SaveOptions
+    {
+        ///
+        /// \brief Compress the pixels with run-length encoding, i.e. write
+        /// image type 10 (true-color) or 11 (grayscale). Packets never cross
+        /// scanlines.
+        ///
+        bool rle{false};
+        ///
+        /// \brief Write a color mapped image, i.e. image type 1 (or 9 with
+        /// rle) with 8-bit indices. Images with no more than 256 colors are
+        /// stored exactly, others are reduced to 256 colors with median cut.
+        /// Ignored for grayscale images, which are written as grayscale.
+        ///
+        bool color_mapped{false};
+    };
+
+    ///
+    /// \brief Where each stored row of an RLE file starts. Given one,
+    /// Image::load_region fills it on the first call, and later calls for the
+    /// same file seek straight to their first row instead of scanning all the
+    /// packets before it. Given another file, it is filled again.
+    ///
+    class ScanlineIndex
+    {
+    public:
+        bool empty() const { return rows.empty(); }
+        void clear()
+        {
+            rows.clear();
+            key = 0;
+        }
+
+    private:
+        friend class Image;
+
+        // Offset from the start of the file of the packet each row starts
+        // in, shifted left by 8 bits, ORed with the number of pixels of that
+        // packet that belong to the rows before. A last entry holds the end
+        // of the payload.
+        std::vector<uint64_t> rows;
+        // Hash of the header and of the size of the file the index was made
+        // for. Another file, or the same one once rewritten, is indexed
+        // again.
+        uint64_t key{0};
+    };
+
+    ///
+    /// \brief Non-owning view of width by height pixels of one format, whose
+    /// rows are row_stride bytes apart. Views of an Image, of a rectangle of
+    /// one, or of external memory are all alike, and making one never copies
+    /// nor allocates. The pixels must outlive the view.
+    ///
+    class ImageView
+    {
+    public:
+        ImageView() = default;
+        ///
+        /// \brief Views the pixels at data. A row_stride of 0 means packed
+        /// rows, a negative one rows stored bottom-up. The view is empty if
+        /// the dimensions or the format are invalid.
+        ///
+        ImageView(uint8_t *data, int width, int height,
+                  tga_pixel_format format, ptrdiff_t row_stride = 0);
+
+        ///
+        /// \brief Views the width by height pixels whose upper left corner is
+        /// at (x, y), which must lie inside the view, otherwise the view is
+        /// empty.
+        ///
+        ImageView subview(int x, int y, int width, int height) const;
+
+        ///
+        /// \brief Saves the viewed pixels like Image::save does. Images are
+        /// not packed first, except when saved color mapped.
+        ///
+        tga_error save(std::string_view filepath,
+                       const SaveOptions &options = SaveOptions{},
+                       const ExecutionPolicy &policy = ExecutionPolicy{}) const;
+        tga_error save(const tga_writer &writer,
+                       const SaveOptions &options = SaveOptions{},
+                       const ExecutionPolicy &policy = ExecutionPolicy{}) const;
+        tga_error save_to_memory(
+            std::vector<uint8_t> &buffer,
+            const SaveOptions &options = SaveOptions{},
+            const ExecutionPolicy &policy = ExecutionPolicy{}) const;
+
+        ///
+        /// \brief Flip the viewed pixels in place.
+        ///
+        void flip_h(const ExecutionPolicy &policy = ExecutionPolicy{}) const;
+        void flip_v(const ExecutionPolicy &policy = ExecutionPolicy{}) const;
+
+        ///
+        /// \brief Gets the pixel at (x, y), with the origin in the upper left
+        /// corner. Unlike Image::get_pixel, the coordinates are not checked.
+        ///
+        uint8_t *get_pixel(int x, int y) const
+        {
+            return data + y * row_stride + (ptrdiff_t)x * pixel_size;
+        }
+        uint8_t *get_row(int y) const { return data + y * row_stride; }
+        uint8_t *get_data() const { return data; }
+        ptrdiff_t get_row_stride() const { return row_stride; }
+        bool empty() const { return data == nullptr; }
+
+        uint16_t get_width() const { return img_info.width; }
+        uint16_t get_height() const { return img_info.height; }
+        tga_pixel_format get_pixel_format() const
+        {
+            return img_info.pixel_format;
+        }
+        uint8_t get_pixel_size() const { return pixel_size; }
+
+    private:
+        uint8_t *data{nullptr};
+        ptrdiff_t row_stride{0};
+        tga_info img_info{0, 0, tga_pixel_format::TGA_PIXEL_BW8};
+        uint8_t pixel_size{0};
+    };
+
+    ///
+    /// \brief Copies the pixels of src into dest, which must have the same
+    /// dimensions, converting them as Image::convert does if the formats
+    /// differ. The views must not overlap.
+    ///
+    tga_error convert(const ImageView &dest, const ImageView &src,
+                      const ExecutionPolicy &policy = ExecutionPolicy{});
+    ///
+    /// \brief Copies the width by height pixels of src whose upper left
+    /// corner is at (src_x, src_y) to (dest_x, dest_y) in dest, converting
+    /// them if the formats differ. The rectangle must lie inside both views,
+    /// which must not overlap.
+    ///
+    tga_error copy_rect(const ImageView &dest, int dest_x, int dest_y,
+                        const ImageView &src, int src_x, int src_y, int width,
+                        int height);
+    ///
+    /// \brief Copies all of src with its upper left corner at (x, y) in
+    /// dest, converting the pixels if the formats differ. Whatever falls
+    /// outside dest is clipped, so x and y may be negative.
+    ///
+    tga_error blit(const ImageView &dest, int x, int y, const ImageView &src);
+
+    class Image;
+
+    ///
+    /// \brief Filters of the resampler. Each is stretched over the source
+    /// pixels a destination pixel covers when shrinking.
+    ///
+    enum class ResampleFilter : uint8_t
+    {
+        ///
+        /// \brief Average of the source pixels a destination pixel covers,
+        /// weighted by how much of each it covers.
+        ///
+        BOX,
+        ///
+        /// \brief Linear interpolation, i.e. bilinear.
+        ///
+        TRIANGLE,
+        ///
+        /// \brief Catmull-Rom cubic, i.e. bicubic.
+        ///
+        CUBIC,
+        ///
+        /// \brief Lanczos windowed sinc with 3 lobes. The sharpest, at the
+        /// cost of some ringing.
+        ///
+        LANCZOS3
+    };
+
+    ///
+    /// \brief Options for generate_mipmaps.
+    ///
+    struct MipmapOptions
+    {
+        ResampleFilter filter{ResampleFilter::BOX};
+        ///
+        /// \brief Filter in linear light, taking the color channels as sRGB.
+        /// Alpha is always linear.
+        ///
+        bool gamma_correct{false};
+        ///
+        /// \brief Weight the colors by alpha, so that the colors of
+        /// transparent pixels don't bleed into the visible ones. Only
+        /// applies to formats with alpha.
+        ///
+        bool alpha_weighted{false};
+        ///
+        /// \brief Most levels to make, 0 to go down to 1x1.
+        ///
+        int max_levels{0};
+    };
+
+    ///
+    /// \brief Makes the mip chain of image into levels, replacing their
+    /// content and reusing their pixel buffers. Each level is half the size
+    /// of the one before, rounded down to no less than 1, in the format of
+    /// the image; levels[0] is the first one below image. Sizes need not be
+    /// powers of two.
+    ///
+    /// The chain is made in one pass: the rows of each level are made from
+    /// the rows of the level before as soon as they are, at full precision.
+    /// With more than one thread each takes a band of rows of every level.
+    /// The result is the same for any number of threads.
+    ///
+    /// image must not be a view of one of the levels.
+    ///
+    tga_error generate_mipmaps(
+        const ImageView &image, std::vector<Image> &levels,
+        const MipmapOptions &options = MipmapOptions{},
+        const ExecutionPolicy &policy = ExecutionPolicy{});
+
+    ///
+    /// \brief Resamples the pixels of src to the size of dest, larger or
+    /// smaller, with separable horizontal and vertical passes. Both must have
+    /// the same pixel format and must not overlap. With more than one thread
+    /// each takes a band of the rows of dest, and the result is the same for
+    /// any number of threads.
+    ///
+    tga_error resize(const ImageView &dest, const ImageView &src,
+                     ResampleFilter filter = ResampleFilter::CUBIC,
+                     const ExecutionPolicy &policy = ExecutionPolicy{});
+
+    ///
+    /// \brief Gets a width by height copy of image, resampled with filter.
+    /// The pixels come from the memory resource of image. On failure the
+    /// copy is empty and its last_error() tells why.
+    ///
+    Image resize(const Image &image, int width, int height,
+                 ResampleFilter filter = ResampleFilter::CUBIC,
+                 const ExecutionPolicy &policy = ExecutionPolicy{});
+
     class Image
     {
     public:
+        Image() = default;
+        ///
+        /// \brief Creates an empty image whose pixels are allocated from
+        /// resource, e.g. a std::pmr::unsynchronized_pool_resource shared by
+        /// the images of one thread.
+        ///
+        explicit Image(std::pmr::memory_resource *resource);
         Image(int width, int height, tga_pixel_format format);
         Image(std::string_view filepath);
-        bool load(std::string_view filepath);
-        bool save(std::string_view filename);
+        ///
+        /// \brief Loads the image, replacing the current one. The pixel buffer
+        /// is reused if it is large enough, in which case nothing is allocated
+        /// for the pixels and nothing is zero-filled.
+        ///
+        bool load(std::string_view filepath,
+                  const LoadOptions &options = LoadOptions{},
+                  const ExecutionPolicy &policy = ExecutionPolicy{});
+        bool load(const tga_reader &reader,
+                  const LoadOptions &options = LoadOptions{},
+                  const ExecutionPolicy &policy = ExecutionPolicy{});
+        bool load_from_memory(
+            const uint8_t *buffer, size_t size,
+            const LoadOptions &options = LoadOptions{},
+            const ExecutionPolicy &policy = ExecutionPolicy{});
+        ///
+        /// \brief Loads only the width by height pixels whose upper left
+        /// corner is at (x, y), which must lie inside the image. Uncompressed
+        /// files are read for the rows of the region only, RLE files up to
+        /// its last row, or from its first row given a filled index.
+        ///
+        bool load_region(std::string_view filepath, int x, int y, int width,
+                         int height,
+                         const LoadOptions &options = LoadOptions{},
+                         ScanlineIndex *index = nullptr);
+        bool load_region_from_memory(
+            const uint8_t *buffer, size_t size, int x, int y, int width,
+            int height, const LoadOptions &options = LoadOptions{},
+            ScanlineIndex *index = nullptr);
+        ///
+        /// \brief Loads the image resized to width by height, like load()
+        /// then resize() but without ever holding the image at full size:
+        /// the rows are decoded one at a time, in the order the file stores
+        /// them, into a window of the few rows the filter spans. Files stored
+        /// bottom up are filtered in that order, which may round some
+        /// channels one step apart from resize().
+        ///
+        bool load_resized(std::string_view filepath, int width, int height,
+                          ResampleFilter filter = ResampleFilter::CUBIC,
+                          const LoadOptions &options = LoadOptions{});
+        bool load_resized_from_memory(
+            const uint8_t *buffer, size_t size, int width, int height,
+            ResampleFilter filter = ResampleFilter::CUBIC,
+            const LoadOptions &options = LoadOptions{});
+        bool save(std::string_view filename,
+                  const SaveOptions &options = SaveOptions{},
+                  const ExecutionPolicy &policy = ExecutionPolicy{});
+        bool save(const tga_writer &writer,
+                  const SaveOptions &options = SaveOptions{},
+                  const ExecutionPolicy &policy = ExecutionPolicy{});
+        ///
+        /// \brief Saves the whole file into buffer, replacing its content.
+        ///
+        bool save_to_memory(std::vector<uint8_t> &buffer,
+                            const SaveOptions &options = SaveOptions{},
+                            const ExecutionPolicy &policy = ExecutionPolicy{});
 
-        void flip_h();
-        void flip_v();
+        ///
+        /// \brief Converts the pixels to another format. Colors become gray
+        /// with the Rec. 601 luma weights, gray is copied to every channel,
+        /// 5-bit channels are scaled to the full 8-bit range and alpha is
+        /// opaque unless the source has alpha.
+        /// Returns false if the image is empty or the format is unknown.
+        ///
+        bool convert(tga_pixel_format format,
+                     const ExecutionPolicy &policy = ExecutionPolicy{});
+
+        void flip_h(const ExecutionPolicy &policy = ExecutionPolicy{});
+        void flip_v(const ExecutionPolicy &policy = ExecutionPolicy{});
 
         uint8_t *get_pixel(int x, int y);
         uint8_t *get_raw_data();
-        std::vector<uint8_t> &get_data();
+        ///
+        /// \brief The pixel buffer. It is a PixelBuffer, not a
+        /// std::vector<uint8_t> as in earlier versions: code that binds the
+        /// result to a std::vector<uint8_t>& must use PixelBuffer& or auto&
+        /// instead. Copy it into a std::vector<uint8_t> with
+        /// assign(begin(), end()) where one is needed.
+        ///
+        PixelBuffer &get_data();
+        ///
+        /// \brief Views the pixels of the image, or those of the width by
+        /// height rectangle at (x, y), e.g. to crop or blit without copying.
+        /// The view is invalidated when the image is loaded or converted.
+        ///
+        ImageView get_view();
+        ImageView get_view(int x, int y, int width, int height);
 
         tga_error last_error() const;
         uint16_t get_width() const;
@@ -85,11 +705,648 @@ namespace tga
         tga_pixel_format get_pixel_format() const;
         uint8_t get_pixel_size() const;
         const uint8_t *get_raw_data() const;
-        const std::vector<uint8_t> &get_data() const;
+        const PixelBuffer &get_data() const;
+
+    private:
+        friend tga_error generate_mipmaps(const ImageView &image,
+                                          std::vector<Image> &levels,
+                                          const MipmapOptions &options,
+                                          const ExecutionPolicy &policy);
+        friend class IncrementalDecoder;
+        friend Image resize(const Image &image, int width, int height,
+                            ResampleFilter filter,
+                            const ExecutionPolicy &policy);
+
+        PixelBuffer data;
+        tga_info img_info{0, 0, tga_pixel_format::TGA_PIXEL_BW8};
+        tga_error err{tga_error::TGA_NO_ERROR};
+    };
+
+    ///
+    /// \brief Pixel types of TypedImage, laid out like the pixels of the
+    /// matching tga_pixel_format in memory. They only hold bytes, so a pixel
+    /// at any address can be accessed through them.
+    ///
+    struct Gray8
+    {
+        uint8_t v;
+    };
+
+    struct Gray16
+    {
+        uint8_t lo, hi;
+
+        uint16_t value() const { return (uint16_t)(lo | hi << 8); }
+        void set_value(uint16_t value)
+        {
+            lo = (uint8_t)value;
+            hi = (uint8_t)(value >> 8);
+        }
+    };
+
+    struct Rgb555
+    {
+        uint8_t lo, hi;
+
+        uint16_t value() const { return (uint16_t)(lo | hi << 8); }
+        void set_value(uint16_t value)
+        {
+            lo = (uint8_t)value;
+            hi = (uint8_t)(value >> 8);
+        }
+        ///
+        /// \brief The 5-bit channels.
+        ///
+        uint8_t r() const { return (value() >> 10) & 0x1F; }
+        uint8_t g() const { return (value() >> 5) & 0x1F; }
+        uint8_t b() const { return value() & 0x1F; }
+        void set_rgb(uint8_t r, uint8_t g, uint8_t b)
+        {
+            set_value((uint16_t)((r & 0x1F) << 10 | (g & 0x1F) << 5 |
+                                 (b & 0x1F)));
+        }
+    };
+
+    struct Bgr24
+    {
+        uint8_t b, g, r;
+    };
+
+    struct Bgra32
+    {
+        uint8_t b, g, r, a;
+    };
+
+    struct Rgba32
+    {
+        uint8_t r, g, b, a;
+    };
+
+    ///
+    /// \brief The pixel type of a tga_pixel_format.
+    ///
+    template <tga_pixel_format Format>
+    struct pixel_type_of;
+
+    template <>
+    struct pixel_type_of<tga_pixel_format::TGA_PIXEL_BW8>
+    {
+        using type = Gray8;
+    };
+
+    template <>
+    struct pixel_type_of<tga_pixel_format::TGA_PIXEL_BW16>
+    {
+        using type = Gray16;
+    };
+
+    template <>
+    struct pixel_type_of<tga_pixel_format::TGA_PIXEL_RGB555>
+    {
+        using type = Rgb555;
+    };
+
+    template <>
+    struct pixel_type_of<tga_pixel_format::TGA_PIXEL_RGB24>
+    {
+        using type = Bgr24;
+    };
+
+    template <>
+    struct pixel_type_of<tga_pixel_format::TGA_PIXEL_ARGB32>
+    {
+        using type = Bgra32;
+    };
+
+    template <>
+    struct pixel_type_of<tga_pixel_format::TGA_PIXEL_ABGR32>
+    {
+        using type = Rgba32;
+    };
+
+    ///
+    /// \brief Typed access to the pixels of an Image or an ImageView of one
+    /// format, known at compile time. Like the view, it doesn't own the
+    /// pixels. The pixel size is a constant and the accessors don't check
+    /// anything, so loops over the pixels come down to pointer arithmetic.
+    ///
+    /// The conversion is checked: it is empty if the format of the image
+    /// isn't Format.
+    ///
+    /// \code
+    /// tga::TypedImage<tga::tga_pixel_format::TGA_PIXEL_ARGB32> pixels(img);
+    /// for (auto row : pixels) {
+    ///     for (tga::Bgra32 &pixel : row) {
+    ///         pixel.a = 255;
+    ///     }
+    /// }
+    /// \endcode
+    ///
+    template <tga_pixel_format Format>
+    class TypedImage
+    {
+    public:
+        using pixel_type = typename pixel_type_of<Format>::type;
+        static constexpr tga_pixel_format pixel_format = Format;
+        static constexpr int pixel_size = (int)sizeof(pixel_type);
+
+        ///
+        /// \brief The pixels of a row, from left to right.
+        ///
+        class row_range
+        {
+        public:
+            row_range(pixel_type *first, int width)
+                : first(first), last(first + width)
+            {
+            }
+
+            pixel_type *begin() const { return first; }
+            pixel_type *end() const { return last; }
+            pixel_type &operator[](int x) const { return first[x]; }
+            int size() const { return (int)(last - first); }
+
+        private:
+            pixel_type *first;
+            pixel_type *last;
+        };
+
+        ///
+        /// \brief Walks the rows from the top down.
+        ///
+        class row_iterator
+        {
+        public:
+            row_iterator(const ImageView *view, int y) : view(view), y(y) {}
+
+            row_range operator*() const
+            {
+                return row_range(
+                    reinterpret_cast<pixel_type *>(view->get_row(y)),
+                    view->get_width());
+            }
+            row_iterator &operator++()
+            {
+                ++y;
+                return *this;
+            }
+            bool operator==(const row_iterator &other) const
+            {
+                return y == other.y;
+            }
+            bool operator!=(const row_iterator &other) const
+            {
+                return y != other.y;
+            }
+
+        private:
+            const ImageView *view;
+            int y;
+        };
+
+        TypedImage() = default;
+        explicit TypedImage(const ImageView &view)
+        {
+            if (view.get_pixel_format() == Format)
+            {
+                this->view = view;
+            }
+        }
+        explicit TypedImage(Image &image) : TypedImage(image.get_view()) {}
+
+        bool empty() const { return view.empty(); }
+
+        ///
+        /// \brief Gets the pixel at (x, y), with the origin in the upper left
+        /// corner. The coordinates are not checked.
+        ///
+        pixel_type &operator()(int x, int y) const { return row(y)[x]; }
+        pixel_type *row(int y) const
+        {
+            return reinterpret_cast<pixel_type *>(view.get_row(y));
+        }
+        row_iterator begin() const { return row_iterator(&view, 0); }
+        row_iterator end() const
+        {
+            return row_iterator(&view, view.get_height());
+        }
+
+        int get_width() const { return view.get_width(); }
+        int get_height() const { return view.get_height(); }
+        ///
+        /// \brief The untyped view, e.g. to save, blit or convert the pixels.
+        ///
+        const ImageView &get_view() const { return view; }
+
+    private:
+        ImageView view;
+    };
+
+    ///
+    /// \brief Read-only view of an uncompressed TGA file mapped into memory.
+    ///
+    /// Only uncompressed true-color and grayscale images are supported, the
+    /// pixel payload is exposed in place without being copied. Instead of
+    /// flipping, the view reports the strides needed to walk the pixels from
+    /// the upper left corner, so get_pixel(x, y) uses the same coordinates as
+    /// Image::get_pixel(x, y) of the same file.
+    ///
+    class MappedImage
+    {
+    public:
+        MappedImage() = default;
+        MappedImage(std::string_view filepath);
+        ~MappedImage();
+
+        MappedImage(const MappedImage &) = delete;
+        MappedImage &operator=(const MappedImage &) = delete;
+        MappedImage(MappedImage &&other) noexcept;
+        MappedImage &operator=(MappedImage &&other) noexcept;
+
+        bool open(std::string_view filepath);
+        void close();
+
+        ///
+        /// \brief Gets the pixel at (x, y), with the origin in the upper left
+        /// corner. Coordinates are clamped like Image::get_pixel.
+        ///
+        const uint8_t *get_pixel(int x, int y) const;
+        ///
+        /// \brief Gets the first pixel of row y, counted from the top.
+        /// Following pixels of the row are get_pixel_stride() bytes apart.
+        ///
+        const uint8_t *get_row(int y) const;
+        ///
+        /// \brief Gets the pixel payload in the order it is stored in the file.
+        ///
+        const uint8_t *get_raw_data() const;
+        size_t get_data_size() const;
+
+        ///
+        /// \brief Byte distance between two vertically adjacent pixels, going
+        /// down. Negative when the file stores rows bottom-up.
+        ///
+        ptrdiff_t get_row_stride() const;
+        ///
+        /// \brief Byte distance between two horizontally adjacent pixels,
+        /// going right. Negative when the file stores rows right-to-left.
+        ///
+        ptrdiff_t get_pixel_stride() const;
+
+        tga_error last_error() const;
+        uint16_t get_width() const;
+        uint16_t get_height() const;
+        tga_pixel_format get_pixel_format() const;
+        uint8_t get_pixel_size() const;
+
+    private:
+        const uint8_t *mapping{nullptr};
+        size_t mapping_size{0};
+        const uint8_t *payload{nullptr};
+        const uint8_t *origin{nullptr};
+        ptrdiff_t row_stride{0};
+        ptrdiff_t pixel_stride{0};
+        tga_info img_info{0, 0, tga_pixel_format::TGA_PIXEL_BW8};
+        tga_error err{tga_error::TGA_NO_ERROR};
+    };
+
+    ///
+    /// \brief Order in which ScanlineReader hands out the rows.
+    ///
+    enum class ScanlineOrder : uint8_t
+    {
+        ///
+        /// \brief From the top row down, like Image stores them.
+        ///
+        TOP_DOWN,
+        ///
+        /// \brief In the order the file stores them, which needs no seeking.
+        ///
+        STORED
+    };
+
+    ///
+    /// \brief Decodes an image one row at a time, so that only a block of the
+    /// file and a few rows are held in memory whatever the image size.
+    ///
+    /// Rows always run left to right and are decoded, color map expanded and
+    /// converted like Image::load does. Handing rows out top-down from a file
+    /// that stores them bottom-up needs to seek: file paths and memory always
+    /// can, a tga_reader needs its seek callback. RLE files are then indexed
+    /// with one pass over the packet headers first.
+    ///
+    class ScanlineReader
+    {
+    public:
+        ScanlineReader();
+        ScanlineReader(std::string_view filepath,
+                       const LoadOptions &options = LoadOptions{},
+                       ScanlineOrder order = ScanlineOrder::TOP_DOWN);
+        ~ScanlineReader();
+
+        ScanlineReader(const ScanlineReader &) = delete;
+        ScanlineReader &operator=(const ScanlineReader &) = delete;
+        ScanlineReader(ScanlineReader &&other) noexcept;
+        ScanlineReader &operator=(ScanlineReader &&other) noexcept;
+
+        bool open(std::string_view filepath,
+                  const LoadOptions &options = LoadOptions{},
+                  ScanlineOrder order = ScanlineOrder::TOP_DOWN);
+        ///
+        /// \brief Reads from reader, which must outlive the ScanlineReader.
+        ///
+        bool open(const tga_reader &reader,
+                  const LoadOptions &options = LoadOptions{},
+                  ScanlineOrder order = ScanlineOrder::TOP_DOWN);
+        ///
+        /// \brief Reads from buffer in place, which must outlive the
+        /// ScanlineReader.
+        ///
+        bool open_from_memory(const uint8_t *buffer, size_t size,
+                              const LoadOptions &options = LoadOptions{},
+                              ScanlineOrder order = ScanlineOrder::TOP_DOWN);
+        void close();
+
+        ///
+        /// \brief Decodes the next row into dest, which must hold
+        /// get_row_size() bytes. Returns false once all rows are read or if
+        /// the file is broken.
+        ///
+        bool read_row(uint8_t *dest);
+        ///
+        /// \brief Gets the y of the row the next read_row() decodes, counted
+        /// from the top like Image::get_pixel, or -1 if there is none left.
+        ///
+        int get_next_row() const;
+        size_t get_row_size() const;
+
+        tga_error last_error() const;
+        uint16_t get_width() const;
+        uint16_t get_height() const;
+        tga_pixel_format get_pixel_format() const;
+        uint8_t get_pixel_size() const;
+
+    private:
+        struct state;
+
+        bool begin(const LoadOptions &options, ScanlineOrder order);
+
+        std::unique_ptr<state> impl;
+        tga_info img_info{0, 0, tga_pixel_format::TGA_PIXEL_BW8};
+        tga_error err{tga_error::TGA_NO_ERROR};
+    };
+
+    ///
+    /// \brief Encodes an image one row at a time, from the top row down,
+    /// writing the file as it goes.
+    ///
+    /// SaveOptions::rle is supported, color_mapped is not, since the palette
+    /// depends on the whole image.
+    ///
+    class ScanlineWriter
+    {
+    public:
+        ScanlineWriter();
+        ~ScanlineWriter();
+
+        ScanlineWriter(const ScanlineWriter &) = delete;
+        ScanlineWriter &operator=(const ScanlineWriter &) = delete;
+        ScanlineWriter(ScanlineWriter &&other) noexcept;
+        ScanlineWriter &operator=(ScanlineWriter &&other) noexcept;
+
+        bool open(std::string_view filepath, int width, int height,
+                  tga_pixel_format format,
+                  const SaveOptions &options = SaveOptions{});
+        bool open(const tga_writer &writer, int width, int height,
+                  tga_pixel_format format,
+                  const SaveOptions &options = SaveOptions{});
+        ///
+        /// \brief Appends the next row, get_row_size() bytes from row.
+        ///
+        bool write_row(const uint8_t *row);
+        ///
+        /// \brief Flushes the rows still buffered. Returns false if not all
+        /// rows were written or if writing failed, in which case a file opened
+        /// by path is removed.
+        ///
+        bool close();
+
+        int get_next_row() const;
+        size_t get_row_size() const;
+
+        tga_error last_error() const;
+        uint16_t get_width() const;
+        uint16_t get_height() const;
+        tga_pixel_format get_pixel_format() const;
+        uint8_t get_pixel_size() const;
+
+    private:
+        struct state;
+
+        bool begin(const SaveOptions &options);
+
+        std::unique_ptr<state> impl;
+        tga_info img_info{0, 0, tga_pixel_format::TGA_PIXEL_BW8};
+        tga_error err{tga_error::TGA_NO_ERROR};
+    };
+
+    ///
+    /// \brief Decodes a file pushed to it in chunks, e.g. as it comes from
+    /// the network, instead of pulling it from a reader. Chunks may end
+    /// anywhere, in the middle of the header, of an RLE packet or of a pixel.
+    /// Each row can be used as soon as it is decoded, while the rest of the
+    /// file is still on its way.
+    ///
+    /// Only the bytes of a partial row or of the head of the file are kept
+    /// across calls, the rest is decoded straight from the chunks.
+    ///
+    class IncrementalDecoder
+    {
+    public:
+        explicit IncrementalDecoder(const LoadOptions &options = LoadOptions{});
+        ~IncrementalDecoder();
+
+        IncrementalDecoder(const IncrementalDecoder &) = delete;
+        IncrementalDecoder &operator=(const IncrementalDecoder &) = delete;
+        IncrementalDecoder(IncrementalDecoder &&other) noexcept;
+        IncrementalDecoder &operator=(IncrementalDecoder &&other) noexcept;
+
+        ///
+        /// \brief Starts over with a new file. The pixel buffer of the image
+        /// is reused if it is large enough.
+        ///
+        void reset(const LoadOptions &options = LoadOptions{});
+        ///
+        /// \brief Decodes the next size bytes of the file, as far as they go.
+        /// Returns false if the file is broken. Bytes past the last pixel,
+        /// e.g. the footer, are ignored.
+        ///
+        bool feed(const uint8_t *data, size_t size);
+        ///
+        /// \brief Tells the decoder that the file has ended. Returns false,
+        /// with TGA_ERROR_FILE_CANNOT_READ, if it ended before the last row.
+        ///
+        bool finish();
+
+        ///
+        /// \brief The header, the ID field and the color map are read, so the
+        /// size and the format of the image are known.
+        ///
+        bool has_header() const;
+        bool is_done() const;
+        int get_rows_decoded() const;
+        ///
+        /// \brief Views the rows decoded so far: the top rows of the image if
+        /// the file stores them from the top, the bottom rows otherwise.
+        ///
+        ImageView get_decoded_view();
+        ///
+        /// \brief Gets the image being decoded, whose rows are undefined
+        /// until they are decoded.
+        ///
+        const Image &get_image() const;
+        ///
+        /// \brief Moves the image out, leaving the decoder empty until
+        /// reset().
+        ///
+        Image take_image();
+
+        tga_error last_error() const;
+        uint16_t get_width() const;
+        uint16_t get_height() const;
+        tga_pixel_format get_pixel_format() const;
 
     private:
-        std::vector<uint8_t> data;
-        tga_info img_info;
+        struct state;
+
+        std::unique_ptr<state> impl;
+        Image img;
         tga_error err{tga_error::TGA_NO_ERROR};
     };
-}
\ No newline at end of file
+
+    ///
+    /// \brief Options for BatchLoader.
+    ///
+    struct BatchOptions
+    {
+        LoadOptions load_options;
+        ///
+        /// \brief Number of threads reading files.
+        ///
+        unsigned io_thread_count{2};
+        ///
+        /// \brief Number of threads decoding, 0 uses all hardware threads.
+        ///
+        unsigned decode_thread_count{0};
+        ///
+        /// \brief Upper bound of the file contents read but not decoded yet.
+        /// A larger file is still read, once nothing else is in flight.
+        ///
+        size_t max_in_flight_bytes{64 * 1024 * 1024};
+    };
+
+    ///
+    /// \brief Loads many images at once, reading the next files on I/O threads
+    /// while the ones already read are decoded on a pool of decode threads.
+    ///
+    /// Each file is read whole, with positional reads, then decoded from memory
+    /// like Image::load_from_memory. Failures are reported by the
+    /// last_error() of the delivered image. The threads live as long as the
+    /// loader, which waits for all the batches it was given before it is
+    /// destroyed.
+    ///
+    class BatchLoader
+    {
+    public:
+        ///
+        /// \brief Receives each image with its position in the batch. It is
+        /// called on the decode threads, possibly concurrently.
+        ///
+        using Callback = std::function<void(size_t index, Image &&image)>;
+        using MemoryFile = std::pair<const uint8_t *, size_t>;
+
+        explicit BatchLoader(const BatchOptions &options = BatchOptions{});
+        ~BatchLoader();
+
+        BatchLoader(const BatchLoader &) = delete;
+        BatchLoader &operator=(const BatchLoader &) = delete;
+
+        std::vector<std::future<Image>> load(
+            const std::vector<std::string> &filepaths);
+        void load(const std::vector<std::string> &filepaths,
+                  Callback callback);
+        ///
+        /// \brief Decodes files already in memory, which must stay valid until
+        /// their image is delivered.
+        ///
+        std::vector<std::future<Image>> load(
+            const std::vector<MemoryFile> &buffers);
+        void load(const std::vector<MemoryFile> &buffers, Callback callback);
+
+        ///
+        /// \brief Waits until every image given so far is delivered.
+        ///
+        void wait();
+
+    private:
+        struct state;
+
+        std::unique_ptr<state> impl;
+    };
+
+    ///
+    /// \brief Counters of an ImageCache.
+    ///
+    struct ImageCacheStats
+    {
+        uint64_t hits{0};
+        uint64_t misses{0};
+        uint64_t evictions{0};
+        ///
+        /// \brief Bytes of pixels held by the cache.
+        ///
+        size_t bytes{0};
+        size_t entries{0};
+    };
+
+    ///
+    /// \brief Thread-safe cache of decoded images, shared read-only between
+    /// the callers.
+    ///
+    /// Images are keyed by path and load options, and are loaded again once
+    /// the size or the modification time of the file changes. The least
+    /// recently used images are dropped to stay within the byte budget,
+    /// which counts pixels only. Callers asking for an image another thread is
+    /// loading wait for that load instead of starting their own. Failed loads
+    /// are returned, with their last_error(), but not kept.
+    ///
+    class ImageCache
+    {
+    public:
+        explicit ImageCache(size_t max_bytes = 256 * 1024 * 1024);
+        ~ImageCache();
+
+        ImageCache(const ImageCache &) = delete;
+        ImageCache &operator=(const ImageCache &) = delete;
+
+        ///
+        /// \brief Gets the image, from the cache or else from the file. Never
+        /// returns nullptr.
+        ///
+        std::shared_ptr<const Image> get(
+            std::string_view filepath,
+            const LoadOptions &options = LoadOptions{});
+        ///
+        /// \brief Drops every image. Images still held by callers stay valid.
+        ///
+        void clear();
+
+        ImageCacheStats get_stats() const;
+        size_t get_max_bytes() const;
+
+    private:
+        struct state;
+
+        std::unique_ptr<state> impl;
+    };
+}